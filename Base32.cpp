@@ -8,127 +8,383 @@
 #include "Base32.h"
 #include "stdint.h"
 
+static const char base32Alphabet[33] PROGMEM = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
+
+// Character to its 5 bits: ' ', 0xA0, '\t', '\r', '\n' and '=' are skipped,
+// lower case is upper case, and '0', '1', '8' are read as 'O', 'L', 'B'
+static const byte base32Symbols[256] PROGMEM = {
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE, 0xFE, 0xFF, 0xFF, 0xFE, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0x0E, 0x0B, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F, 0x01, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE, 0xFF, 0xFF,
+  0xFF, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+  0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+  0x0F, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+// 8 symbols of 5 bits to 5 bytes
+static void base32Pack(const byte *v, byte *out)
+{
+  out[0] = (v[0] << 3) | (v[1] >> 2);
+  out[1] = (v[1] << 6) | (v[2] << 1) | (v[3] >> 4);
+  out[2] = (v[3] << 4) | (v[4] >> 1);
+  out[3] = (v[4] << 7) | (v[5] << 2) | (v[6] >> 3);
+  out[4] = (v[6] << 5) | v[7];
+}
+
+#ifdef BASE32_SIMD
+#include <immintrin.h>
+
+boolean Base32::useSimd = true;
+
+static boolean base32Ssse3()
+{
+  static int supported = -1;
+  if(supported < 0)
+    supported = __builtin_cpu_supports("ssse3");
+  return supported;
+}
+
+// 10 bytes to 16 characters; reads 16 bytes
+__attribute__((target("ssse3")))
+static void base32EncodeSimd(const byte *in, char *out)
+{
+  __m128i data = _mm_loadu_si128((const __m128i *)in);
+  // Character i of a group is in the 16 bits in[k] << 8 | in[k + 1], k
+  // the byte it starts in, at bit offset 0, 5, 2, 7, 4, 1, 6, 3. Shifting
+  // it down by 11 - offset is a multiplication by 2^(5 + offset) keeping
+  // the high half.
+  const __m128i first = _mm_setr_epi8(1, 0, 1, 0, 2, 1, 2, 1, 3, 2, 4, 3, 4, 3, -128, 4);
+  const __m128i second = _mm_setr_epi8(6, 5, 6, 5, 7, 6, 7, 6, 8, 7, 9, 8, 9, 8, -128, 9);
+  const __m128i shift = _mm_setr_epi16(32, 1024, 128, 4096, 512, 64, 2048, 256);
+  const __m128i mask = _mm_set1_epi16(0x1F);
+  __m128i a = _mm_and_si128(_mm_mulhi_epu16(_mm_shuffle_epi8(data, first), shift), mask);
+  __m128i b = _mm_and_si128(_mm_mulhi_epu16(_mm_shuffle_epi8(data, second), shift), mask);
+  __m128i index = _mm_packus_epi16(a, b);
+
+  // 0-25 are 'A'-'Z', 26-31 are '2'-'7'
+  __m128i c = _mm_add_epi8(index, _mm_set1_epi8('A'));
+  __m128i digit = _mm_cmpgt_epi8(index, _mm_set1_epi8(25));
+  c = _mm_sub_epi8(c, _mm_and_si128(digit, _mm_set1_epi8('A' + 26 - '2')));
+  _mm_storeu_si128((__m128i *)out, c);
+}
+
+// 16 characters to 10 bytes; false if they are not all plain Base32
+// characters (upper or lower case), then nothing is written
+__attribute__((target("ssse3")))
+static boolean base32DecodeSimd(const char *in, byte *out)
+{
+  __m128i c = _mm_loadu_si128((const __m128i *)in);
+  __m128i upper = _mm_and_si128(c, _mm_set1_epi8((char)0xDF));
+  __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(upper, _mm_set1_epi8('A' - 1)),
+      _mm_cmplt_epi8(upper, _mm_set1_epi8('Z' + 1)));
+  __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('2' - 1)),
+      _mm_cmplt_epi8(c, _mm_set1_epi8('7' + 1)));
+  if(_mm_movemask_epi8(_mm_or_si128(letter, digit)) != 0xFFFF)
+    return false;
+  __m128i v = _mm_or_si128(_mm_and_si128(letter, _mm_sub_epi8(upper, _mm_set1_epi8('A'))),
+      _mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('2' - 26))));
+
+  // Pairs of 5 bits to 10, pairs of those to 20; then per 64 bit lane the
+  // two halves of a group to 40 bits, and those bytes in big endian order
+  __m128i p = _mm_maddubs_epi16(v, _mm_set1_epi16(0x0120));
+  __m128i q = _mm_madd_epi16(p, _mm_set1_epi32(0x00010400));
+  __m128i group = _mm_or_si128(_mm_srli_epi64(_mm_slli_epi64(q, 44), 24), _mm_srli_epi64(q, 32));
+  __m128i bytes = _mm_shuffle_epi8(group,
+      _mm_setr_epi8(4, 3, 2, 1, 0, 12, 11, 10, 9, 8, -128, -128, -128, -128, -128, -128));
+  byte all[16];
+  _mm_storeu_si128((__m128i *)all, bytes);
+  memcpy(out, all, 10);
+  return true;
+}
+#endif
+
 Base32::Base32() 
 {
 }
 
-int Base32::toBase32(byte* in, long length, byte*& out)
+void Base32::encodeGroup(const byte *in, char *out)
 {
-  return toBase32(in, length, out, false);
+  byte index[8];
+  index[0] = in[0] >> 3;
+  index[1] = ((in[0] & 0x07) << 2) | (in[1] >> 6);
+  index[2] = (in[1] >> 1) & 0x1F;
+  index[3] = ((in[1] & 0x01) << 4) | (in[2] >> 4);
+  index[4] = ((in[2] & 0x0F) << 1) | (in[3] >> 7);
+  index[5] = (in[3] >> 2) & 0x1F;
+  index[6] = ((in[3] & 0x03) << 3) | (in[4] >> 5);
+  index[7] = in[4] & 0x1F;
+  for(byte k = 0; k < 8; k++)
+    out[k] = pgm_read_byte(base32Alphabet + index[k]);
 }
 
-int Base32::toBase32(byte* in, long length, byte*& out, boolean usePadding)
+// False if one of the 8 is not a symbol (a character to skip, or a bad
+// one); then nothing is written
+boolean Base32::decodeGroup(const char *in, byte *out)
 {
-  char base32StandardAlphabet[] = {"ABCDEFGHIJKLMNOPQRSTUVWXYZ234567"};
-  char standardPaddingChar = '='; 
+  byte v[8];
+  for(byte k = 0; k < 8; k++)
+  {
+    v[k] = symbol(in[k]);
+    if(v[k] > 0x1F)
+      return false;
+  }
+  base32Pack(v, out);
+  return true;
+}
 
-  int result = 0;
-  int count = 0;
-  int bufSize = 8;
-  int index = 0;
-  int size = 0; // size of temporary array
-  byte* temp = NULL;
+byte Base32::symbol(char c)
+{
+  return pgm_read_byte(base32Symbols + (byte)c);
+}
 
-  if (length < 0 || length > 268435456LL) 
-  { 
-    return 0;
+long Base32::encode(const byte *in, long length, char *out, boolean usePadding)
+{
+  long done = 0;
+  char *o = out;
+
+#ifdef BASE32_SIMD
+  if(useSimd && base32Ssse3())
+    for(; length - done >= 16; done += 10, o += 16)
+      base32EncodeSimd(in + done, o);
+#endif
+  for(; length - done >= 5; done += 5, o += 8)
+    encodeGroup(in + done, o);
+
+  long rest = length - done;
+  if(rest > 0)
+  {
+    byte last[5] = { 0, 0, 0, 0, 0 };
+    char chars[8];
+    memcpy(last, in + done, rest);
+    encodeGroup(last, chars);
+    byte n = (8 * rest + 4) / 5;
+    memcpy(o, chars, n);
+    o += n;
+    if(usePadding)
+      for(; n < 8; n++)
+        *o++ = '=';
   }
+  return o - out;
+}
 
-  size = 8 * ceil(length / 4.0); // Calculating size of temporary array. Not very precise.
-  temp = (byte*)malloc(size); // Allocating temporary array.
+long Base32::decode(const char *in, long length, byte *out)
+{
+  byte *o = out;
+  byte v[8];
+  byte count = 0; // symbols in v
+  long i = 0;
 
-  if (length > 0)
+  while(i < length)
   {
-    int buffer = in[0];
-    int next = 1;
-    int bitsLeft = 8;
-    
-    while (count < bufSize && (bitsLeft > 0 || next < length))
+    // Whole groups at once while there is nothing to skip
+    if(count == 0)
     {
-      if (bitsLeft < 5)
+#ifdef BASE32_SIMD
+      if(useSimd && (length - i >= 16) && base32Ssse3() && base32DecodeSimd(in + i, o))
       {
-        if (next < length)
-        {
-          buffer <<= 8;
-          buffer |= in[next] & 0xFF;
-          next++;
-          bitsLeft += 8;
-        }
-        else
-        {
-          int pad = 5 - bitsLeft;
-          buffer <<= pad;
-          bitsLeft += pad;
-        }
+        i += 16;
+        o += 10;
+        continue;
       }
-      index = 0x1F & (buffer >> (bitsLeft -5));
-
-      bitsLeft -= 5;
-      temp[result] = (byte)base32StandardAlphabet[index];
-      result++;
-    }
-  }
-  
-  if (usePadding)
-  {
-    int pads = (result % 8);
-    if (pads > 0)
-    {
-      pads = (8 - pads);
-      for (int i = 0; i < pads; i++) 
+#endif
+      if((length - i >= 8) && decodeGroup(in + i, o))
       {
-        temp[result] = standardPaddingChar;
-        result++;
+        i += 8;
+        o += 5;
+        continue;
       }
     }
+    byte s = symbol(in[i++]);
+    if(s == BASE32_BAD)
+      return -1;
+    if(s == BASE32_SKIP)
+      continue;
+    v[count++] = s;
+    if(count == 8)
+    {
+      base32Pack(v, o);
+      o += 5;
+      count = 0;
+    }
   }
+  // The bits of a last short group that make whole bytes
+  if(count > 0)
+  {
+    byte last[5];
+    for(byte k = count; k < 8; k++)
+      v[k] = 0;
+    base32Pack(v, last);
+    memcpy(o, last, 5 * count / 8);
+    o += 5 * count / 8;
+  }
+  return o - out;
+}
 
-  out = (byte*)malloc(result);
-  memcpy(out, temp, result);
-  free(temp);
-  
-  return result;
+int Base32::toBase32(byte* in, long length, byte*& out)
+{
+  return toBase32(in, length, out, false);
+}
+
+int Base32::toBase32(byte* in, long length, byte*& out, boolean usePadding)
+{
+  if (length < 0 || length > 268435456LL) 
+  { 
+    return 0;
+  }
+  out = (byte*)malloc(encodedLength(length, usePadding));
+  return encode(in, length, (char *)out, usePadding);
 }
 
 int Base32::fromBase32(byte* in, long length, byte*& out)
 {
-  int result = 0; // Length of the array of decoded values.
-  int buffer = 0;
-  int bitsLeft = 0;
-  byte* temp = NULL;
+  out = (byte*)malloc(decodedLength(length));
+  long result = decode((const char *)in, length, out);
+  if (result < 0)
+  {
+    free(out);
+    out = NULL;
+    return 0;
+  }
+  return result;
+}
 
-  temp = (byte*)malloc(length); // Allocating temporary array.
+Base32Encoder::Base32Encoder(Base32CharSink sink, void *context)
+  : sink(sink), context(context), used(0), outLen(0), total(0)
+{
+}
 
-  for (int i = 0; i < length; i++)
+void Base32Encoder::write(const byte *in, long length)
+{
+  // Complete the group left over from before
+  while(used > 0 && length > 0)
   {
-    byte ch = in[i];
+    group[used++] = *in++;
+    length--;
+    if(used == 5)
+    {
+      if(outLen == BASE32_CHUNK)
+        flush();
+      Base32::encodeGroup(group, out + outLen);
+      outLen += 8;
+      used = 0;
+    }
+  }
+  // Then as many whole groups at once as fit in the chunk
+  while(length >= 5)
+  {
+    if(outLen == BASE32_CHUNK)
+      flush();
+    long n = (BASE32_CHUNK - outLen) / 8 * 5;
+    if(n > length / 5 * 5)
+      n = length / 5 * 5;
+    outLen += Base32::encode(in, n, out + outLen);
+    in += n;
+    length -= n;
+  }
+  for(; length > 0; length--)
+    group[used++] = *in++;
+}
 
-    // ignoring some characters: ' ', '\t', '\r', '\n', '='
-    if (ch == 0xA0 || ch == 0x09 || ch == 0x0A || ch == 0x0D || ch == 0x3D) continue;
+unsigned long Base32Encoder::finish(boolean usePadding)
+{
+  if(used > 0)
+  {
+    if(outLen == BASE32_CHUNK)
+      flush();
+    outLen += Base32::encode(group, used, out + outLen, usePadding);
+    used = 0;
+  }
+  flush();
+  unsigned long written = total;
+  total = 0;
+  return written;
+}
 
-    // recovering mistyped: '0' -> 'O', '1' -> 'L', '8' -> 'B'
-    if (ch == 0x30) { ch = 0x4F; } else if (ch == 0x31) { ch = 0x4C; } else if (ch == 0x38) { ch = 0x42; }
-    
+void Base32Encoder::flush()
+{
+  if(outLen > 0)
+    sink(out, outLen, context);
+  total += outLen;
+  outLen = 0;
+}
 
-    // look up one base32 symbols: from 'A' to 'Z' or from 'a' to 'z' or from '2' to '7'
-    if ((ch >= 0x41 && ch <= 0x5A) || (ch >= 0x61 && ch <= 0x7A)) { ch = ((ch & 0x1F) - 1); }
-    else if (ch >= 0x32 && ch <= 0x37) { ch -= (0x32 - 26); }
-    else { free(temp); return 0; }
+Base32Decoder::Base32Decoder(Base32ByteSink sink, void *context)
+  : sink(sink), context(context), count(0), outLen(0), total(0)
+{
+}
 
-    buffer <<= 5;    
-    buffer |= ch;
-    bitsLeft += 5;
-    if (bitsLeft >= 8)
+boolean Base32Decoder::write(const char *in, long length)
+{
+  if(count == BASE32_BAD)
+    return false;
+  for(long i = 0; i < length; )
+  {
+    if(outLen == sizeof(out))
+      flush();
+    if((count == 0) && (length - i >= 8) && Base32::decodeGroup(in + i, out + outLen))
+    {
+      i += 8;
+      outLen += 5;
+      continue;
+    }
+    byte s = Base32::symbol(in[i++]);
+    if(s == BASE32_BAD)
     {
-      temp[result] = (unsigned char)((unsigned int)(buffer >> (bitsLeft - 8)) & 0xFF);
-      result++;
-      bitsLeft -= 8;
+      count = BASE32_BAD;
+      return false;
+    }
+    if(s == BASE32_SKIP)
+      continue;
+    symbols[count++] = s;
+    if(count == 8)
+    {
+      base32Pack(symbols, out + outLen);
+      outLen += 5;
+      count = 0;
     }
   }
+  return true;
+}
 
-  out = (byte*)malloc(result);
-  memcpy(out, temp, result);
-  free(temp);
+long Base32Decoder::finish()
+{
+  long written = -1;
+  if(count != BASE32_BAD)
+  {
+    if(count > 0)
+    {
+      if(outLen + 5 > (int)sizeof(out))
+        flush();
+      for(byte k = count; k < 8; k++)
+        symbols[k] = 0;
+      byte last[5];
+      base32Pack(symbols, last);
+      memcpy(out + outLen, last, 5 * count / 8);
+      outLen += 5 * count / 8;
+    }
+    flush();
+    written = total;
+  }
+  count = 0;
+  outLen = 0;
+  total = 0;
+  return written;
+}
 
-  return result;
+void Base32Decoder::flush()
+{
+  if(outLen > 0)
+    sink(out, outLen, context);
+  total += outLen;
+  outLen = 0;
 }
@@ -3,6 +3,19 @@
   Compatible with RFC 4648 ( http://tools.ietf.org/html/rfc4648 )
   Created by Vladimir Tarasow, December 18, 2012.
   Released into the public domain.
+
+  encode() and decode() work on buffers the caller provides, sized with
+  encodedLength() and decodedLength(); nothing is allocated. Both go
+  through the data 5 bytes / 8 characters at a time with lookup tables.
+  On the host build with an SSSE3 CPU, 10 bytes / 16 characters at a time
+  with SIMD instructions.
+  Decoding ignores whitespace and '=', takes lower case, and reads the
+  mistyped '0', '1' and '8' as 'O', 'L' and 'B'.
+
+  Base32Encoder and Base32Decoder do the same on a stream that arrives in
+  pieces of any size, in constant memory: they keep the partial group
+  between calls and hand their output to a sink function in chunks of up
+  to BASE32_CHUNK characters (or the bytes those make).
 */
 
 #ifndef Base32_h
@@ -11,13 +24,105 @@
 #include "Arduino.h"
 #include "stdint.h"
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#define BASE32_SIMD
+#endif
+
 class Base32
 {
   public:
     Base32();
+
+    // Characters for length bytes, with or without '=' padding to a
+    // multiple of 8
+    static constexpr long encodedLength(long length, boolean usePadding = false)
+    {
+      return usePadding ? 8 * ((length + 4) / 5) : (8 * length + 4) / 5;
+    }
+    // Bytes for at most length characters
+    static constexpr long decodedLength(long length)
+    {
+      return 5 * length / 8;
+    }
+
+    // Writes encodedLength(length, usePadding) characters, no terminating
+    // NUL; returns how many
+    static long encode(const byte *in, long length, char *out, boolean usePadding = false);
+    // Writes up to decodedLength(length) bytes; returns how many, -1 if
+    // there is a character that is not Base32
+    static long decode(const char *in, long length, byte *out);
+
+    // The whole groups: 5 bytes to 8 characters and back
+    static void encodeGroup(const byte *in, char *out);
+    static boolean decodeGroup(const char *in, byte *out);
+    // 0-31, BASE32_SKIP for characters to ignore, BASE32_BAD
+    static byte symbol(char c);
+
+    // Old interface: allocates out (to be freed by the caller)
     int toBase32(byte*, long, byte*&);
     int toBase32(byte*, long, byte*&, boolean);
     int fromBase32(byte*, long, byte*&);
+
+#ifdef BASE32_SIMD
+    // Off to measure the table kernels alone
+    static boolean useSimd;
+#endif
+};
+
+#define BASE32_SKIP 0xFE
+#define BASE32_BAD 0xFF
+
+// Characters per sink call, a multiple of 8
+#define BASE32_CHUNK 40
+
+typedef void (*Base32CharSink)(const char *chars, byte length, void *context);
+typedef void (*Base32ByteSink)(const byte *data, byte length, void *context);
+
+class Base32Encoder
+{
+  public:
+    Base32Encoder(Base32CharSink sink, void *context = NULL);
+
+    void write(const byte *in, long length);
+    void write(byte b) { write(&b, 1); }
+    // Encode what is left, with '=' padding if asked, and hand everything
+    // to the sink; returns the characters written in all. Starts over.
+    unsigned long finish(boolean usePadding = false);
+
+  private:
+    void flush();
+
+    Base32CharSink sink;
+    void *context;
+    byte group[5];
+    byte used; // bytes in group
+    char out[BASE32_CHUNK];
+    byte outLen;
+    unsigned long total;
+};
+
+class Base32Decoder
+{
+  public:
+    Base32Decoder(Base32ByteSink sink, void *context = NULL);
+
+    // False once there was a character that is not Base32; the rest of
+    // the stream is then ignored
+    boolean write(const char *in, long length);
+    // Hand the sink what is left; returns the bytes written in all, -1
+    // after a bad character. Starts over.
+    long finish();
+
+  private:
+    void flush();
+
+    Base32ByteSink sink;
+    void *context;
+    byte symbols[8];
+    byte count; // symbols in the group, BASE32_BAD after an error
+    byte out[BASE32_CHUNK * 5 / 8];
+    byte outLen;
+    unsigned long total;
 };
 
 #endif
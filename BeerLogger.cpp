@@ -9,6 +9,12 @@
 #include <DallasTemperature.h>
 #include "SD.h"
 #include <SPI.h>
+#include "HistoryBuffer.h"
+#include "BlockCache.h"
+#include "SerialLink.h"
+#include "ShadowLcd.h"
+#include "PowerSave.h"
+#include <EEPROM.h>
 
 
 /// Liquid sensor
@@ -47,53 +53,69 @@ enum UiResults {
 	RET_CONTINUE
 };
 
-// I'd like to have a better way to define this. Right now it's a bit murky
-#define UI_TARGET_NUM 6
+// The pages, in uiPages order (see UI pages)
 enum UiTargets {
 	UIT_TEMP_DISPLAY = 0,
-	UIT_LOGGER_SETTINGS = 1,
-	UIT_MESSAGE = 2,
-	UIT_THERMOSTAT_SETTINGS = 3,
-	UIT_THERMOSTAT_MODE = 4,
-	UIT_LOAD_STORE_SETTINGS = 5,
-	UIT_DUMMY = -1
-};
-
-/// UI handler
-// Returns:
-// true if the UI leaves, false if it stays
-// takes as parameter:
-// int: the UiAction
-// void *: a pointer to a custom "static structure" containing the UI state
-typedef int (* UiTarget) (int);
-volatile UiTarget uiTargets[UI_TARGET_NUM] = {
-		&uiTempDisplay,
-		&uiLoggerSettings,
-		&uiMessage,
-		&uiThermostatSettings,
-		&uiThermostatMode,
-		&uiLoadStoreSettings,
-};
-int uiTargetContinueMap[UI_TARGET_NUM] = {
-		UIT_LOGGER_SETTINGS, // from UIT_TEMP_DISPLAY
-		UIT_THERMOSTAT_SETTINGS, // from UIT_LOGGER_SETTINGS
-		UIT_DUMMY, // from UIT_MESSAGE (because it always returns RET_HOME)
-		UIT_THERMOSTAT_MODE, // from UIT_THERMOSTAT_SETTINGS
-		UIT_LOAD_STORE_SETTINGS, // from UIT_THERMOSTAT_MODE
-		UIT_TEMP_DISPLAY, // from UIT_LOAD_STORE_SETTINGS
-
+	UIT_LOGGER_SETTINGS,
+	UIT_MESSAGE,
+	UIT_THERMOSTAT_SETTINGS,
+	UIT_THERMOSTAT_MODE,
+	UIT_LOAD_STORE_SETTINGS,
+	UIT_STATISTICS,
+#if DIAGNOSTICS
+	UIT_DIAGNOSTICS,
+#endif
+	UIT_PAGES_NO,
+	UIT_DUMMY = -1,
+	UIT_NEXT = -2, // from a page's apply(): on as usual
+	UIT_STAY = -3 // from a page's apply(): stay on the same field
 };
 
 volatile int uiTarget;
 
 /// Rotary encoder
-static boolean rotating=false;      // debounce management
+// Decoded from the Gray code of both pins, (A << 1) | B: each move from one
+// state to a neighbouring one counts a quarter detent up or down, and a
+// detent is taken when the encoder is back at rest (both high) after at
+// least half of one. A bouncing contact goes back and forth and adds up to
+// nothing; two pins changing at once (a missed edge) count neither way.
+#define ENCODER_REST 3
+const int8_t encoderSteps[16] PROGMEM = {
+		// to 00, 01, 10, 11
+		 0, -1, +1,  0, // from 00
+		+1,  0,  0, -1, // from 01
+		-1,  0,  0, +1, // from 10
+		 0, +1, -1,  0, // from 11
+};
+// Acceleration: a detent ENCODER_ACCEL_MS / n after the last one in the
+// same direction counts n times, up to ENCODER_STEPS_MAX
+#define ENCODER_ACCEL_MS 100
+#define ENCODER_STEPS_MAX 10
 // Rotary encoder: interrupt service routine vars
-boolean A_set = false;
-boolean B_set = false;
+volatile byte encoderState = ENCODER_REST;
+volatile int8_t encoderCount = 0; // quarter detents since the last rest
+volatile unsigned long encoderLastMs = 0;
+volatile int8_t encoderLastDir = 0;
+// Detents of the action handleUi() is working on
+byte uiEncoderSteps = 1;
+
+/// Input queue
+// UiActions from the interrupt handlers, handled by loop(). The handlers
+// only ever run one at a time, so this is a single producer/single consumer
+// ring: inputHead is only written by the handlers, inputTail only by loop().
+// The high nibble of an encoder action is its uiEncoderSteps.
+#define INPUT_QUEUE_SIZE 16 // must be a power of two
+#define INPUT_ACTION_MASK 0x0F
+#define INPUT_STEPS_SHIFT 4
+volatile byte inputQueue[INPUT_QUEUE_SIZE];
+volatile byte inputHead = 0;
+volatile byte inputTail = 0;
+volatile byte inputOverflows = 0;
 
 /// LCD
-LiquidCrystal lcd(51, 53, 40, 38, 36, 34);
+LiquidCrystal lcdDisplay(51, 53, 40, 38, 36, 34);
+// The UI draws into this; fpUpdateScreen() sends what changed to lcdDisplay
+ShadowLcd lcd(lcdDisplay);
 
 /// RTC
 RTC_DS1307 RTC;
@@ -102,115 +124,531 @@ RTC_DS1307 RTC;
 /// Software
 String message = "";
 
+// Seconds between samples, between control passes (0: after every
+// sample) and between log rows. A log row is the mean of the samples
+// taken since the one before.
+volatile int sampleInterval = 10;
+volatile int controlInterval = 0;
 volatile int logInterval = 10;
+// Also log each channel's minimum and maximum of the log period
+boolean logMinMax = false;
+// Longest time (s) a logged sample may sit in the SD library's block cache
+volatile int logFlushInterval = 60;
+// How often (s) the zones in THERMOSTAT_PID mode are updated
+volatile int pidInterval = 10;
+// Keeps ki * error * dt of pidUpdate() within 32 bits
+#define PID_INTERVAL_MAX 300
+
+enum logFormats {
+	LOG_TEXT = 0, // .TXT, one "unixtime;t0;t1;...;relay" line per row
+	LOG_BINARY = 1, // .BIN, fixed width records (see writeLogBinary)
+};
+int logFormat = LOG_TEXT;
+
+/// Log files
+// Rows go to LOG/YYYYMMDD.TXT (or .BIN), one file per day of the row's
+// timestamp. A file that grows past logRotateKB is continued in .T01 (.B01),
+// .T02 and so on. So the file being appended to stays small and opening
+// it does not walk a FAT chain of months.
+// LOG/INDEX.BIN has an entry where each file starts and then at least one
+// every LOG_INDEX_INTERVAL seconds of rows, each saying which file and
+// offset the rows from that time on are at. logIndexFind() looks a time up
+// with a binary search over it.
+#define LOG_DIR "LOG"
+#define LOG_INDEX_FILE "LOG/INDEX.BIN"
+#define LOG_INDEX_INTERVAL 3600
+// time, date (YYYYMMDD), offset: uint32 each, then part, format, 0, CRC8
+#define LOG_INDEX_ENTRY_SIZE 16
+#define LOG_PARTS_MAX 99
+int logRotateKB = 1024; // 0: one file per day, whatever its size
+uint32_t logFileDay = 0; // unixtime / 86400 of the open file
+uint32_t logFileDate = 0; // YYYYMMDD of the open file, 0: none open
+byte logFilePart = 0;
+uint32_t logIndexLast = 0; // time of the last index entry
+uint32_t logLastTime = 0; // time of the last row in the open file
+boolean logFileMinMax = false; // logMinMax the open file's rows were written with
 
 typedef void (* ScheduleFP)(void);
 
-#define SCHEDULE_EVENTS_NO 7
-
+// To add an event: add it here (before SCHEDULE_EVENTS_NO) and add its
+// entry to each of the tables below
 enum scheduleEvents {
   updateScreen = 0,
   cycle = 1,
-  clearDebounce = 2,
-  manageSD = 3,
-  settingsLoad = 4,
-  settingsStore = 5,
+  manageSD = 2,
+  settingsLoad = 3,
+  settingsStore = 4,
+  readSensors = 5,
+  flushLog = 6,
+  pidControl = 7,
+  controlZones = 8,
+  logRow = 9,
+  SCHEDULE_EVENTS_NO
   };
 
+// Period after which the event is repeated, -1: run once
 volatile long scheduleTime[SCHEDULE_EVENTS_NO] =
 {
   2000,
-  1000 * logInterval,
-  0,
+  1000L * sampleInterval,
   -1,
   -1,
   -1,
+  -1,
+  1000L * logFlushInterval,
+  1000L * pidInterval,
+  -1, // 1000 * controlInterval when set
+  1000L * logInterval,
 };
 
-boolean scheduleActive[SCHEDULE_EVENTS_NO] =
-{
-   true,
-   true,
-   false,
-   true,
-   false,
-   false,
-};
-
+// Startup schedule:
 // 0: trigger on start
 // 1+: trigger after n ms
 // -1: do not trigger in start schedule
+// Afterwards: the deadline (millis()) of the event while it is queued
 unsigned long scheduleTarget[SCHEDULE_EVENTS_NO] =
 {
   0,
   0,
-  -1,
   0, // init SD on startup
   -1,
   -1,
+  -1,
+  1000L * logFlushInterval,
+  1000L * pidInterval,
+  -1,
+  1000L * logInterval,
   };
 
+// Requests from scheduleEvent() (possibly from interrupt context) that
+// loop() has not yet moved into the queue
 volatile long scheduleCommand[SCHEDULE_EVENTS_NO] =
 {
-  -1,-1,-1,-1,-1,-1
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1
   };
 
 ScheduleFP scheduleFunc[SCHEDULE_EVENTS_NO] =
 {
   &fpUpdateScreen,
   &fpCycle,
-  &fpClearDebounce,
   &fpManageSD,
   &fpSettingsLoad,
   &fpSettingsStore,
+  &fpReadSensors,
+  &fpFlushLog,
+  &fpPidControl,
+  &fpControl,
+  &fpLogRow,
   };
 
 volatile boolean eventsExecuted[SCHEDULE_EVENTS_NO] =
 {
-  false,false,false,false,false,false
+  false,false,false,false,false,false,false,false,false,false
   };
-
-
-volatile byte screenPos = 0;
-byte lastWrite = 0;
-byte bufferPos = 0;
+volatile boolean scheduleChanged = false;
+
+// Queued events as a binary min-heap on scheduleTarget, so loop() only
+// ever looks at the top to find the next deadline
+byte scheduleHeap[SCHEDULE_EVENTS_NO];
+byte scheduleHeapSize = 0;
+// Position of each event in scheduleHeap, -1 if not queued
+char scheduleHeapIndex[SCHEDULE_EVENTS_NO];
+
+/// Diagnostics
+// How long each scheduler event runs (and writeLog() and SD.open() besides):
+// count, minimum, mean, maximum and a histogram, and how often an event
+// ran more than DIAG_LATE_MS after its deadline; also the encoder steps
+// that were lost. Since the statistics were reset. Shown on the
+// diagnostics page and written to DIAG_FILE every hour. See DIAGNOSTICS.
+#if DIAGNOSTICS
+#define DIAG_BUCKETS 8 // < 64 us, < 256 us, ... (times 4), the rest
+#define DIAG_LATE_MS 10
+#define DIAG_FILE LOG_DIR "/DIAG.TXT"
+#define DIAG_DUMP_INTERVAL 3600 // s
+enum DiagSlots {
+	DIAG_WRITE_LOG = SCHEDULE_EVENTS_NO, // the events come first
+	DIAG_SD_OPEN,
+	DIAG_SLOTS_NO
+};
+const char * const diagNames[DIAG_SLOTS_NO] = {
+	"screen", "cycle", "manageSD", "setLoad", "setStore", "sensors",
+	"flush", "pid", "control", "logRow", "writeLog", "SD.open"
+};
+struct DiagTimes {
+	unsigned long count;
+	uint64_t sumUs;
+	unsigned long minUs, maxUs;
+	unsigned long late;
+	uint16_t buckets[DIAG_BUCKETS]; // stop at 65535
+};
+DiagTimes diagTimes[DIAG_SLOTS_NO];
+volatile unsigned long diagBounces = 0; // encoder edges taken for bounces
+uint32_t diagLastDump = 0;
+#define DIAG_START() unsigned long diagStartUs = micros()
+#define DIAG_STOP(slot) diagAdd(slot, micros() - diagStartUs)
+#define DIAG_LATE(slot, ms) if((ms) > DIAG_LATE_MS) diagTimes[slot].late++
+#define DIAG_BOUNCE() diagBounces++
+#else
+#define DIAG_START()
+#define DIAG_STOP(slot)
+#define DIAG_LATE(slot, ms)
+#define DIAG_BOUNCE()
+#endif
+
+
+// Log rows are numbered by bufferPos (wrapping); screenPos is how many
+// rows back from the newest the screen shows, 0 is live
+volatile unsigned int screenPos = 0;
+unsigned int lastWrite = 0;
+unsigned int bufferPos = 0;
 boolean liveWrite = true;
 boolean startupSettingsLoaded = false;
 File logfile;
 
-#define SENSOR_COUNT 2
-float dataBuffer[256][SENSOR_COUNT];
-DateTime tsBuffer[256];
-
-float thermostatSettings[4] = {
-		0, // target temperature
-		1, // target temperature window
-		0, // temperature undershoot
-		0, // temperature overshoot
+/// Temperature sensors
+// Sensors are found on the bus at startup and put on channels, which is
+// how the log, the screen and the settings (sensor0=<address>,
+// sensorRes0=<bits>) refer to them. A sensor that has no channel yet gets
+// the first free one; the mapping is then stored with the settings, so
+// swapping or adding a probe needs no recompile.
+#define SENSOR_MAX 4
+#define SENSOR_RES_DEFAULT 12
+DeviceAddress sensorAddress[SENSOR_MAX]; // all zero: channel unused
+// The probes the logger had built in. When they are on the bus and have no
+// channel yet they get their old ones, 0 (air) and 1 (liquid), which the
+// zones' defaults control with.
+const DeviceAddress sensorBuiltIn[2] = {
+  { 0x28, 0xFF, 0xA9, 0x02, 0x64, 0x14, 0x03, 0x81 },
+  { 0x28, 0xA2, 0x8C, 0x97, 0x05, 0x00, 0x00, 0x94 },
+};
+byte sensorResolution[SENSOR_MAX];
+boolean sensorPresent[SENSOR_MAX]; // found on the bus
+byte sensorCount = 0; // channels in use (highest used channel + 1)
+int sensorWaitMs = 750; // conversion time of the slowest sensor
+// With more than two channels the main screen shows them in pairs, each
+// pair for this long
+#define SENSOR_PAGE_MS 4000
+#define LOG_RECORD_SIZE(values) (7 + 2 * (values))
+// Set in the length byte of binary records with mean, min and max
+#define LOG_RECORD_MINMAX 0x80
+// About 3 KB of RAM, however many channels there are: 307 samples of
+// 10 bytes with SENSOR_MAX 4 (the float buffer had 256 of 14 bytes)
+#define HISTORY_SIZE (3072 / (2 + 2 * SENSOR_MAX))
+HistoryBuffer<HISTORY_SIZE, SENSOR_MAX> history;
+
+/// History view
+// Scrolling back past the oldest row in RAM goes on with the rows in the
+// log files on the card (cardView), found through the log index and read
+// through a small block cache. The encoder switch, while scrolled back,
+// changes the step between a row, an hour and a day.
+struct LogRow {
+	uint32_t time;
+	uint32_t offset; // in cardName
+	byte length; // bytes, with the line end
+	byte channels;
+	int16_t centi[SENSOR_MAX];
+};
+enum scrollSteps {
+	SCROLL_ROW = 0,
+	SCROLL_HOUR,
+	SCROLL_DAY,
+	SCROLL_STEPS_NO
+};
+const uint32_t scrollStepSeconds[SCROLL_STEPS_NO] = { 0, 3600UL, 86400UL };
+const char scrollStepMark[SCROLL_STEPS_NO] = { ' ', 'h', 'd' };
+byte scrollStep = SCROLL_ROW;
+boolean cardView = false;
+LogRow cardRow;
+File cardFile;
+char cardName[20] = "";
+// Longest text row looked at
+#define LOG_ROW_TEXT_MAX 128
+// 512 bytes of RAM; two blocks so that a row across a block boundary
+// does not read the card twice
+BlockCache<2, 256> cardCache;
+// Text files: values per channel and offset of the first row, from the
+// header line (see logHeader()); files without one have a value each
+byte cardStride = 1;
+uint32_t cardStart = 0;
+
+/// Log journal
+// A power cut loses the rows still in the SD library's block cache, and
+// can leave the file with a torn row at its end (see logOpenFor()). So
+// every new row also goes to the EEPROM, in the slot seq % JOURNAL_SLOTS:
+// seq, unixtime, the channels' 1/100 degC, relays, CRC8. The sequence
+// number tells the newest slot, the CRC one that the cut caught halfway.
+// logRecover() logs the rows the card does not have. The AVR's brown-out
+// detector resets without a warning to save anything in, hence a row at a
+// time: some 6 changed bytes at 3.3 ms each, and each slot is written every
+// JOURNAL_SLOTS rows (38 min at logInterval=10, 7 years of 100000 cycles).
+#define JOURNAL_SLOT_SIZE (10 + 2 * SENSOR_MAX)
+#define JOURNAL_SLOTS ((E2END + 1) / JOURNAL_SLOT_SIZE)
+struct JournalRow {
+	uint32_t seq;
+	uint32_t time;
+	int16_t centi[SENSOR_MAX];
+	byte relays;
 };
+uint32_t journalSeq = 0; // of the next row
+boolean logRecoverPending = false; // card just begun, settings not loaded
+
+/// Serial link
+// A host talks to the logger over Serial in the frames of SerialLink.h:
+// status, settings, live samples and log downloads. Nothing in it waits
+// for the UART: loop() calls serialProcess(), which answers a request or
+// queues the next frame only when the last one has been handed over.
+#define SERIAL_BAUD 115200
+SerialLink serialLink(Serial);
+boolean linkSubscribed = false;
+boolean linkSamplePending = false;
+// Log download: the raw bytes of the log files, from where the index
+// has the start of the range to where it has its end
+boolean linkDownload = false;
+byte linkSeq;
+File linkFile;
+char linkName[20];
+uint32_t linkOffset;
+uint32_t linkEntryTime; // of the index entry linkName was started at
+char linkEndName[20]; // "": to the end of the log
+uint32_t linkEndOffset;
+int linkEnd = -1; // LINK_END status still to send
+
+/// Power saving
+// While the scheduler waits the MCU sleeps (see PowerSave.h): powered down
+// when the wait is long enough and the serial port has been quiet for a
+// while, idle otherwise. A request that comes in while it is powered down
+// wakes it, but is lost with the UART's clock stopped; the host tries
+// again, and gets an answer since there is no power down for
+// POWER_SERIAL_QUIET_MS after any serial traffic.
+#define POWER_DOWN_MIN_MS 32 // shorter waits only idle
+#define POWER_SERIAL_QUIET_MS 10000UL
+#define POWER_CALIBRATE_MS 3600000UL // the watchdog is measured this often
+#define SERIAL_RX_PIN 0
+enum PowerModes {
+	POWER_BUSY, // delay(), as without power saving
+	POWER_IDLE,
+	POWER_DOWN
+};
+byte powerMode = POWER_DOWN; // the deepest one allowed
+unsigned long serialLastMs = 0; // last serial traffic
+volatile boolean serialWoke = false;
+boolean powerCalibrated = false;
+unsigned long powerCalibratedMs = 0;
+// Time asleep since the statistics were reset, and in all (powerCount())
+unsigned long powerTotalMs = 0;
+unsigned long powerCountedMs = 0; // millis() when powerTotalMs was counted up
+unsigned long powerIdleMs = 0;
+unsigned long powerIdleUs = 0; // not yet in powerIdleMs
+unsigned long powerDownMs = 0;
+
+/// Samples
+// The newest and the one before, 1/100 degC, for control and the screen
+int16_t sampleCenti[SENSOR_MAX];
+int16_t samplePrevCenti[SENSOR_MAX];
+uint32_t sampleTime = 0;
+uint32_t samplePrevTime = 0;
+unsigned long samplesTaken = 0;
+// Running sum, minimum and maximum per channel of the samples since the
+// last log row; disconnected readings are left out
+struct SampleStats {
+	long sum;
+	int count;
+	int16_t min, max;
+};
+SampleStats periodStats[SENSOR_MAX];
+// Minimum and maximum of the newest log row (the history has the mean)
+int16_t rowMin[SENSOR_MAX];
+int16_t rowMax[SENSOR_MAX];
+
 enum thermostatModes {
 	THERMOSTAT_OFF = 0,
 	THERMOSTAT_HEAT = 1,
 	THERMOSTAT_COOL = 2,
 	THERMOSTAT_ON = 3,
+	THERMOSTAT_PID = 4,
+	THERMOSTAT_MODES_NO
 };
-volatile int thermostatMode = THERMOSTAT_OFF;
 
 #define RELAY_PIN 44
 #define RELAY_PIN_2 46
-bool relayState = false;
-int relayStartupDelay = 3;
 
+/// Thermostat zones
+// Each zone controls its own relay from a sensor channel (the liquid) and,
+// for cooling, optionally a second one (the air around it). Zones are
+// set up in the settings: zones=<number in use>, and per zone the same
+// keys as the channels take, e.g. tempTarget1=18.0, zoneSensor1=2,
+// zoneAir1=-1. Without a number a key means zone 0.
+#define ZONE_MAX 2
+struct ThermostatZone {
+	int16_t settings[4]; // 1/100 degC: target, window, undershoot, overshoot
+	int mode;
+	int liquid; // channel
+	int air; // channel, -1: none
+	// THERMOSTAT_PID, see fpPidControl(). Gains are integers: output in
+	// 1/1000 of the relay window per degC of error (kp), per degC and hour
+	// (ki) and per degC/min of change (kd).
+	int kp, ki, kd;
+	int pidWindow; // s
+	int pidMinOn, pidMinOff; // s, to protect compressors
+	boolean pidCool; // the relay cools instead of heats
+	boolean relayState;
+	boolean cooling;
+	boolean pidActive;
+	long pidIntegral; // ki * error * s, see pidUpdate()
+	int pidOutput; // 0..1000
+	unsigned long pidWindowStart;
+	unsigned long pidLastSwitch;
+	unsigned long pidLastUpdate;
+};
+// Settings, then the run time state from relayState on
+ThermostatZone zones[ZONE_MAX] = {
+		{ { 0, 100, 0, 0 }, THERMOSTAT_OFF, 1, 0, 1000, 200, 0, 600, 60, 180, false,
+				false, false, false, 0, 0, 0, 0, 0 },
+		{ { 0, 100, 0, 0 }, THERMOSTAT_OFF, 1, 0, 1000, 200, 0, 600, 60, 180, false,
+				false, false, false, 0, 0, 0, 0, 0 },
+};
+const byte zoneRelayPins[ZONE_MAX] = { RELAY_PIN, RELAY_PIN_2 };
+int zoneCount = 1;
+// Relays that are on, bit n for zone n; this is what the log shows
+byte relayOutputs = 0;
+// Zone the thermostat pages of the UI work on
+int uiZone = 0;
+
+/// Statistics
+// Shown on the statistics page. Minimum, maximum, mean and relay duty are
+// since the last reset, the rate of change and the "last hour" duty are
+// running averages. Everything is updated in O(1) per sample (channels) or
+// per relay update (zones).
+#define STATS_TAU 3600 // s, time constant of the running averages
+struct ChannelStats {
+	int64_t sum;
+	unsigned long count;
+	int16_t min, max;
+	long rate; // 1/100 degC per hour, times 1024
+};
+ChannelStats channelStats[SENSOR_MAX];
+struct ZoneStats {
+	unsigned long onSeconds;
+	unsigned long seconds;
+	long duty; // 1/1000, times 1024
+};
+ZoneStats zoneStats[ZONE_MAX];
+uint32_t statsSince = 0; // unixtime of the last reset
+unsigned long statsLastMs = 0;
+unsigned long statsCarryMs = 0; // not yet counted in the zone seconds
+
+/// Settings file
+// Keys of settings.txt. settingNames must stay sorted (strcmp order) for
+// the binary search in settingFind(); this is checked at compile time.
+enum settingKeys {
+	SET_CONTROL_INTERVAL,
+	SET_LOG_FLUSH,
+	SET_LOG_FORMAT,
+	SET_LOG_INTERVAL,
+	SET_LOG_MIN_MAX,
+	SET_LOG_ROTATE,
+	SET_PID_COOL,
+	SET_PID_INTERVAL,
+	SET_PID_KD,
+	SET_PID_KI,
+	SET_PID_KP,
+	SET_PID_MIN_OFF,
+	SET_PID_MIN_ON,
+	SET_PID_WINDOW,
+	SET_POWER_SAVE,
+	SET_SAMPLE_INTERVAL,
+	SET_SENSOR,
+	SET_SENSOR_RES,
+	SET_TEMP_OVERSHOOT,
+	SET_TEMP_RANGE,
+	SET_TEMP_TARGET,
+	SET_TEMP_UNDERSHOOT,
+	SET_THERMOSTAT_MODE,
+	SET_ZONE_AIR,
+	SET_ZONE_SENSOR,
+	SET_ZONES,
+	SETTING_KEYS_NO
+};
+constexpr const char *settingNames[SETTING_KEYS_NO] = {
+		"controlInterval",
+		"logFlush",
+		"logFormat",
+		"logInterval",
+		"logMinMax",
+		"logRotateKB",
+		"pidCool",
+		"pidInterval",
+		"pidKd",
+		"pidKi",
+		"pidKp",
+		"pidMinOff",
+		"pidMinOn",
+		"pidWindow",
+		"powerSave", // 0: never sleep, 1: idle only, 2: power down too
+		"sampleInterval",
+		"sensor", // per channel: sensor0, sensor1, ...
+		"sensorRes",
+		"tempOvershoot",
+		"tempRange",
+		"tempTarget",
+		"tempUndershoot",
+		"thermostatMode",
+		"zoneAir",
+		"zoneSensor",
+		"zones",
+};
 
-#define DEBOUNCE_DELAY 400
-volatile boolean debouncing = false;
+constexpr int settingNameCompare(const char *a, const char *b)
+{
+	return ((*a != *b) || (*a == 0)) ? (*a - *b) : settingNameCompare(a + 1, b + 1);
+}
+constexpr boolean settingNamesSorted(int n)
+{
+	return (n + 1 >= SETTING_KEYS_NO) ||
+			((settingNameCompare(settingNames[n], settingNames[n + 1]) < 0) &&
+					settingNamesSorted(n + 1));
+}
+static_assert(settingNamesSorted(0), "settingNames must be sorted");
+
+const char * const settingsSlotNames[2] = { "settings.a", "settings.b" };
+int settingsSlot = -1; // slot the current settings came from / went to
+unsigned long settingsVersion = 0;
+
+// Results of the last settingsParse()
+int settingsBad = 0;
+int settingsBadLine = 0;
+unsigned long settingsFileVersion = 0;
+boolean settingsChecked = false; // ends with a [crc=] entry that matches
+
+#define SETTINGS_WRITE_BLOCK 32
+// Settings being stored: collected in buf and written to file when it is
+// full; crc covers what has been written so far. With window set they go
+// to RAM instead, only the bytes from skip on and as many as fit.
+struct SettingsWriter {
+	File file;
+	char buf[SETTINGS_WRITE_BLOCK];
+	byte len;
+	uint16_t crc;
+	byte *window;
+	uint16_t skip;
+	byte windowLen, windowMax;
+};
+SettingsWriter settingsOut;
+
+#define SETTINGS_READ_BLOCK 32
+#define SETTING_NAME_MAX 15
+#define SETTING_VALUE_MAX 23
+enum settingParseStates {
+	PARSE_SEEK, // looking for '['
+	PARSE_NAME, // up to '='
+	PARSE_VALUE, // up to ']'
+};
 
-#define LOOP_DELAY 40
-const boolean delayLoop = true;
+int relayStartupDelay = 3;
 
 
-DeviceAddress temp1 = { 0x28, 0xA2, 0x8C, 0x97, 0x05, 0x00, 0x00, 0x94 };
-DeviceAddress temp2 = { 0x28, 0xFF, 0xA9, 0x02, 0x64, 0x14, 0x03, 0x81 };
+#define DEBOUNCE_DELAY 400
+volatile unsigned long lastButtonPress = 0;
 
 void setup() {
   // put your setup code here, to run once:
@@ -224,17 +662,19 @@ void setup() {
 //  digitalWrite(fake5v, HIGH);
 //  digitalWrite(fakeGnd, LOW);
 
-  pinMode(RELAY_PIN, OUTPUT);
-  pinMode(RELAY_PIN_2, OUTPUT);
-  digitalWrite(RELAY_PIN, HIGH);
-  digitalWrite(RELAY_PIN_2, HIGH);
+  // Relays are active low
+  for(int z = 0; z < ZONE_MAX; z++)
+  {
+    pinMode(zoneRelayPins[z], OUTPUT);
+    digitalWrite(zoneRelayPins[z], HIGH);
+  }
 
-  // encoder pin on PCE (pin a)
+  // encoder pins on PCE (pin a and b)
+  encoderState = (digitalRead(encoderPinA) << 1) | digitalRead(encoderPinB);
   attachPinChangeInterrupt(
-		  digitalPinToPinChangeInterrupt(encoderPinA), doEncoderA, CHANGE);
-  // encoder pin on PCE (pin b)
+		  digitalPinToPinChangeInterrupt(encoderPinA), doEncoder, CHANGE);
   attachPinChangeInterrupt(
-		  digitalPinToPinChangeInterrupt(encoderPinB), doEncoderB, CHANGE);
+		  digitalPinToPinChangeInterrupt(encoderPinB), doEncoder, CHANGE);
 
   attachPinChangeInterrupt(
 		  digitalPinToPinChangeInterrupt(encoderSW), doEncSw, RISING);
@@ -242,70 +682,253 @@ void setup() {
 		  digitalPinToPinChangeInterrupt(clearButton), doClearButton, RISING);
 
 
+  /// Serial link
+  Serial.begin(SERIAL_BAUD);
+
   /// RTC
   Wire.begin();
   RTC.begin();
 
   /// LCD
-  lcd.begin(16, 2);  // set up the LCD's number of columns and rows:
+  lcdDisplay.begin(16, 2);  // set up the LCD's number of columns and rows:
+  lcd.begin();
 
-  /// Liquid sensor
-  sensors.begin(); // IC Default 9 bit. If you have troubles consider upping it 12. Ups the delay giving the IC more time to process the temperature measurement
+  /// Temperature sensors
+  // Don't block in requestTemperatures(), fpCycle() schedules the read instead
+  sensors.setWaitForConversion(false);
+  for(int c = 0; c < SENSOR_MAX; c++)
+    sensorResolution[c] = SENSOR_RES_DEFAULT;
+  sensorsDiscover();
 
-  /// Software: Init buffer to 0
-  DateTime ts = RTC.now();
-  for(int n1=0; n1<256; n1++){
-    tsBuffer[n1] = ts;
-    for(int n2=0; n2<SENSOR_COUNT; n2++)
-      dataBuffer[n1][n2] = 0;
-  }
+  /// Log journal
+  journalBegin();
 
+  /// Software: Queue the startup schedule
+  unsigned long ms = millis();
+  for(int n=0; n<SCHEDULE_EVENTS_NO; n++)
+  {
+    scheduleHeapIndex[n] = -1;
+    if(scheduleTarget[n] != (unsigned long)-1)
+      scheduleQueue(n, ms + scheduleTarget[n]);
+  }
 }
 
 void loop() {
-  /// Rotary encoder
-  rotating = true;
   // put your main code here, to run repeatedly:
 
+  /// Input: handle what the interrupt handlers queued
+  inputProcess();
+  serialProcess();
+
+  // Scheduler: execute due events in deadline order
+  scheduleApplyCommands();
+  while((scheduleHeapSize > 0) &&
+		  ((long)(millis() - scheduleTarget[scheduleHeap[0]]) >= 0))
+  {
+    int n = scheduleHeap[0];
+    unsigned long due = scheduleTarget[n];
+    DIAG_LATE(n, millis() - due);
+    scheduleRemove(n);
+    DIAG_START();
+    (scheduleFunc[n])();
+    DIAG_STOP(n);
+    // The next one from this deadline, not from now, so that events of the
+    // same period (sampling and logging) keep their phase however long each
+    // takes; after falling a whole period behind, from now
+    if(scheduleTime[n] > 0)
+    {
+      long late = millis() - due;
+      scheduleEvent(n, (late < scheduleTime[n]) ? scheduleTime[n] - late : scheduleTime[n]);
+    }
+    scheduleApplyCommands();
+  }
+
+  // Scheduler: wait for the next deadline, or until there is input or
+  // something new to schedule
+  while((!scheduleChanged) && (inputHead == inputTail) && !serialBusy() && (scheduleHeapSize > 0) &&
+		  ((long)(scheduleTarget[scheduleHeap[0]] - millis()) > 0))
+  {
+    powerWait(scheduleTarget[scheduleHeap[0]] - millis());
+  }
+}
+
+/// Power saving
+// Sleep through (part of) a wait of ms; loop() calls it again until the
+// wait is over
+void powerWait(unsigned long ms)
+{
+  unsigned long us = micros();
+  if((powerMode == POWER_DOWN) && (ms >= POWER_DOWN_MIN_MS) && serialLink.ready() &&
+      !linkSubscribed && (millis() - serialLastMs >= POWER_SERIAL_QUIET_MS))
+  {
+    if(!powerCalibrated || (millis() - powerCalibratedMs >= POWER_CALIBRATE_MS))
+    {
+      powerCalibrate();
+      powerCalibrated = true;
+      powerCalibratedMs = millis();
+    }
+    else
+    {
+      Serial.flush();
+      attachPinChangeInterrupt(
+          digitalPinToPinChangeInterrupt(SERIAL_RX_PIN), doSerialWake, FALLING);
+      powerDownMs += powerDown(ms, powerAwake);
+      detachPinChangeInterrupt(digitalPinToPinChangeInterrupt(SERIAL_RX_PIN));
+      if(serialWoke)
+      {
+        serialWoke = false;
+        serialLastMs = millis();
+      }
+      powerCount();
+      return;
+    }
+  }
+  else if(powerMode == POWER_BUSY)
+  {
+    delay(1);
+    return;
+  }
+  else
+    powerIdle();
+
+  powerIdleUs += micros() - us;
+  powerIdleMs += powerIdleUs / 1000;
+  powerIdleUs %= 1000;
+  powerCount();
+}
 
-  // Scheduler: execute pending events
+// Add the time since the last call to powerTotalMs. Often enough that
+// millis() does not wrap in between; before the counters would, they are
+// halved together, which keeps the shares.
+void powerCount()
+{
   unsigned long ms = millis();
-  for(int n=0; n<SCHEDULE_EVENTS_NO; n++)
-   {
-     if((scheduleTarget[n] < ms) && (scheduleActive[n]))
-     {
-       (scheduleFunc[n])();
-       scheduleActive[n] = false;
-       scheduleEvent(n, scheduleTime[n]);
-     }
-     //else
-     //  eventsExecuted[n] = false;
-   }
+  powerTotalMs += ms - powerCountedMs;
+  powerCountedMs = ms;
+  if(powerTotalMs >= 0x80000000UL)
+  {
+    powerTotalMs /= 2;
+    powerIdleMs /= 2;
+    powerDownMs /= 2;
+  }
+}
 
-  // Scheduler: add new events
-  ms = millis();
-  for(int n=0; n<SCHEDULE_EVENTS_NO; n++)
-   {
-     if(eventsExecuted[n])
-     {
-       if(scheduleCommand[n] != -1)
-       {
-         scheduleTarget[n] = ms + scheduleCommand[n];
-         scheduleActive[n] = true;
-       }
-       eventsExecuted[n] = false;
-     }
-   }
+// Something for loop() to do; asked with interrupts off
+boolean powerAwake()
+{
+  return scheduleChanged || (inputHead != inputTail);
+}
 
-  if(delayLoop)
-    delay(LOOP_DELAY);
+// The start bit of a byte on the serial line, while powered down
+void doSerialWake()
+{
+  serialWoke = true;
 }
 
 /// Software: Scheduler
+// Run the event in tDelay ms; -1 takes it out of the queue
 void scheduleEvent(int eventId, long tDelay)
 {
   scheduleCommand[eventId] = tDelay;
   eventsExecuted[eventId] = true;
+  scheduleChanged = true;
+}
+
+// Move the requests from scheduleEvent() into the queue
+void scheduleApplyCommands()
+{
+  unsigned long ms = millis();
+  scheduleChanged = false;
+  for(int n=0; n<SCHEDULE_EVENTS_NO; n++)
+  {
+    if(!eventsExecuted[n])
+      continue;
+    // scheduleCommand is not written atomically, so don't let an interrupt
+    // change it halfway through reading it
+    noInterrupts();
+    long command = scheduleCommand[n];
+    eventsExecuted[n] = false;
+    interrupts();
+    if(command == -1)
+      scheduleRemove(n);
+    else
+      scheduleQueue(n, ms + command);
+  }
+}
+
+// Deadline order; ties run in event order like the old linear scan did
+boolean scheduleBefore(int a, int b)
+{
+  long d = (long)(scheduleTarget[a] - scheduleTarget[b]);
+  return (d < 0) || ((d == 0) && (a < b));
+}
+
+void scheduleHeapSet(int pos, int eventId)
+{
+  scheduleHeap[pos] = eventId;
+  scheduleHeapIndex[eventId] = pos;
+}
+
+void scheduleSiftUp(int pos)
+{
+  int eventId = scheduleHeap[pos];
+  while(pos > 0)
+  {
+    int parent = (pos - 1) / 2;
+    if(!scheduleBefore(eventId, scheduleHeap[parent]))
+      break;
+    scheduleHeapSet(pos, scheduleHeap[parent]);
+    pos = parent;
+  }
+  scheduleHeapSet(pos, eventId);
+}
+
+void scheduleSiftDown(int pos)
+{
+  int eventId = scheduleHeap[pos];
+  while(true)
+  {
+    int child = 2 * pos + 1;
+    if(child >= scheduleHeapSize)
+      break;
+    if((child + 1 < scheduleHeapSize) &&
+    		scheduleBefore(scheduleHeap[child + 1], scheduleHeap[child]))
+      child++;
+    if(!scheduleBefore(scheduleHeap[child], eventId))
+      break;
+    scheduleHeapSet(pos, scheduleHeap[child]);
+    pos = child;
+  }
+  scheduleHeapSet(pos, eventId);
+}
+
+// Queue the event for the given deadline, or move it there if it is queued
+void scheduleQueue(int eventId, unsigned long target)
+{
+  int pos = scheduleHeapIndex[eventId];
+  scheduleTarget[eventId] = target;
+  if(pos < 0)
+  {
+    pos = scheduleHeapSize++;
+    scheduleHeapSet(pos, eventId);
+  }
+  scheduleSiftUp(pos);
+  scheduleSiftDown(scheduleHeapIndex[eventId]);
+}
+
+void scheduleRemove(int eventId)
+{
+  int pos = scheduleHeapIndex[eventId];
+  if(pos < 0)
+    return;
+  scheduleHeapIndex[eventId] = -1;
+  scheduleHeapSize--;
+  if(pos == scheduleHeapSize)
+    return;
+  int moved = scheduleHeap[scheduleHeapSize];
+  scheduleHeapSet(pos, moved);
+  scheduleSiftUp(pos);
+  scheduleSiftDown(scheduleHeapIndex[moved]);
 }
 
 
@@ -313,55 +936,48 @@ void scheduleEvent(int eventId, long tDelay)
 /// Software: LCD screen
 void fpUpdateScreen()
 {
+  // Draw the whole screen into the shadow, then update only what changed
   lcd.clear();
 
   handleUi(UI_DISPLAY);
 
+  lcd.render();
+
 }
 
 /// Software: Load/store settings
+// Settings are stored alternately in two slot files, each with a version
+// and a checksum. A save only ever overwrites the older slot, so if the
+// power goes in the middle of it, the newer slot is still complete and is
+// what gets loaded. settings.txt is only read while there is no valid slot
+// (e.g. a hand-written file on a fresh card).
 void fpSettingsLoad()
 {
 	File settingsFile;
-	char character;
-	String settingName;
-	String settingValue;
 	if(liveWrite)
 	{
-		// Close logfile and open settings file
-		logfile.close();
-		settingsFile = SD.open("settings.txt");
-
-		char character;
-		String settingName;
-		String settingValue;
+		int oldFormat = logFormat;
+		settingsFindSlot();
+		if(settingsSlot >= 0)
+			settingsFile = sdOpen(settingsSlotNames[settingsSlot]);
+		else
+			settingsFile = sdOpen("settings.txt");
 
 		if (settingsFile) {
-			while (settingsFile.available()) {
-				character = settingsFile.read();
-				while((settingsFile.available()) && (character != '[')){
-					character = settingsFile.read();
-				}
-				character = settingsFile.read();
-				while((settingsFile.available()) && (character != '=')){
-					settingName = settingName + character;
-					character = settingsFile.read();
-				}
-				character = settingsFile.read();
-				while((settingsFile.available()) && (character != ']')){
-					settingValue = settingValue + character;
-					character = settingsFile.read();
-				}
-				if(character == ']'){
+			settingsParse(settingsFile, true);
+			settingsFile.close();
 
-					// Apply the value to the parameter
-					settingApply(settingName,settingValue);
-					// Reset Strings
-					settingName = "";
-					settingValue = "";
-				}
+			// Sensors the settings don't know yet get a channel; store that
+			// so they keep it
+			if(sensorsDiscover() > 0)
+				scheduleEvent(settingsStore, 1);
+
+			if(settingsBad)
+			{
+				char msg[17];
+				snprintf(msg, sizeof(msg), "%d bad, line %d", settingsBad, settingsBadLine);
+				setMessage(msg);
 			}
-			settingsFile.close();
 		}
 		else
 		{
@@ -370,8 +986,17 @@ void fpSettingsLoad()
 			setMessage("error loading");
 		}
 
-		// Reopen the logfile at the end
-		logfile = SD.open("log.txt", FILE_WRITE);
+		// The log stays open, unless it has to change to the other format
+		if(logRecoverPending)
+		{
+			logRecover();
+			logOpen();
+		}
+		else if(logFormat != oldFormat)
+		{
+			logfile.close();
+			logOpen();
+		}
 	}
 	else
 	{
@@ -380,518 +1005,2244 @@ void fpSettingsLoad()
 
 }
 
+// Find the newest slot with a good checksum: sets settingsSlot (-1: none)
+// and settingsVersion
+void settingsFindSlot()
+{
+	settingsSlot = -1;
+	settingsVersion = 0;
+	for(int n = 0; n < 2; n++)
+	{
+		File f = sdOpen(settingsSlotNames[n]);
+		if(!f)
+			continue;
+		settingsParse(f, false);
+		f.close();
+		if(settingsChecked && ((settingsSlot < 0) || (settingsFileVersion > settingsVersion)))
+		{
+			settingsSlot = n;
+			settingsVersion = settingsFileVersion;
+		}
+	}
+}
+
+// Streaming parser for [name=value] entries: the file is read a block at a
+// time and nothing is allocated. With apply, the entries are passed to
+// settingApply(); otherwise the file is only checked. Sets settingsBad,
+// settingsBadLine, settingsFileVersion and settingsChecked.
+void settingsParse(File &settingsFile, boolean apply)
+{
+	byte block[SETTINGS_READ_BLOCK];
+	char name[SETTING_NAME_MAX + 1];
+	char value[SETTING_VALUE_MAX + 1];
+	byte len = 0;
+	int state = PARSE_SEEK;
+	int line = 1;
+	uint16_t crc = 0;
+	uint16_t entryCrc = 0;
+	int n;
+
+	settingsBad = 0;
+	settingsBadLine = 0;
+	settingsFileVersion = 0;
+	settingsChecked = false;
+
+	while((n = settingsFile.read(block, sizeof(block))) > 0) {
+		for(int i = 0; i < n; i++) {
+			char character = block[i];
+			if(character == '[')
+				entryCrc = crc;
+			crc = OneWire::crc16(&block[i], 1, crc);
+
+			if(character == '\n')
+			{
+				if(state != PARSE_SEEK)
+				{
+					// entry not closed on its line
+					if(!settingsBad++) settingsBadLine = line;
+					state = PARSE_SEEK;
+				}
+				line++;
+				continue;
+			}
+			switch(state)
+			{
+			case PARSE_SEEK:
+				if(character == '[')
+				{
+					state = PARSE_NAME;
+					len = 0;
+				}
+				break;
+			case PARSE_NAME:
+				if(character == '=')
+				{
+					name[len] = 0;
+					state = PARSE_VALUE;
+					len = 0;
+				}
+				else if((character == '[') || (character == ']') || (len == SETTING_NAME_MAX))
+				{
+					if(!settingsBad++) settingsBadLine = line;
+					state = (character == '[') ? PARSE_NAME : PARSE_SEEK;
+					len = 0;
+				}
+				else
+					name[len++] = character;
+				break;
+			case PARSE_VALUE:
+				if(character == ']')
+				{
+					value[len] = 0;
+					if(strcmp(name, "crc") == 0)
+						// checks everything before this entry
+						settingsChecked = (strtoul(value, NULL, 16) == entryCrc);
+					else
+					{
+						settingsChecked = false;
+						if(strcmp(name, "version") == 0)
+							settingsFileVersion = strtoul(value, NULL, 10);
+						// Apply the value to the parameter
+						else if(apply && !settingApply(name, value))
+							if(!settingsBad++) settingsBadLine = line;
+					}
+					state = PARSE_SEEK;
+				}
+				else if((character == '[') || (len == SETTING_VALUE_MAX))
+				{
+					if(!settingsBad++) settingsBadLine = line;
+					state = (character == '[') ? PARSE_NAME : PARSE_SEEK;
+					len = 0;
+				}
+				else
+					value[len++] = character;
+				break;
+			}
+		}
+	}
+	if(state != PARSE_SEEK)
+		if(!settingsBad++) settingsBadLine = line;
+}
+
 void fpSettingsStore()
 {
+	char number[12];
 
-	File settingsFile;
-	char character;
-	String settingName;
-	String settingValue;
-	if(liveWrite)
+	if(!liveWrite)
+	{
+		setMessage("SD inactive");
+		return;
+	}
+
+	// Write the slot that does not hold the current settings. The log file
+	// stays open; the SD library handles both files at once.
+	int slot = (settingsSlot == 0) ? 1 : 0;
+	SD.remove(settingsSlotNames[slot]);
+	settingsOut.file = sdOpen(settingsSlotNames[slot], FILE_WRITE);
+	if(!settingsOut.file)
 	{
-		logfile.close();
-		 SD.remove("settings.txt");
-		 // Create new one
-		 settingsFile = SD.open("settings.txt", FILE_WRITE);
+		setMessage("error storing");
+		return;
 	}
-	// Delete the old One
-	 SD.remove("settings.txt");
-	 // Create new one
-	 settingsFile = SD.open("settings.txt", FILE_WRITE);
-	 // writing in the file works just like regular print()/println() function
-
-	 settingsFile.println(settingPrint("logInterval", String(logInterval) ));
-	 settingsFile.println(settingPrint("tempTarget", String(thermostatSettings[0],1) ));
-	 settingsFile.println(settingPrint("tempRange", String(thermostatSettings[1],1) ));
-	 settingsFile.println(settingPrint("tempUndershoot", String(thermostatSettings[2],1) ));
-	 settingsFile.println(settingPrint("tempOvershoot", String(thermostatSettings[3],1) ));
-
-	 String tsMode = "";
-	 switch(thermostatMode)
-	 {
-	 case THERMOSTAT_HEAT:
-		 tsMode = "H";
-		 break;
-	 case THERMOSTAT_COOL:
-		 tsMode = "C";
-		 break;
-	 case THERMOSTAT_OFF:
-		 tsMode = "X";
-		 break;
-	 case THERMOSTAT_ON:
-		 tsMode = "O";
-		 break;
-	 }
-	 settingsFile.println(settingPrint("thermostatMode", tsMode ));
-
-	 // close the file:
-	 settingsFile.close();
-	 //Serial.println("Writing done.");
-
-	 logfile = SD.open("log.txt");
+	settingsOut.len = 0;
+	settingsOut.crc = 0;
 
+	settingsPrintAll(settingsVersion + 1);
+
+	// The checksum covers everything before it and has to be last
+	settingsOutFlush();
+	sprintf(number, "%04X", settingsOut.crc);
+	settingPrint("crc", number);
+	settingsOutFlush();
+
+	// close the file: only now is the new slot complete
+	settingsOut.file.close();
+	settingsSlot = slot;
+	settingsVersion++;
 }
 
-void fpCycle()
+// Every setting, through settingPrint()
+void settingsPrintAll(unsigned long version)
 {
-  bufferPos++;
-  // Keep the screen at the old position if it was not on liveshow (pos 0)
-  if(screenPos != 0) screenPos++;
-  // read date/time and temperatures into current buffer
+	char number[12];
+
+	sprintf(number, "%lu", version);
+	settingPrint("version", number);
+	sprintf(number, "%d", sampleInterval);
+	settingPrint("sampleInterval", number);
+	sprintf(number, "%d", controlInterval);
+	settingPrint("controlInterval", number);
+	sprintf(number, "%d", logInterval);
+	settingPrint("logInterval", number);
+	settingPrint("logMinMax", logMinMax ? "1" : "0");
+	sprintf(number, "%d", logRotateKB);
+	settingPrint("logRotateKB", number);
+	sprintf(number, "%d", powerMode);
+	settingPrint("powerSave", number);
+	sprintf(number, "%d", logFlushInterval);
+	settingPrint("logFlush", number);
+	settingPrint("logFormat", logFormat == LOG_BINARY ? "B" : "T");
+	sprintf(number, "%d", pidInterval);
+	settingPrint("pidInterval", number);
+	sprintf(number, "%d", zoneCount);
+	settingPrint("zones", number);
+	for(int z = 0; z < ZONE_MAX; z++)
+	{
+		char name[SETTING_NAME_MAX + 1];
+		ThermostatZone &zone = zones[z];
+		const char *keys[4] = { "tempTarget", "tempRange", "tempUndershoot", "tempOvershoot" };
+		for(int k = 0; k < 4; k++)
+		{
+			sprintf(name, "%s%d", keys[k], z);
+			// one decimal unless the value has two
+			centiFormat(number, zone.settings[k], (zone.settings[k] % 10) ? 2 : 1);
+			settingPrint(name, number);
+		}
+
+		const char *tsMode = "";
+		switch(zone.mode)
+		{
+		case THERMOSTAT_HEAT:
+			tsMode = "H";
+			break;
+		case THERMOSTAT_COOL:
+			tsMode = "C";
+			break;
+		case THERMOSTAT_OFF:
+			tsMode = "X";
+			break;
+		case THERMOSTAT_ON:
+			tsMode = "O";
+			break;
+		case THERMOSTAT_PID:
+			tsMode = "P";
+			break;
+		}
+		sprintf(name, "thermostatMode%d", z);
+		settingPrint(name, tsMode);
+		sprintf(name, "zoneSensor%d", z);
+		sprintf(number, "%d", zone.liquid);
+		settingPrint(name, number);
+		sprintf(name, "zoneAir%d", z);
+		sprintf(number, "%d", zone.air);
+		settingPrint(name, number);
+
+		const char *pidKeys[6] = { "pidKp", "pidKi", "pidKd", "pidWindow", "pidMinOn", "pidMinOff" };
+		int pidValues[6] = { zone.kp, zone.ki, zone.kd, zone.pidWindow, zone.pidMinOn, zone.pidMinOff };
+		for(int k = 0; k < 6; k++)
+		{
+			sprintf(name, "%s%d", pidKeys[k], z);
+			sprintf(number, "%d", pidValues[k]);
+			settingPrint(name, number);
+		}
+		sprintf(name, "pidCool%d", z);
+		settingPrint(name, zone.pidCool ? "1" : "0");
+	}
 
-  sensors.requestTemperatures(); // Send the command to get temperatures
-  float airTemp =   sensors.getTempC(temp2);
-  float liquidTemp =   sensors.getTempC(temp1);
+	for(int c = 0; c < SENSOR_MAX; c++)
+	{
+		char name[12];
+		char address[17];
+		if(!sensorUsed(c))
+			continue;
+		sprintf(name, "sensor%d", c);
+		settingPrint(name, sensorFormatAddress(sensorAddress[c], address));
+		sprintf(name, "sensorRes%d", c);
+		sprintf(number, "%d", sensorResolution[c]);
+		settingPrint(name, number);
+	}
+}
 
-  tsBuffer[bufferPos] = RTC.now();
-  dataBuffer[bufferPos][0] = airTemp;
-  dataBuffer[bufferPos][1] = liquidTemp;
+// Up to max bytes of the settings as fpSettingsStore() writes them (less
+// the crc), from offset from on. Returns how many.
+byte settingsWindow(uint16_t from, byte *out, byte max)
+{
+	settingsOut.window = out;
+	settingsOut.skip = from;
+	settingsOut.windowLen = 0;
+	settingsOut.windowMax = max;
+	settingsOut.len = 0;
+	settingsOut.crc = 0;
+	settingsPrintAll(settingsVersion);
+	settingsOutFlush();
+	settingsOut.window = NULL;
+	return settingsOut.windowLen;
+}
 
-  controlRelay(airTemp, liquidTemp);
+void fpCycle()
+{
+  // Start the conversion on all sensors at once (one bus command no matter
+  // how many there are) and read the results when it is done
+  sensors.requestTemperatures();
+  scheduleEvent(readSensors, sensorWaitMs);
+}
 
-  if(liveWrite)
+void fpReadSensors()
+{
+  // read date/time and temperatures. Channels whose sensor is missing read
+  // as DEVICE_DISCONNECTED_C.
+  samplePrevTime = sampleTime;
+  sampleTime = RTC.now().unixtime();
+  for(int c = 0; c < SENSOR_MAX; c++)
   {
-    while(lastWrite != bufferPos)
-    {
-      writeLog(lastWrite);
-      lastWrite++;
-    }
-    logfile.flush();
+    samplePrevCenti[c] = sampleCenti[c];
+    sampleCenti[c] = centiFromRaw(sensorPresent[c] ?
+        sensors.getTemp(sensorAddress[c]) : DEVICE_DISCONNECTED_RAW);
+    if(sampleCenti[c] == DEVICE_DISCONNECTED_C * 100)
+      continue;
+    statsAddSample(c);
+
+    // Add to the log period
+    SampleStats &st = periodStats[c];
+    if((st.count == 0) || (sampleCenti[c] < st.min)) st.min = sampleCenti[c];
+    if((st.count == 0) || (sampleCenti[c] > st.max)) st.max = sampleCenti[c];
+    st.sum += sampleCenti[c];
+    st.count++;
   }
+  samplesTaken++;
+  if(statsSince == 0)
+    statsSince = sampleTime;
+
+  if(controlInterval == 0)
+    fpControl();
+  if(linkSubscribed)
+    linkSamplePending = true;
   //if(!messageState)
   //scheduleEvent(updateScreen,1);
 
 }
 
+void fpControl()
+{
+  if(samplesTaken == 0)
+    return;
+  controlRelay(sampleCenti);
+}
 
-//float getAirTemp()
-//{
-//  float tempTot = 0;
-//  int tempCnt = 0;
-//  int pos = 0;
-//  while(pos < airTempBufferPosMax)
-//  {
-//    tempTot += airTempBuffer[pos];
-//    pos++;
-//  }
-//  tempTot = tempTot / (airTempBufferPosMax + 1);
-//
-//  airTempBufferPos = 0;
-//  airTempBufferPosMax = 0;
-//
-//  return tempTot;
-//
-//}
-
-
-void writeLog(int index)
+/// Statistics
+// The newest sample of the channel (in sampleCenti) into its statistics
+void statsAddSample(int c)
 {
-  DateTime ts = tsBuffer[index];
-  float tAir = dataBuffer[index][0];
-  float tLiquid = dataBuffer[index][1];
-  logfile.print(ts.unixtime());
-  logfile.print(";");
-  logfile.print(tAir);
-  logfile.print(";");
-  logfile.print(tLiquid);
-  logfile.print(";");
-  logfile.print(relayState);
-  logfile.println();
+  ChannelStats &st = channelStats[c];
+  int16_t centi = sampleCenti[c];
+  if((st.count == 0) || (centi < st.min)) st.min = centi;
+  if((st.count == 0) || (centi > st.max)) st.max = centi;
+  st.sum += centi;
+  st.count++;
+
+  // Rate of change from the previous sample, averaged over about STATS_TAU
+  if((samplesTaken > 0) && (samplePrevCenti[c] != DEVICE_DISCONNECTED_C * 100) &&
+      (sampleTime > samplePrevTime))
+  {
+    long dt = sampleTime - samplePrevTime;
+    long rate = constrain((long)(centi - samplePrevCenti[c]) * 3600 / dt, -100000L, 100000L);
+    if(dt > STATS_TAU / 6) dt = STATS_TAU / 6;
+    // The fraction bits keep small steps: a sample moves the average by
+    // dt / STATS_TAU of the difference, less than 1/300 of it at dt=10
+    st.rate += ((int64_t)(rate << 10) - st.rate) * dt / STATS_TAU;
+  }
 }
 
-void fpClearDebounce(){
-  debouncing = false;
+// Count the time since the last call for the zones, with the relays as
+// they were until now
+void statsAddRelays()
+{
+  unsigned long ms = millis();
+  statsCarryMs += ms - statsLastMs;
+  statsLastMs = ms;
+  unsigned long secs = statsCarryMs / 1000;
+  statsCarryMs %= 1000;
+  if(secs == 0)
+    return;
+  long dt = (secs > STATS_TAU / 6) ? STATS_TAU / 6 : secs;
+  for(int z = 0; z < zoneCount; z++)
+  {
+    ZoneStats &zs = zoneStats[z];
+    boolean on = relayOutputs & (1 << z);
+    zs.seconds += secs;
+    if(on)
+      zs.onSeconds += secs;
+    zs.duty += ((on ? 1000L << 10 : 0) - zs.duty) * dt / STATS_TAU;
+  }
 }
 
-void fpManageSD(){
-  // This function is called after the toggle was pressed.
-  // Set the SD to the correct state now
-  if(liveWrite)
+// Start over with minimum, maximum, mean and duty
+void statsReset()
+{
+  for(int c = 0; c < SENSOR_MAX; c++)
   {
-    if (!SD.begin(10,11,12,13)) {
-      setMessage("SD init failed");
-      liveWrite = false;
-    }
-    else
-    {
-      logfile = SD.open("log.txt", FILE_WRITE);
-      if(!startupSettingsLoaded)
-    	  scheduleEvent(settingsLoad, 1);
-    }
+    channelStats[c].sum = 0;
+    channelStats[c].count = 0;
   }
-  else
+  for(int z = 0; z < ZONE_MAX; z++)
   {
-    logfile.close();
-    SD.end();
+    zoneStats[z].onSeconds = 0;
+    zoneStats[z].seconds = 0;
   }
-
-  // Regardless whether or not it worked:
-  startupSettingsLoaded = true;
+  statsSince = RTC.now().unixtime();
+  powerTotalMs = 0;
+  powerCountedMs = millis();
+  powerIdleMs = 0;
+  powerDownMs = 0;
+#if DIAGNOSTICS
+  memset(diagTimes, 0, sizeof(diagTimes));
+  diagBounces = 0;
+  inputOverflows = 0;
+#endif
 }
 
-/// Software: helper to get index position
+// SD.open(), timed for the diagnostics
+File sdOpen(const char *name, uint8_t mode)
+{
+  DIAG_START();
+  File f = SD.open(name, mode);
+  DIAG_STOP(DIAG_SD_OPEN);
+  return f;
+}
 
+#if DIAGNOSTICS
+/// Diagnostics
+void diagAdd(byte slot, unsigned long us)
+{
+  DiagTimes &d = diagTimes[slot];
+  if((d.count == 0) || (us < d.minUs)) d.minUs = us;
+  if(us > d.maxUs) d.maxUs = us;
+  d.sumUs += us;
+  d.count++;
+  byte b = 0;
+  for(unsigned long edge = 64; (us >= edge) && (b < DIAG_BUCKETS - 1); edge <<= 2)
+    b++;
+  if(d.buckets[b] < 0xFFFF)
+    d.buckets[b]++;
+}
 
-/// Software: Screen messages on errors etc
-void setMessage(String msg){
-  message = msg;
-  handleUi(UI_LEAVE);
-  uiTarget = UIT_MESSAGE;
-  scheduleEvent(updateScreen, 1);
+// A time in 4 characters: "850u", "1.2m", " 12m", "1.2s", " 12s"
+char *diagFormatUs(char *out, unsigned long us)
+{
+  if(us < 1000)
+    sprintf(out, "%3luu", us);
+  else if(us < 10000)
+    sprintf(out, "%lu.%lum", us / 1000, us / 100 % 10);
+  else if(us < 1000000)
+    sprintf(out, "%3lum", us / 1000);
+  else if(us < 10000000)
+    sprintf(out, "%lu.%lus", us / 1000000, us / 100000 % 10);
+  else
+    sprintf(out, "%3lus", (us / 1000000) % 1000);
+  return out;
 }
 
-/// Encoder: rotator handling
+// One line per slot, then the encoder:
+// time;name;count;min us;mean us;max us;late;<64us;..;rest
+// time;encoder;lost;bounces
+void diagDump()
+{
+  diagLastDump = sampleTime;
+  File f = sdOpen(DIAG_FILE, FILE_WRITE);
+  if(!f)
+    return;
+  for(byte n = 0; n < DIAG_SLOTS_NO; n++)
+  {
+    DiagTimes &d = diagTimes[n];
+    f.print(sampleTime);
+    f.print(';');
+    f.print(diagNames[n]);
+    f.print(';');
+    f.print(d.count);
+    f.print(';');
+    f.print(d.minUs);
+    f.print(';');
+    f.print(d.count ? (unsigned long)(d.sumUs / d.count) : 0UL);
+    f.print(';');
+    f.print(d.maxUs);
+    f.print(';');
+    f.print(d.late);
+    for(byte b = 0; b < DIAG_BUCKETS; b++)
+    {
+      f.print(';');
+      f.print(d.buckets[b]);
+    }
+    f.println();
+  }
+  f.print(sampleTime);
+  f.print(";encoder;");
+  f.print(inputOverflows);
+  f.print(';');
+  f.println(diagBounces);
+  f.close();
+}
+#endif
 
-// Interrupt on A changing state
-void doEncoderA(){
-  // debounce
-  if ( rotating ) delay (10);  // wait a little until the bouncing is done
+// One log row from the samples of the period: into the history, and to the
+// card if it is on
+void fpLogRow()
+{
+  int16_t temps[SENSOR_MAX];
+  boolean any = false;
+  for(int c = 0; c < SENSOR_MAX; c++)
+  {
+    SampleStats &st = periodStats[c];
+    if(st.count == 0)
+    {
+      temps[c] = rowMin[c] = rowMax[c] = DEVICE_DISCONNECTED_C * 100;
+      continue;
+    }
+    // rounded mean
+    temps[c] = ((st.sum >= 0) ? st.sum + st.count / 2 : st.sum - st.count / 2) / st.count;
+    rowMin[c] = st.min;
+    rowMax[c] = st.max;
+    st.sum = 0;
+    st.count = 0;
+    any = true;
+  }
+  if(!any)
+    return; // no sample in this period
 
-  // Test transition, did things really change?
-  if( digitalRead(encoderPinA) != A_set ) {  // debounce once more
-    A_set = !A_set;
+  bufferPos++;
+  // Keep the screen at the old position if it was not on liveshow (pos 0)
+  if((screenPos != 0) && !cardView && (screenPos + 1 < history.capacity())) screenPos++;
+  history.push(sampleTime, temps);
 
-    // adjust counter + if A leads B
-    if ( A_set && !B_set )
+  if(liveWrite)
+  {
+    // No flush here: the rows collect in the SD library's block cache,
+    // which goes to the card when the block is full or on flushLog.
+    // Catch up on what was logged while the card was off, as far back as
+    // the buffer goes.
+    unsigned int pending = bufferPos - lastWrite;
+    if(pending > history.size()) pending = history.size();
+    boolean caughtUp = (pending > 1);
+    uint32_t t = pending ? history.time(pending - 1) : 0;
+    while(pending > 0)
     {
-    	handleUi(UI_ENC_UP);
+      pending--;
+      writeLog(pending, t);
+      if(pending)
+        t = history.newer(pending, t);
     }
+    lastWrite = bufferPos;
+    // Only the newest row went to the journal: the others to the card now
+    if(caughtUp)
+      logfile.flush();
+#if DIAGNOSTICS
+    if(sampleTime - diagLastDump >= DIAG_DUMP_INTERVAL)
+      diagDump();
+#endif
+  }
+}
+
+
+/// Temperature sensors
+// Put the sensors on the bus on channels. Returns how many of them were
+// new, i.e. got a channel that is not in the settings yet.
+int sensorsDiscover()
+{
+  DeviceAddress address;
+  int added = 0;
+
+  sensors.begin(); // searches the bus
+  for(int c = 0; c < SENSOR_MAX; c++)
+    sensorPresent[c] = false;
+  byte found = sensors.getDeviceCount();
+  // The built-in probes first, to their old channels; then the others, to
+  // the lowest free ones
+  for(byte pass = 0; pass < 2; pass++)
+  {
+    for(byte n = 0; n < found; n++)
+    {
+      if(!sensors.getAddress(address, n))
+        continue;
+      int c = sensorChannel(address);
+      if(c < 0)
+      {
+        if(pass == 0)
+        {
+          for(byte b = 0; b < 2; b++)
+            if(!memcmp(sensorBuiltIn[b], address, sizeof(DeviceAddress)) && !sensorUsed(b))
+              c = b;
+        }
+        else
+          c = sensorChannel(NULL);
+        if(c < 0)
+          continue; // not built in, or more sensors than channels
+        memcpy(sensorAddress[c], address, sizeof(DeviceAddress));
+        added++;
+      }
+      sensorPresent[c] = true;
+    }
+  }
+  sensorsConfigure();
+  return added;
+}
+
+// Set the resolutions and work out sensorCount and sensorWaitMs
+void sensorsConfigure()
+{
+  byte slowest = 9;
+  sensorCount = 0;
+  for(int c = 0; c < SENSOR_MAX; c++)
+  {
+    if(sensorUsed(c))
+      sensorCount = c + 1;
+    if(!sensorPresent[c])
+      continue;
+    sensors.setResolution(sensorAddress[c], sensorResolution[c]);
+    if(sensorResolution[c] > slowest)
+      slowest = sensorResolution[c];
+  }
+  sensorWaitMs = sensors.millisToWaitForConversion(slowest);
+}
+
+// Channel of the sensor, -1 if it has none. NULL finds a free channel.
+int sensorChannel(const uint8_t *address)
+{
+  for(int c = 0; c < SENSOR_MAX; c++)
+  {
+    if(address == NULL ? !sensorUsed(c) :
+    		(memcmp(sensorAddress[c], address, sizeof(DeviceAddress)) == 0))
+      return c;
+  }
+  return -1;
+}
+
+boolean sensorUsed(int channel)
+{
+  for(byte b = 0; b < sizeof(DeviceAddress); b++)
+    if(sensorAddress[channel][b] != 0)
+      return true;
+  return false;
+}
+
+// 16 hex digits, first ROM byte first (the family code, 28 for DS18B20)
+char *sensorFormatAddress(const uint8_t *address, char *out)
+{
+  for(byte b = 0; b < sizeof(DeviceAddress); b++)
+    sprintf(out + 2 * b, "%02X", address[b]);
+  return out;
+}
+
+boolean sensorParseAddress(const char *text, uint8_t *address)
+{
+  if(strlen(text) != 2 * sizeof(DeviceAddress))
+    return false;
+  for(byte b = 0; b < sizeof(DeviceAddress); b++)
+  {
+    char digits[3] = { text[2 * b], text[2 * b + 1], 0 };
+    if(!isxdigit(digits[0]) || !isxdigit(digits[1]))
+      return false;
+    address[b] = strtoul(digits, NULL, 16);
+  }
+  return true;
+}
+
+
+//float getAirTemp()
+//{
+//  float tempTot = 0;
+//  int tempCnt = 0;
+//  int pos = 0;
+//  while(pos < airTempBufferPosMax)
+//  {
+//    tempTot += airTempBuffer[pos];
+//    pos++;
+//  }
+//  tempTot = tempTot / (airTempBufferPosMax + 1);
+//
+//  airTempBufferPos = 0;
+//  airTempBufferPosMax = 0;
+//
+//  return tempTot;
+//
+//}
 
-    rotating = false;  // no more debouncing until loop() hits again
+
+// age: how many samples back from the newest, t: its time
+void writeLog(int age, uint32_t t)
+{
+  int16_t values[3 * SENSOR_MAX];
+  byte n = 1;
+  DIAG_START();
+  for(int c = 0; c < sensorCount; c++)
+    n = logValues(age, c, values + 3 * c);
+  if(age == 0)
+    journalAdd(t, values, relayOutputs);
+  else
+    logSelect(t);
+  // Catching up, logRecover() may have logged the row from the journal
+  if((age == 0) || (t > logLastTime))
+    writeLogRow(t, values, n, relayOutputs);
+  DIAG_STOP(DIAG_WRITE_LOG);
+}
+
+// values: n per channel (see logValues()), 3 apart
+void writeLogRow(uint32_t t, const int16_t *values, byte n, byte relays)
+{
+  logSelect(t);
+  if(logFormat == LOG_BINARY)
+    writeLogBinary(t, values, n, relays);
+  else
+    writeLogText(t, values, n, relays);
+  logLastTime = t;
+}
+
+void writeLogText(uint32_t t, const int16_t *values, byte n, byte relays)
+{
+  logfile.print(t);
+  logfile.print(";");
+  for(int c = 0; c < sensorCount; c++)
+  {
+    for(byte v = 0; v < n; v++)
+    {
+      centiPrint(logfile, values[3 * c + v], 2);
+      logfile.print(";");
+    }
   }
+  logfile.print(relays);
+  logfile.println();
 }
 
-// Interrupt on B changing state, same as A above
-void doEncoderB(){
-  if ( rotating ) delay (10);
-  if( digitalRead(encoderPinB) != B_set ) {
-    B_set = !B_set;
-    //  adjust counter - 1 if B leads A
-    if( B_set && !A_set )
+// Record of LOG_RECORD_SIZE(values) bytes, little endian, one write per
+// row:
+// byte 0: record length, with LOG_RECORD_MINMAX set if logMinMax was on
+// byte 1-4: unixtime
+// then per sensor: temperature in 1/100 degC, int16; with logMinMax the
+//   mean, minimum and maximum
+// then relay outputs, bit n for zone n
+// last byte: Dallas CRC8 over all bytes before it
+// sim/logdecode turns log.bin back into the text format.
+void writeLogBinary(uint32_t t, const int16_t *values, byte n, byte relays)
+{
+  byte record[LOG_RECORD_SIZE(3 * SENSOR_MAX)];
+  byte pos = 0;
+
+  record[pos++] = (n == 3) ?
+      (LOG_RECORD_SIZE(3 * sensorCount) | LOG_RECORD_MINMAX) : LOG_RECORD_SIZE(sensorCount);
+  logPut32(record + pos, t);
+  pos += 4;
+  for(int c = 0; c < sensorCount; c++)
+  {
+    for(byte v = 0; v < n; v++)
     {
-    	handleUi(UI_ENC_DOWN);
+      record[pos++] = values[3 * c + v] & 0xFF;
+      record[pos++] = (values[3 * c + v] >> 8) & 0xFF;
     }
+  }
+  record[pos++] = relays;
+  record[pos] = OneWire::crc8(record, pos);
+  logfile.write(record, pos + 1);
+}
+
+// What a log row has for a channel: the mean, and with logMinMax the
+// minimum and maximum. Only the newest row has those; for older rows
+// (catching up after the card was off) they are the mean as well.
+byte logValues(int age, int channel, int16_t *values)
+{
+  values[0] = history.temp(age, channel);
+  if(!logMinMax)
+    return 1;
+  values[1] = (age == 0) ? rowMin[channel] : values[0];
+  values[2] = (age == 0) ? rowMax[channel] : values[0];
+  return 3;
+}
 
-    rotating = false;
+/// Log journal
+// values as for writeLogRow(), the means go in
+void journalAdd(uint32_t t, const int16_t *values, byte relays)
+{
+  byte slot[JOURNAL_SLOT_SIZE];
+  logPut32(slot, journalSeq);
+  logPut32(slot + 4, t);
+  for(int c = 0; c < SENSOR_MAX; c++)
+  {
+    int16_t centi = (c < sensorCount) ? values[3 * c] : DEVICE_DISCONNECTED_C * 100;
+    slot[8 + 2 * c] = centi & 0xFF;
+    slot[9 + 2 * c] = (centi >> 8) & 0xFF;
   }
+  slot[8 + 2 * SENSOR_MAX] = relays;
+  slot[JOURNAL_SLOT_SIZE - 1] = OneWire::crc8(slot, JOURNAL_SLOT_SIZE - 1);
+  int address = (journalSeq % JOURNAL_SLOTS) * JOURNAL_SLOT_SIZE;
+  for(byte b = 0; b < JOURNAL_SLOT_SIZE; b++)
+    EEPROM.update(address + b, slot[b]);
+  journalSeq++;
 }
 
-void doEncSw(){
-	if(debouncing) return;
-	handleUi(UI_ENC_SW);
+// The row in slot n; false if there is none, or only part of one
+boolean journalRead(int n, JournalRow &row)
+{
+  byte slot[JOURNAL_SLOT_SIZE];
+  for(byte b = 0; b < JOURNAL_SLOT_SIZE; b++)
+    slot[b] = EEPROM.read(n * JOURNAL_SLOT_SIZE + b);
+  if(OneWire::crc8(slot, JOURNAL_SLOT_SIZE - 1) != slot[JOURNAL_SLOT_SIZE - 1])
+    return false;
+  row.seq = logGet32(slot);
+  row.time = logGet32(slot + 4);
+  for(int c = 0; c < SENSOR_MAX; c++)
+    row.centi[c] = (int16_t)(slot[8 + 2 * c] | (slot[9 + 2 * c] << 8));
+  row.relays = slot[8 + 2 * SENSOR_MAX];
+  // An erased EEPROM can pass the CRC
+  return (row.time != 0) && (row.seq % JOURNAL_SLOTS == (uint32_t)n);
+}
 
-	debouncing = true;
-	scheduleEvent(clearDebounce, DEBOUNCE_DELAY);
+// On startup: go on after the newest row in the journal
+void journalBegin()
+{
+  JournalRow row;
+  for(int n = 0; n < JOURNAL_SLOTS; n++)
+    if(journalRead(n, row) && (row.seq >= journalSeq))
+      journalSeq = row.seq + 1;
 }
 
-void doClearButton()
+// After SD.begin() and with the settings loaded (the channels and format
+// to log in): mend what a power cut may have left on the card, and log
+// the rows of the journal that are newer than the card's
+void logRecover()
 {
-	if(debouncing) return;
-	handleUi(UI_CLEAR);
-	// debounce
-	debouncing = true;
-	scheduleEvent(clearDebounce, DEBOUNCE_DELAY);
+  JournalRow row;
+
+  logRecoverPending = false;
+  logIndexRepair();
+  if(journalSeq == 0)
+    return;
+  uint32_t newest = journalSeq - 1;
+
+  // Oldest first. The file of each row's day is opened (and checked) as it
+  // comes; rows it already has are left out.
+  logfile.close();
+  logFileDate = 0;
+  byte n = logMinMax ? 3 : 1;
+  uint32_t seq = (newest >= JOURNAL_SLOTS) ? newest - JOURNAL_SLOTS + 1 : 0;
+  for(; seq <= newest; seq++)
+  {
+    if(!journalRead(seq % JOURNAL_SLOTS, row) || (row.seq != seq))
+      continue;
+    logSelect(row.time);
+    if(row.time <= logLastTime)
+      continue;
+    int16_t values[3 * SENSOR_MAX];
+    for(int c = 0; c < sensorCount; c++)
+      for(byte v = 0; v < n; v++)
+        values[3 * c + v] = row.centi[c];
+    writeLogRow(row.time, values, n, row.relays);
+  }
+  if(logfile)
+    logfile.flush();
 }
 
+/// Fixed point temperatures
+// Temperatures are int16_t in 1/100 degC everywhere, from the sensor to the
+// log, screen and settings; DEVICE_DISCONNECTED_C * 100 marks a channel
+// without a reading. The AVR has no FPU, so this keeps float arithmetic
+// and printing out of the sketch altogether.
 
-void handleUi(int action)
+// The sensor's raw 1/128 degC, rounded
+int16_t centiFromRaw(int16_t raw)
 {
-	int ret;
+  if(raw == DEVICE_DISCONNECTED_RAW)
+    return DEVICE_DISCONNECTED_C * 100;
+  long v = (long)raw * 100;
+  return (v + (v < 0 ? -64 : 64)) / 128;
+}
 
-	ret = (uiTargets[uiTarget])(action);
-	switch(ret)
+// "-12.3" for -1234 and 1 decimal (or 2), rounded half away from zero;
+// buf needs 13 bytes. Returns buf.
+char *centiFormat(char *buf, long centi, byte decimals)
+{
+  char digits[11];
+  char *p = buf;
+  if(centi < 0)
+  {
+    *p++ = '-';
+    centi = -centi;
+  }
+  if(decimals < 2)
+    centi = (centi + 5) / 10;
+  // at least one digit before the point
+  byte n = 0;
+  do
+  {
+    digits[n++] = '0' + centi % 10;
+    centi /= 10;
+  } while((centi > 0) || (n <= decimals));
+  while(n > 0)
+  {
+    *p++ = digits[--n];
+    if((n == decimals) && (n > 0))
+      *p++ = '.';
+  }
+  *p = 0;
+  return buf;
+}
+
+void centiPrint(Print &out, long centi, byte decimals)
+{
+  char buf[13];
+  out.print(centiFormat(buf, centi, decimals));
+}
+
+// "-12.34" as 1/100 degC, further decimals are cut off; p is left after
+// the number. Saturates at INT16_MIN..INT16_MAX.
+int16_t centiParse(char *&p)
+{
+  boolean minus = (*p == '-');
+  if(minus)
+    p++;
+  long v = 0;
+  for(; isdigit(*p); p++)
+    if(v <= INT16_MAX)
+      v = 10 * v + (*p - '0');
+  int scale = 100;
+  if(*p == '.')
+    for(p++; isdigit(*p); p++)
+      if(scale > 1)
+      {
+        scale /= 10;
+        v = 10 * v + (*p - '0');
+      }
+  v *= scale;
+  if(v > INT16_MAX)
+    v = minus ? -INT16_MIN : INT16_MAX;
+  return minus ? -v : v;
+}
+
+// Open the log file of the current format for appending
+void logOpen()
+{
+  logOpenFor(RTC.now().unixtime());
+}
+
+// Open the file that rows of time t go to: the newest part of that day
+void logOpenFor(uint32_t t)
+{
+  char name[20];
+  DateTime d(t);
+
+  logfile.close();
+  logFileDay = t / 86400UL;
+  logFileDate = d.year() * 10000UL + d.month() * 100 + d.day();
+  SD.mkdir(LOG_DIR);
+  logFilePart = 0;
+  for(byte p = 1; p <= LOG_PARTS_MAX; p++)
+  {
+    logFileName(name, logFileDate, p);
+    if(!SD.exists(name))
+      break;
+    logFilePart = p;
+  }
+  logFileName(name, logFileDate, logFilePart);
+  logfile = sdOpen(name, FILE_WRITE);
+  if(!logfile)
+    return;
+  // A power cut can leave a torn row at the end, or the file shorter than
+  // the index has it. The SD library cannot truncate; rows go on in a new
+  // part, whose start the index knows, and the readers stop at the tear.
+  // Rows of the other logMinMax layout go in a new part too.
+  if((!logTailValid(name) || (logFileMinMax != logMinMax)) &&
+      (logFilePart < LOG_PARTS_MAX))
+    logNextPart(t);
+  else
+  {
+    logHeader();
+    logIndexAdd((t > logLastTime) ? t : logLastTime + 1);
+  }
+}
+
+// Go on in the next part of the day's file, with rows from time t on
+void logNextPart(uint32_t t)
+{
+  char name[20];
+  logfile.close();
+  logFilePart++;
+  logFileName(name, logFileDate, logFilePart);
+  logfile = sdOpen(name, FILE_WRITE);
+  logFileMinMax = logMinMax;
+  if(!logfile)
+    return;
+  logHeader();
+  logIndexAdd((t > logLastTime) ? t : logLastTime + 1);
+}
+
+// Start a new text file with its row layout, so that the readers do not
+// go by the settings of today:
+// #time;t0;t1;...;relays  or, with logMinMax,
+// #time;t0;t0min;t0max;t1;...;relays
+void logHeader()
+{
+  if((logFormat != LOG_TEXT) || logfile.size())
+    return;
+  logfile.print("#time;");
+  for(int c = 0; c < sensorCount; c++)
+  {
+    logfile.print('t');
+    logfile.print(c);
+    logfile.print(";");
+    if(logMinMax)
+    {
+      logfile.print('t');
+      logfile.print(c);
+      logfile.print("min;t");
+      logfile.print(c);
+      logfile.print("max;");
+    }
+  }
+  logfile.println("relays");
+}
+
+// Whether the valid rows of the log file just opened (name) go up to its
+// end, and the index does not point past that; sets logLastTime and
+// logFileMinMax
+boolean logTailValid(const char *name)
+{
+  char keep[20];
+  uint32_t offset = 0;
+  uint32_t size = logfile.size();
+  LogRow row;
+
+  logLastTime = 0;
+  // Empty, or binary: the records carry their own layout
+  logFileMinMax = logMinMax;
+  uint32_t when = logIndexLastIn(name, &offset);
+  if(when)
+    logLastTime = when - 1;
+  if((offset >= size) && (!size || (logFormat == LOG_BINARY)))
+    return offset == size;
+
+  strcpy(keep, cardName);
+  if(!cardOpen(name))
+    return true;
+  if(logFormat == LOG_TEXT)
+    logFileMinMax = (cardStride == 3);
+  if(offset < cardStart)
+    offset = cardStart;
+  while((offset < size) && cardReadRow(offset, row))
+  {
+    if(row.time > logLastTime)
+      logLastTime = row.time;
+    offset += row.length;
+  }
+  if(keep[0])
+    cardOpen(keep);
+  else
+  {
+    cardFile.close();
+    cardName[0] = 0;
+  }
+  return offset == size;
+}
+
+// Make sure the row of time t goes to the right file
+void logSelect(uint32_t t)
+{
+  if((logFileDate == 0) || (t / 86400UL != logFileDay))
+  {
+    logOpenFor(t);
+    return;
+  }
+  if((logFilePart < LOG_PARTS_MAX) && ((logFileMinMax != logMinMax) ||
+      (logRotateKB && (logfile.size() >= 1024UL * logRotateKB))))
+  {
+    logNextPart(t);
+    return;
+  }
+  if(t >= logIndexLast + LOG_INDEX_INTERVAL)
+    logIndexAdd(t);
+}
+
+void logFileName(char *name, uint32_t date, byte part)
+{
+  if(part == 0)
+    sprintf(name, LOG_DIR "/%08lu.%s", (unsigned long)date, logFormat == LOG_BINARY ? "BIN" : "TXT");
+  else
+    sprintf(name, LOG_DIR "/%08lu.%c%02d", (unsigned long)date, logFormat == LOG_BINARY ? 'B' : 'T', part);
+}
+
+// Rows from time t on are at the current end of the open log file. The
+// entries stay in time order: none before the last one.
+void logIndexAdd(uint32_t t)
+{
+  byte entry[LOG_INDEX_ENTRY_SIZE];
+  if(t < logIndexLast)
+    return;
+  logPut32(entry, t);
+  logPut32(entry + 4, logFileDate);
+  logPut32(entry + 8, logfile.size());
+  entry[12] = logFilePart;
+  entry[13] = logFormat;
+  entry[14] = 0;
+  entry[15] = OneWire::crc8(entry, LOG_INDEX_ENTRY_SIZE - 1);
+
+  File index = sdOpen(LOG_INDEX_FILE, FILE_WRITE);
+  if(!index)
+    return;
+  index.write(entry, LOG_INDEX_ENTRY_SIZE);
+  index.close();
+  logIndexLast = t;
+}
+
+// Where the rows from time t on are: the file (name, at least 20 chars)
+// and offset of the last index entry at or before t; with after, of the
+// first entry after t instead. Returns the time of that entry, 0 if there
+// is none.
+uint32_t logIndexFind(uint32_t t, char *name, uint32_t *offset, boolean after)
+{
+  byte entry[LOG_INDEX_ENTRY_SIZE];
+  uint32_t found = 0;
+
+  File index = sdOpen(LOG_INDEX_FILE);
+  if(!index)
+    return 0;
+  long n = logIndexSearch(index, t);
+  long count = index.size() / LOG_INDEX_ENTRY_SIZE;
+  // past holes (see logIndexSearch())
+  if(!after)
+    while((--n >= 0) && !logIndexEntry(index, n, entry))
+      ;
+  else
+    while((n < count) && !logIndexEntry(index, n, entry))
+      n++;
+  if((n >= 0) && (n < count))
+    found = logIndexDecode(entry, name, offset);
+  index.close();
+  return found;
+}
+
+// The first index entry after time t that is in another file than
+// current; as logIndexFind(). For going on at the end of a file.
+uint32_t logIndexNextFile(uint32_t t, const char *current, char *name, uint32_t *offset)
+{
+  byte entry[LOG_INDEX_ENTRY_SIZE];
+  uint32_t found = 0;
+
+  File index = sdOpen(LOG_INDEX_FILE);
+  if(!index)
+    return 0;
+  long n = logIndexSearch(index, t);
+  long count = index.size() / LOG_INDEX_ENTRY_SIZE;
+  for(; n < count; n++)
+  {
+    if(!logIndexEntry(index, n, entry))
+      continue;
+    found = logIndexDecode(entry, name, offset);
+    if(strcmp(name, current) != 0)
+      break;
+    found = 0;
+  }
+  index.close();
+  return found;
+}
+
+// How many entries are at or before time t. Entries are in time order, so
+// this is a binary search that reads one entry per step. An entry a power
+// cut tore is a hole (see logIndexRepair()); the next whole one decides.
+long logIndexSearch(File &index, uint32_t t)
+{
+  byte entry[LOG_INDEX_ENTRY_SIZE];
+  long lo = 0;
+  long hi = index.size() / LOG_INDEX_ENTRY_SIZE;
+  while(lo < hi)
+  {
+    long mid = (lo + hi) / 2;
+    long probe = mid;
+    while((probe < hi) && !logIndexEntry(index, probe, entry))
+      probe++;
+    if((probe < hi) && (logGet32(entry) <= t))
+      lo = probe + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Time and offset of the last index entry into name, a file of the open
+// day; 0 if there is none
+uint32_t logIndexLastIn(const char *name, uint32_t *offset)
+{
+  byte entry[LOG_INDEX_ENTRY_SIZE];
+  char entryName[20];
+
+  File index = sdOpen(LOG_INDEX_FILE);
+  if(!index)
+    return 0;
+  for(long n = (long)(index.size() / LOG_INDEX_ENTRY_SIZE) - 1; n >= 0; n--)
+  {
+    if(!logIndexEntry(index, n, entry))
+      continue;
+    if(logGet32(entry + 4) < logFileDate)
+      break;
+    uint32_t t = logIndexDecode(entry, entryName, offset);
+    if(!strcmp(entryName, name))
+    {
+      index.close();
+      return t;
+    }
+  }
+  index.close();
+  *offset = 0;
+  return 0;
+}
+
+// A power cut while an entry was written can leave part of one at the
+// end: fill it up to a whole entry with a wrong CRC, a hole, so that the
+// ones after it line up. Also finds logIndexLast.
+void logIndexRepair()
+{
+  byte entry[LOG_INDEX_ENTRY_SIZE];
+
+  logIndexLast = 0;
+  SD.mkdir(LOG_DIR);
+  File index = sdOpen(LOG_INDEX_FILE, FILE_WRITE);
+  if(!index)
+    return;
+  uint32_t size = index.size();
+  byte part = size % LOG_INDEX_ENTRY_SIZE;
+  if(part)
+  {
+    index.seek(size - part);
+    index.read(entry, part);
+    memset(entry + part, 0, LOG_INDEX_ENTRY_SIZE - part);
+    entry[LOG_INDEX_ENTRY_SIZE - 1] = ~OneWire::crc8(entry, LOG_INDEX_ENTRY_SIZE - 1);
+    index.write(entry + part, LOG_INDEX_ENTRY_SIZE - part);
+  }
+  for(long n = (long)(index.size() / LOG_INDEX_ENTRY_SIZE) - 1; n >= 0; n--)
+    if(logIndexEntry(index, n, entry))
+    {
+      logIndexLast = logGet32(entry);
+      break;
+    }
+  index.close();
+}
+
+// Read entry n; false past the end or if its CRC is wrong
+boolean logIndexEntry(File &index, long n, byte *entry)
+{
+  index.seek(n * LOG_INDEX_ENTRY_SIZE);
+  return (index.read(entry, LOG_INDEX_ENTRY_SIZE) == LOG_INDEX_ENTRY_SIZE) &&
+      (OneWire::crc8(entry, LOG_INDEX_ENTRY_SIZE - 1) == entry[15]);
+}
+
+// File name and offset of an entry; returns its time
+uint32_t logIndexDecode(const byte *entry, char *name, uint32_t *offset)
+{
+  int format = logFormat;
+  logFormat = entry[13];
+  logFileName(name, logGet32(entry + 4), entry[12]);
+  logFormat = format;
+  *offset = logGet32(entry + 8);
+  return logGet32(entry);
+}
+
+void logPut32(byte *p, uint32_t v)
+{
+  for(int b = 0; b < 4; b++)
+    p[b] = (v >> (8 * b)) & 0xFF;
+}
+
+uint32_t logGet32(const byte *p)
+{
+  return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Make name the file the history view reads
+boolean cardOpen(const char *name)
+{
+  if(cardFile && !strcmp(name, cardName))
+    return true;
+  cardFile.close();
+  cardCache.invalidate();
+  strcpy(cardName, name);
+  cardFile = sdOpen(name);
+  cardStride = 1;
+  cardStart = 0;
+  if(!cardFile || (strchr(cardName, '.')[1] == 'B'))
+    return cardFile;
+
+  // #time;t0;t0min;t0max;... (see logHeader())
+  char line[LOG_ROW_TEXT_MAX + 1];
+  byte length = 0;
+  int c;
+  if(cardCache.get(cardFile, 0) != '#')
+    return true;
+  do
+  {
+    c = cardCache.get(cardFile, length);
+    if((c < 0) || (length == LOG_ROW_TEXT_MAX))
+      break;
+    line[length++] = c;
+  } while(c != '\n');
+  line[length] = 0;
+  // a torn header: no row of the file is whole
+  if(c != '\n')
+    return true;
+  cardStart = length;
+  if(strstr(line, "min;"))
+    cardStride = 3;
+  return true;
+}
+
+void cardClose()
+{
+  cardFile.close();
+  cardName[0] = 0;
+  cardView = false;
+}
+
+// The row at offset of the card file; false if there is none there (the
+// end of the file, or not a whole valid row)
+boolean cardReadRow(uint32_t offset, LogRow &row)
+{
+  char line[LOG_ROW_TEXT_MAX + 1];
+  byte length = 0;
+  int c;
+
+  row.offset = offset;
+  row.channels = 0;
+  if(strchr(cardName, '.')[1] == 'B')
+    return cardReadRecord(offset, row);
+
+  // unixtime;t0;t1;...;relay\r\n
+  do
+  {
+    c = cardCache.get(cardFile, offset + length);
+    if((c < 0) || (length == LOG_ROW_TEXT_MAX))
+      return false;
+    line[length++] = c;
+  } while(c != '\n');
+  line[length] = 0;
+  row.length = length;
+
+  char *p = line;
+  row.time = strtoul(p, &p, 10);
+  if(*p != ';')
+    return false;
+  int16_t values[3 * SENSOR_MAX];
+  byte n = 0;
+  while((*p == ';') && (isdigit(p[1]) || (p[1] == '-')))
+  {
+    p++;
+    int16_t v = centiParse(p);
+    // the last field is the relay outputs
+    if((*p == ';') && (n < 3 * SENSOR_MAX))
+      values[n++] = v;
+  }
+  // With logMinMax each channel has mean, minimum and maximum
+  for(byte v = 0; (v < n) && (row.channels < SENSOR_MAX); v += cardStride)
+    row.centi[row.channels++] = values[v];
+  return true;
+}
+
+// See writeLogBinary()
+boolean cardReadRecord(uint32_t offset, LogRow &row)
+{
+  byte record[LOG_RECORD_SIZE(3 * SENSOR_MAX)];
+  int c = cardCache.get(cardFile, offset);
+  if(c < 0)
+    return false;
+  byte length = c & ~LOG_RECORD_MINMAX;
+  if((length < LOG_RECORD_SIZE(0)) || (length > sizeof(record)))
+    return false;
+  record[0] = c;
+  for(byte b = 1; b < length; b++)
+  {
+    c = cardCache.get(cardFile, offset + b);
+    if(c < 0)
+      return false;
+    record[b] = c;
+  }
+  if(OneWire::crc8(record, length - 1) != record[length - 1])
+    return false;
+
+  byte values = (length - LOG_RECORD_SIZE(0)) / 2;
+  byte stride = (record[0] & LOG_RECORD_MINMAX) ? 3 : 1;
+  row.time = logGet32(record + 1);
+  row.length = length;
+  for(byte v = 0; (v < values) && (row.channels < SENSOR_MAX); v += stride)
+    row.centi[row.channels++] = (int16_t)(record[5 + 2 * v] | (record[6 + 2 * v] << 8));
+  return true;
+}
+
+// The last row at or before time t in the log files. Leaves the card file
+// as it was if there is none.
+boolean cardSeek(uint32_t t, LogRow &row)
+{
+  char name[20];
+  char keep[20];
+  uint32_t offset;
+  LogRow next;
+
+  strcpy(keep, cardName);
+  // The rows after an index entry can all be later than t when the file
+  // was opened before its first row; then try the entry before
+  for(byte tries = 0; tries < 4; tries++)
+  {
+    uint32_t when = logIndexFind(t, name, &offset);
+    if((when == 0) || !cardOpen(name))
+      break;
+    boolean found = false;
+    while(cardReadRow(offset, next) && (next.time <= t))
+    {
+      row = next;
+      found = true;
+      offset += next.length;
+    }
+    if(found)
+      return true;
+    t = when - 1;
+  }
+  if(keep[0])
+    cardOpen(keep);
+  return false;
+}
+
+// The row before row in the log files
+boolean cardPrevRow(LogRow &row)
+{
+  LogRow prev;
+  uint32_t start = row.offset;
+
+  if(strchr(cardName, '.')[1] == 'B')
+  {
+    // Records in a file are mostly the same size
+    if(start >= row.length)
+      start -= row.length;
+  }
+  else if(start > 0)
+  {
+    // back over the '\n' of the row before, to the one before that
+    start--;
+    for(byte back = 0; (start > 0) && (back < LOG_ROW_TEXT_MAX); back++)
+    {
+      if(cardCache.get(cardFile, start - 1) == '\n')
+        break;
+      start--;
+    }
+  }
+  if((start < row.offset) && cardReadRow(start, prev) &&
+      (prev.offset + prev.length == row.offset))
+  {
+    row = prev;
+    return true;
+  }
+  // First row of its file, or a record of another size
+  return cardSeek(row.time - 1, row);
+}
+
+// The row after row in the log files
+boolean cardNextRow(LogRow &row)
+{
+  char name[20];
+  char keep[20];
+  uint32_t offset;
+  LogRow next;
+
+  if(cardReadRow(row.offset + row.length, next))
+  {
+    row = next;
+    return true;
+  }
+  // End of its file: on in the next one the index knows
+  strcpy(keep, cardName);
+  if(logIndexNextFile(row.time, cardName, name, &offset) && cardOpen(name) &&
+      cardReadRow(offset, next))
+  {
+    row = next;
+    return true;
+  }
+  if(keep[0])
+    cardOpen(keep);
+  return false;
+}
+
+// Answer a request and send what is waiting, as far as it goes without
+// waiting for the UART. Replies go first, then samples, then downloads.
+void serialProcess()
+{
+  if(!serialLink.ready() || (Serial.available() > 0))
+    serialLastMs = millis();
+  serialLink.pump();
+  if(!serialLink.ready())
+    return;
+  if(serialLink.receive())
+    serialRequest();
+  else if(linkSamplePending)
+    serialSample();
+  else if(linkDownload)
+    serialDownload();
+}
+
+// Whether serialProcess() has something to do now
+boolean serialBusy()
+{
+  if(!serialLink.ready())
+    return Serial.availableForWrite() > 0;
+  return (Serial.available() > 0) || linkSamplePending || linkDownload;
+}
+
+void serialRequest()
+{
+  const byte *in = serialLink.payload();
+  byte *out = serialLink.sendBuffer();
+  byte type = serialLink.type();
+  byte length = 0;
+
+  switch(type)
+  {
+  case LINK_PING:
+    out[length++] = LINK_VERSION;
+    break;
+  case LINK_STATUS:
+    length = serialStatus(out);
+    break;
+  case LINK_SETTINGS:
+  {
+    uint16_t from = (serialLink.length() >= 2) ? in[0] | (in[1] << 8) : 0;
+    out[0] = from & 0xFF;
+    out[1] = from >> 8;
+    length = 2 + settingsWindow(from, out + 2, LINK_PAYLOAD_MAX - 2);
+    break;
+  }
+  case LINK_SET:
+  {
+    // name=value
+    char text[SETTING_NAME_MAX + SETTING_VALUE_MAX + 2];
+    byte n = serialLink.length();
+    if(n >= sizeof(text))
+      n = sizeof(text) - 1;
+    memcpy(text, in, n);
+    text[n] = 0;
+    char *value = strchr(text, '=');
+    int oldFormat = logFormat;
+    out[length++] = false;
+    if(value)
+    {
+      *value++ = 0;
+      out[0] = settingApply(text, value);
+    }
+    if(logFormat != oldFormat)
+      logOpen();
+    scheduleEvent(updateScreen, 1);
+    break;
+  }
+  case LINK_SUBSCRIBE:
+    linkSubscribed = (serialLink.length() > 0) && in[0];
+    out[length++] = linkSubscribed;
+    break;
+  case LINK_DOWNLOAD:
+    if(serialLink.length() < 8)
+      break;
+    // A new download replaces one that is still going, which ends with
+    // LINK_END_CANCELLED; no reply, the LINK_FILE, LINK_DATA and LINK_END
+    // frames are the answer
+    serialDownloadStart(logGet32(in), logGet32(in + 4), serialLink.seq());
+    return;
+  case LINK_STORE:
+    scheduleEvent(settingsStore, 1);
+    out[length++] = true;
+    break;
+  default:
+    out[0] = type;
+    serialLink.send(LINK_UNKNOWN, serialLink.seq(), out, 1);
+    return;
+  }
+  serialLink.send(type | LINK_REPLY, serialLink.seq(), out, length);
+}
+
+// time, samples taken, relay outputs, card in use, channels, 1/100 degC
+// per channel, zones, mode and target (1/100 degC) per zone
+byte serialStatus(byte *out)
+{
+  byte n = 0;
+  logPut32(out + n, sampleTime);
+  n += 4;
+  logPut32(out + n, samplesTaken);
+  n += 4;
+  out[n++] = relayOutputs;
+  out[n++] = liveWrite;
+  out[n++] = sensorCount;
+  for(int c = 0; c < sensorCount; c++)
+  {
+    out[n++] = sampleCenti[c] & 0xFF;
+    out[n++] = (sampleCenti[c] >> 8) & 0xFF;
+  }
+  out[n++] = zoneCount;
+  for(int z = 0; z < zoneCount; z++)
+  {
+    int16_t target = zones[z].settings[0];
+    out[n++] = zones[z].mode;
+    out[n++] = target & 0xFF;
+    out[n++] = (target >> 8) & 0xFF;
+  }
+  return n;
+}
+
+void serialSample()
+{
+  byte *out = serialLink.sendBuffer();
+  byte n = 0;
+  logPut32(out + n, sampleTime);
+  n += 4;
+  out[n++] = relayOutputs;
+  for(int c = 0; c < sensorCount; c++)
+  {
+    out[n++] = sampleCenti[c] & 0xFF;
+    out[n++] = (sampleCenti[c] >> 8) & 0xFF;
+  }
+  serialLink.send(LINK_SAMPLE, 0, out, n);
+  linkSamplePending = false;
+}
+
+void serialDownloadStart(uint32_t from, uint32_t to, byte seq)
+{
+  if(linkDownload)
+  {
+    byte *out = serialLink.sendBuffer();
+    out[0] = LINK_END_CANCELLED;
+    serialLink.send(LINK_END, linkSeq, out, 1);
+  }
+  linkFile.close();
+  linkSeq = seq;
+  linkDownload = true;
+  linkEnd = -1;
+  // From the last index entry before the range, or the first one in it
+  linkEntryTime = logIndexFind(from, linkName, &linkOffset);
+  if(!linkEntryTime)
+    linkEntryTime = logIndexFind(from, linkName, &linkOffset, true);
+  if(!linkEntryTime || (linkEntryTime > to))
+    linkEnd = LINK_END_EMPTY;
+  if(!logIndexFind(to, linkEndName, &linkEndOffset, true))
+    linkEndName[0] = 0;
+}
+
+// The next frame of the download
+void serialDownload()
+{
+  byte *out = serialLink.sendBuffer();
+  boolean last = !strcmp(linkName, linkEndName);
+
+  if(linkEnd < 0 && last && (linkOffset >= linkEndOffset))
+    linkEnd = LINK_END_DONE;
+  if(linkEnd >= 0)
+  {
+    out[0] = linkEnd;
+    serialLink.send(LINK_END, linkSeq, out, 1);
+    linkFile.close();
+    linkDownload = false;
+    return;
+  }
+  if(!linkFile)
+  {
+    linkFile = sdOpen(linkName);
+    if(!linkFile || !linkFile.seek(linkOffset))
+    {
+      linkEnd = LINK_END_ERROR;
+      return;
+    }
+    byte n = strlen(linkName);
+    serialLink.send(LINK_FILE, linkSeq, (const byte *)linkName, n);
+    return;
+  }
+
+  uint32_t want = LINK_PAYLOAD_MAX - 4;
+  if(last && (linkEndOffset - linkOffset < want))
+    want = linkEndOffset - linkOffset;
+  int got = linkFile.read(out + 4, want);
+  if(got <= 0)
+  {
+    // End of this file: on with the next one the index knows
+    char name[20];
+    linkFile.close();
+    linkEntryTime = logIndexNextFile(linkEntryTime, linkName, name, &linkOffset);
+    if(!linkEntryTime || last)
+      linkEnd = LINK_END_DONE;
+    else
+      strcpy(linkName, name);
+    return;
+  }
+  logPut32(out, linkOffset);
+  linkOffset += got;
+  serialLink.send(LINK_DATA, linkSeq, out, got + 4);
+}
+
+void fpFlushLog()
+{
+  if(liveWrite)
+    logfile.flush();
+}
+
+void fpManageSD(){
+  // This function is called after the toggle was pressed.
+  // Set the SD to the correct state now
+  if(liveWrite)
+  {
+    if (!SD.begin(10,11,12,13)) {
+      setMessage("SD init failed");
+      liveWrite = false;
+    }
+    else
+    {
+      // On startup the log opens once the settings are loaded
+      if(startupSettingsLoaded)
+      {
+        logRecover();
+        logOpen();
+      }
+      else
+      {
+        logRecoverPending = true;
+        scheduleEvent(settingsLoad, 1);
+      }
+    }
+  }
+  else
+  {
+    logfile.close();
+    SD.end();
+  }
+
+  // Regardless whether or not it worked:
+  startupSettingsLoaded = true;
+}
+
+/// Software: helper to get index position
+
+
+/// Software: Screen messages on errors etc
+void setMessage(String msg){
+  message = msg;
+  handleUi(UI_LEAVE);
+  uiTarget = UIT_MESSAGE;
+  scheduleEvent(updateScreen, 1);
+}
+
+/// Input queue
+// Called from the interrupt handlers only
+void inputPush(byte action)
+{
+	byte next = (inputHead + 1) & (INPUT_QUEUE_SIZE - 1);
+	if(next == inputTail)
 	{
-	case RET_HOME:
-		(uiTargets[uiTarget])(UI_LEAVE);
-		uiTarget = UIT_TEMP_DISPLAY;
-		(uiTargets[uiTarget])(UI_ENTER);
-	    scheduleEvent(updateScreen, 1);
-		break;
-	case RET_CONTINUE:
-		(uiTargets[uiTarget])(UI_LEAVE);
-		uiTarget = uiTargetContinueMap[uiTarget];
-		(uiTargets[uiTarget])(UI_ENTER);
-	    scheduleEvent(updateScreen, 1);
-		break;
-	case RET_STAY:
-		break;
+		// Queue full: loop() is stuck in a long event. Drop and count it.
+		inputOverflows++;
+		return;
 	}
+	inputQueue[inputHead] = action;
+	inputHead = next;
 }
 
-int uiTempDisplay(int action)
+// Called from loop() only
+void inputProcess()
 {
-	int ret = 0;
-	int sp = screenPos;
-	switch(action)
+	while(inputTail != inputHead)
 	{
-	case UI_LEAVE:
-		// in this case, do nothing because the difference is handled
-		// by UI_ENC_SW vs UI_CLEAR
-		break;
-	case UI_ENTER:
-		break;
-	case UI_ENC_UP:
-		sp -= 1;
-		if(sp < 0) sp = 0;
-		screenPos = sp;
-	    scheduleEvent(updateScreen, 1);
-		break;
-	case UI_ENC_DOWN:
-		sp += 1;
-		screenPos = sp;
-	    scheduleEvent(updateScreen, 1);
-		break;
-	case UI_ENC_SW:
-		ret = RET_CONTINUE;
-		break;
-	case UI_CLEAR:
-		toggleWriteMode();
-		break;
-	case UI_DISPLAY:
-		mainDisplay();
-		break;
+		byte action = inputQueue[inputTail];
+		inputTail = (inputTail + 1) & (INPUT_QUEUE_SIZE - 1);
+		uiEncoderSteps = (action >> INPUT_STEPS_SHIFT) ? (action >> INPUT_STEPS_SHIFT) : 1;
+		handleUi(action & INPUT_ACTION_MASK);
 	}
-	return(ret);
+	uiEncoderSteps = 1;
+}
+
+/// Encoder: rotator handling
+// The handlers only queue the action; handleUi() runs in loop()
+
+// Interrupt on A or B changing state
+void doEncoder(){
+  byte state = (digitalRead(encoderPinA) << 1) | digitalRead(encoderPinB);
+  if( state == encoderState )
+    return;
+  int8_t step = (int8_t)pgm_read_byte(&encoderSteps[(encoderState << 2) | state]);
+  if( step == 0 )
+    DIAG_BOUNCE(); // both pins changed: an edge was missed
+  encoderState = state;
+  encoderCount += step;
+  if( state != ENCODER_REST )
+    return;
+
+  // back at rest: a detent, or a bounce that went nowhere
+  int8_t dir = (encoderCount >= 2) ? 1 : (encoderCount <= -2) ? -1 : 0;
+  encoderCount = 0;
+  if( dir == 0 ) {
+    DIAG_BOUNCE();
+    return;
+  }
+
+  // the faster the turn, the bigger the steps
+  unsigned long ms = millis();
+  unsigned long dt = ms - encoderLastMs;
+  byte steps = 1;
+  if( dir == encoderLastDir ) {
+    if( dt * ENCODER_STEPS_MAX <= ENCODER_ACCEL_MS )
+      steps = ENCODER_STEPS_MAX;
+    else if( dt < ENCODER_ACCEL_MS )
+      steps = ENCODER_ACCEL_MS / dt;
+  }
+  encoderLastMs = ms;
+  encoderLastDir = dir;
+  inputPush(((dir > 0) ? UI_ENC_UP : UI_ENC_DOWN) | (steps << INPUT_STEPS_SHIFT));
+}
+
+void doEncSw(){
+	unsigned long ms = millis();
+	if(ms - lastButtonPress < DEBOUNCE_DELAY) return;
+	lastButtonPress = ms;
+	inputPush(UI_ENC_SW);
 }
 
-int uiLoggerSettings(int action)
+void doClearButton()
 {
-	//static int intvSet;
-	int ret = 0;
-	long li = logInterval;
-	switch(action)
+	unsigned long ms = millis();
+	// debounce
+	if(ms - lastButtonPress < DEBOUNCE_DELAY) return;
+	lastButtonPress = ms;
+	inputPush(UI_CLEAR);
+}
+
+
+/// UI pages
+// A page is either a handler of its own (the main screen, messages) or
+// edited by uiEdit(): up to UI_FIELDS_MAX values, one after the other,
+// each between min and max and changed by step per detent, clamped or
+// wrapping around. Entering the page, load() fills them in (or var, if
+// there is one, the first). The switch hands them to var and apply() and
+// goes on to the next field, and after the last one to the next page.
+// CLEAR goes home without applying the field at hand. The table lives in
+// flash; uiEditState holds the values of the page being edited.
+#define UI_FIELDS_MAX 4
+#define UIP_WRAP 1 // past max is min and the other way round
+
+struct UiEdit {
+	int16_t value[UI_FIELDS_MAX];
+	int16_t max; // the page's max, unless load() has a better one
+	byte field;
+};
+UiEdit uiEditState;
+
+typedef int (* UiTarget) (int); // takes a UiAction, returns a UiResult
+struct UiPage {
+	int8_t page; // its UiTargets, to check the order
+	int8_t next; // UiTargets on RET_CONTINUE
+	byte fields;
+	byte flags;
+	int16_t min, max, step;
+	volatile int *var;
+	UiTarget handler; // uiEdit() for the edited pages
+	void (*load)(struct UiEdit &);
+	int (*apply)(struct UiEdit &); // a UiTargets to go to, UIT_NEXT or UIT_STAY
+	void (*show)(const struct UiEdit &);
+};
+
+constexpr UiPage uiCustom(int8_t page, UiTarget handler, int8_t next)
+{
+	return UiPage { page, next, 0, 0, 0, 0, 0, NULL, handler, NULL, NULL, NULL };
+}
+constexpr UiPage uiEditor(int8_t page, byte fields, int16_t min, int16_t max, int16_t step,
+		byte flags, volatile int *var, void (*load)(UiEdit &), int (*apply)(UiEdit &),
+		void (*show)(const UiEdit &), int8_t next)
+{
+	return UiPage { page, next, fields, flags, min, max, step, var, &uiEdit, load, apply, show };
+}
+
+constexpr UiPage uiPages[UIT_PAGES_NO] PROGMEM = {
+		uiCustom(UIT_TEMP_DISPLAY, &uiTempDisplay, UIT_STATISTICS),
+		uiEditor(UIT_LOGGER_SETTINGS, 1, 5, 1000, 1, 0, &logInterval,
+				NULL, &uiLoggerApply, &uiLoggerShow, UIT_THERMOSTAT_SETTINGS),
+		uiCustom(UIT_MESSAGE, &uiMessage, UIT_DUMMY), // always goes home
+		uiEditor(UIT_THERMOSTAT_SETTINGS, 4, -10000, 20000, 10, 0, NULL,
+				&uiThermostatLoad, &uiThermostatApply, &uiThermostatShow, UIT_THERMOSTAT_MODE),
+		uiEditor(UIT_THERMOSTAT_MODE, 1, 0, THERMOSTAT_MODES_NO - 1, 1, UIP_WRAP, NULL,
+				&uiModeLoad, &uiModeApply, &uiModeShow, UIT_LOAD_STORE_SETTINGS),
+		uiEditor(UIT_LOAD_STORE_SETTINGS, 1, 0, 2, 1, UIP_WRAP, NULL,
+				NULL, &uiLoadStoreApply, &uiLoadStoreShow, UIT_TEMP_DISPLAY),
+		// one view per channel, one per zone, time asleep, and one to reset
+		uiEditor(UIT_STATISTICS, 1, 0, 0, 1, UIP_WRAP, NULL,
+				&uiStatisticsLoad, &uiStatisticsApply, &uiStatisticsShow,
+#if DIAGNOSTICS
+				UIT_DIAGNOSTICS),
+		// times and histogram of each slot, then the encoder
+		uiEditor(UIT_DIAGNOSTICS, 1, 0, 2 * DIAG_SLOTS_NO, 1, UIP_WRAP, NULL,
+				NULL, NULL, &uiDiagnosticsShow, UIT_LOGGER_SETTINGS),
+#else
+				UIT_LOGGER_SETTINGS),
+#endif
+};
+
+constexpr boolean uiPagesInOrder(int n)
+{
+	return (n >= UIT_PAGES_NO) || ((uiPages[n].page == n) && uiPagesInOrder(n + 1));
+}
+static_assert(uiPagesInOrder(0), "uiPages must be in UiTargets order");
+
+UiTarget uiHandler(int page)
+{
+	return (UiTarget)pgm_read_ptr(&uiPages[page].handler);
+}
+
+void handleUi(int action)
+{
+	switch(uiHandler(uiTarget)(action))
 	{
-	case UI_LEAVE:
-		// in this case, do nothing because the difference is handled
-		// by UI_ENC_SW vs UI_CLEAR
-		break;
-	case UI_ENTER:
-		break;
-	case UI_ENC_UP:
-		li += 1;
-		if(li > 1000) li = 1000;
-		logInterval = li;
-	    scheduleEvent(updateScreen, 1);
-		break;
-	case UI_ENC_DOWN:
-		li -= 1;
-		if(li < 5) li = 5;
-		logInterval = li;
-	    scheduleEvent(updateScreen, 1);
-		break;
-	case UI_ENC_SW:
-		scheduleTime[cycle] = 1000 * li;
-		scheduleEvent(cycle, scheduleTime[cycle]);
-		ret = RET_CONTINUE;
+	case RET_HOME:
+		uiGoTo(UIT_TEMP_DISPLAY);
 		break;
-	case UI_CLEAR:
-		ret = RET_HOME;
+	case RET_CONTINUE:
+		uiGoTo((int8_t)pgm_read_byte(&uiPages[uiTarget].next));
 		break;
-	case UI_DISPLAY:
-		lcd.setCursor(0,0);
-		lcd.print("Interval:");
-		lcd.setCursor(0,1);
-		lcd.print(logInterval);
-		lcd.print(" ");
-		lcd.print(scheduleTime[cycle]);
+	case RET_STAY:
 		break;
 	}
-	return(ret);
 }
 
-int uiMessage(int action)
+void uiGoTo(int page)
+{
+	uiHandler(uiTarget)(UI_LEAVE);
+	uiTarget = page;
+	uiHandler(uiTarget)(UI_ENTER);
+	scheduleEvent(updateScreen, 1);
+}
+
+// Handler of the pages that are described in uiPages only
+int uiEdit(int action)
 {
 	int ret = RET_STAY;
-	long li = logInterval;
+	UiPage p;
+	UiEdit &e = uiEditState;
+	memcpy_P(&p, &uiPages[uiTarget], sizeof(p));
+
 	switch(action)
 	{
 	case UI_LEAVE:
 		break;
 	case UI_ENTER:
+		memset(&e, 0, sizeof(e));
+		e.max = p.max;
+		if(p.var)
+			e.value[0] = *p.var;
+		if(p.load)
+			p.load(e);
 		break;
 	case UI_ENC_UP:
-		break;
 	case UI_ENC_DOWN:
+	{
+		// Values speed up with the encoder, views and choices do not
+		int step = (p.flags & UIP_WRAP) ? p.step : p.step * uiEncoderSteps;
+		int v = e.value[e.field] + ((action == UI_ENC_UP) ? step : -step);
+		if(v > e.max)
+			v = (p.flags & UIP_WRAP) ? p.min : e.max;
+		else if(v < p.min)
+			v = (p.flags & UIP_WRAP) ? e.max : p.min;
+		e.value[e.field] = v;
+		scheduleEvent(updateScreen, 1);
 		break;
+	}
 	case UI_ENC_SW:
-		ret = RET_HOME;
+	{
+		if(p.var)
+			*p.var = e.value[0];
+		int to = p.apply ? p.apply(e) : UIT_NEXT;
+		if(to >= 0)
+			uiGoTo(to);
+		else if((to == UIT_NEXT) && (++e.field >= p.fields))
+			ret = RET_CONTINUE;
+		else
+			scheduleEvent(updateScreen, 1);
 		break;
+	}
 	case UI_CLEAR:
 		ret = RET_HOME;
 		break;
 	case UI_DISPLAY:
-	    lcd.print(message);
-	    break;
+		p.show(e);
+		break;
 	}
 	return(ret);
 }
 
-int uiThermostatSettings(int action)
+int uiTempDisplay(int action)
 {
-	int ret = RET_STAY;
-	static float s[4];
-	static int sPos = 0;
-
+	int ret = 0;
+	int sp = screenPos;
 	switch(action)
 	{
 	case UI_LEAVE:
+		// in this case, do nothing because the difference is handled
+		// by UI_ENC_SW vs UI_CLEAR
 		break;
 	case UI_ENTER:
-		for(int c = 0; c < 4; c++)
+		break;
+	case UI_ENC_UP:
+		if(scrollStep != SCROLL_ROW)
+			scrollTo(scrollTime() + scrollStepSeconds[scrollStep]);
+		else if(cardView)
+		{
+			// Back to RAM where the card catches up with it
+			LogRow row = cardRow;
+			if(cardNextRow(row) && (row.time < history.time(history.size() - 1)))
+				cardRow = row;
+			else
+			{
+				cardClose();
+				screenPos = history.size() - 1;
+			}
+		}
+		else
 		{
-			s[c] = thermostatSettings[c];
+			sp -= 1;
+			if(sp < 0) sp = 0;
+			screenPos = sp;
 		}
-		sPos = 0;
-		break;
-	case UI_ENC_UP:
-		s[sPos] += 0.1;
 	    scheduleEvent(updateScreen, 1);
 		break;
 	case UI_ENC_DOWN:
-		s[sPos] -= 0.1;
+		if(scrollStep != SCROLL_ROW)
+			scrollTo(scrollTime() - scrollStepSeconds[scrollStep]);
+		else if(cardView)
+			cardPrevRow(cardRow);
+		else if(sp + 1 < history.size())
+			screenPos = sp + 1;
+		else if(history.size() > 0)
+			scrollTo(history.time(history.size() - 1) - 1);
 	    scheduleEvent(updateScreen, 1);
 		break;
 	case UI_ENC_SW:
-		sPos++;
-		for(int c = 0; c < 4; c++)
+		// Scrolled back it changes the step, live it goes on
+		if((screenPos == 0) && !cardView)
 		{
-			thermostatSettings[c] = s[c];
-		}
-		if(sPos == 4)
+			scrollStep = SCROLL_ROW;
 			ret = RET_CONTINUE;
+		}
 		else
+		{
+			scrollStep = (scrollStep + 1) % SCROLL_STEPS_NO;
 		    scheduleEvent(updateScreen, 1);
+		}
 		break;
 	case UI_CLEAR:
-		ret = RET_HOME;
+		toggleWriteMode();
 		break;
 	case UI_DISPLAY:
-	    thermostatSettingsDisplay(s, sPos, -1);
-	    break;
+		mainDisplay();
+		break;
 	}
 	return(ret);
 }
 
-int uiLoadStoreSettings(int action)
+// Time of the row the main screen shows
+uint32_t scrollTime()
 {
-	int ret = RET_STAY;
-	static int option = 0;
+	if(cardView)
+		return cardRow.time;
+	if((screenPos == 0) || (history.size() == 0))
+		return sampleTime;
+	return history.time(screenPos);
+}
 
-	switch(action)
+// Show the newest row at or before t: live, from RAM or from the card
+void scrollTo(uint32_t t)
+{
+	uint16_t size = history.size();
+	if((size < 2) || (t >= history.time(0)))
 	{
-	case UI_LEAVE:
-		break;
-	case UI_ENTER:
-		option = 0;
-		break;
-	case UI_ENC_UP:
-		option++;
-		if(option > 2) option = 0;
-		scheduleEvent(updateScreen, 1);
-		break;
-	case UI_ENC_DOWN:
-		option--;
-		if(option < 0) option = 2;
-		scheduleEvent(updateScreen, 1);
-		break;
-	case UI_ENC_SW:
-		switch(option)
-		{
-		case 0:
-			break;
-		case 1:
-			scheduleEvent(settingsStore, 1);
-			break;
-		case 2:
-			scheduleEvent(settingsLoad, 1);
-			break;
-		}
-		ret = RET_CONTINUE;
-		break;
-	case UI_CLEAR:
-		ret = RET_HOME;
-		break;
-	case UI_DISPLAY:
-		lcd.setCursor(0,0);
-		lcd.print("Load/store:");
-		lcd.setCursor(0,1);
-		switch(option)
+		cardClose();
+		screenPos = 0;
+	}
+	else if(t >= history.time(size - 1))
+	{
+		// age 0 is shown as live, so from 1 on
+		uint16_t age = 1;
+		uint32_t at = history.older(0, history.time(0));
+		while(at > t)
 		{
-		case 0:
-			lcd.print("Cancel");
-			break;
-		case 1:
-			lcd.print("Store");
-			break;
-		case 2:
-			lcd.print("Load");
-			break;
+			at = history.older(age, at);
+			age++;
 		}
-		ret = RET_STAY;
-		break;
+		cardClose();
+		screenPos = age;
 	}
-	return(ret);
+	else if(cardSeek(t, cardRow))
+		cardView = true;
+	else if(!cardView)
+		// nothing older on the card
+		screenPos = size - 1;
 }
 
-int uiThermostatMode(int action)
+int uiMessage(int action)
 {
 	int ret = RET_STAY;
-	static int thMode = 0;
-
+	long li = logInterval;
 	switch(action)
 	{
 	case UI_LEAVE:
 		break;
 	case UI_ENTER:
-		thMode = thermostatMode;
 		break;
 	case UI_ENC_UP:
-		thMode++;
-		if(thMode > 3)
-			thMode = 0;
-	    scheduleEvent(updateScreen, 1);
 		break;
 	case UI_ENC_DOWN:
-		thMode--;
-		if(thMode < 0)
-			thMode = 3;
-		scheduleEvent(updateScreen, 1);
 		break;
 	case UI_ENC_SW:
-		thermostatMode = thMode;
-		ret = RET_CONTINUE;
+		ret = RET_HOME;
 		break;
 	case UI_CLEAR:
 		ret = RET_HOME;
 		break;
 	case UI_DISPLAY:
-	    thermostatSettingsDisplay(NULL, -1, thMode);
+	    lcd.print(message);
 	    break;
 	}
 	return(ret);
 }
 
+// Logger settings: the log interval (var), in s
+int uiLoggerApply(UiEdit &)
+{
+	scheduleTime[logRow] = 1000L * logInterval;
+	scheduleEvent(logRow, scheduleTime[logRow]);
+	uiZone = 0;
+	return UIT_NEXT;
+}
+
+void uiLoggerShow(const UiEdit &e)
+{
+	lcd.setCursor(0,0);
+	lcd.print("Interval:");
+	lcd.setCursor(0,1);
+	lcd.print(e.value[0]);
+	lcd.print(" ");
+	lcd.print(scheduleTime[logRow]);
+}
+
+// Thermostat settings of uiZone: target, range, overshoot, undershoot
+void uiThermostatLoad(UiEdit &e)
+{
+	for(int c = 0; c < 4; c++)
+		e.value[c] = zones[uiZone].settings[c];
+}
+
+int uiThermostatApply(UiEdit &e)
+{
+	for(int c = 0; c < 4; c++)
+		zones[uiZone].settings[c] = e.value[c];
+	return UIT_NEXT;
+}
+
+void uiThermostatShow(const UiEdit &e)
+{
+	thermostatSettingsDisplay(e.value, e.field, -1);
+}
+
+// Thermostat mode of uiZone
+void uiModeLoad(UiEdit &e)
+{
+	e.value[0] = zones[uiZone].mode;
+}
+
+int uiModeApply(UiEdit &e)
+{
+	zones[uiZone].mode = e.value[0];
+	if(uiZone + 1 < zoneCount)
+	{
+		// On to the settings of the next zone
+		uiZone++;
+		return UIT_THERMOSTAT_SETTINGS;
+	}
+	return UIT_NEXT;
+}
+
+void uiModeShow(const UiEdit &e)
+{
+	thermostatSettingsDisplay(NULL, -1, e.value[0]);
+}
+
+// Load/store settings: cancel, store, load
+int uiLoadStoreApply(UiEdit &e)
+{
+	if(e.value[0] == 1)
+		scheduleEvent(settingsStore, 1);
+	else if(e.value[0] == 2)
+		scheduleEvent(settingsLoad, 1);
+	return UIT_NEXT;
+}
+
+void uiLoadStoreShow(const UiEdit &e)
+{
+	static const char * const options[3] = { "Cancel", "Store", "Load" };
+	lcd.setCursor(0,0);
+	lcd.print("Load/store:");
+	lcd.setCursor(0,1);
+	lcd.print(options[e.value[0]]);
+}
+
+// Statistics: the views of statisticsDisplay(), the last one resets
+void uiStatisticsLoad(UiEdit &e)
+{
+	e.max = sensorCount + zoneCount + 1;
+}
+
+int uiStatisticsApply(UiEdit &e)
+{
+	if(e.value[0] < e.max)
+		return UIT_NEXT;
+	statsReset();
+	return UIT_STAY;
+}
+
+void uiStatisticsShow(const UiEdit &e)
+{
+	int last = sensorCount + zoneCount + 1;
+	statisticsDisplay(e.value[0] < last ? e.value[0] : last);
+}
+
+#if DIAGNOSTICS
+void uiDiagnosticsShow(const UiEdit &e)
+{
+	diagnosticsDisplay(e.value[0]);
+}
+#endif
+
 
 void mainDisplay()
 {
     char outString[16];
 
-    byte screenBufPos = bufferPos - screenPos;
-    DateTime ts = tsBuffer[screenBufPos];
-    float tAir = dataBuffer[screenBufPos][0];
-    float tLiquid = dataBuffer[screenBufPos][1];
+    if(samplesTaken == 0)
+    {
+    	lcd.setCursor(0,0);
+    	lcd.print("No samples yet");
+    	return;
+    }
+    // Live: the newest sample. Scrolled back: the log rows, from RAM and
+    // then from the card.
+    unsigned int age = screenPos;
+    if(age >= history.size()) age = history.size() - 1;
+    boolean live = ((screenPos == 0) || (history.size() == 0)) && !cardView;
+    DateTime ts = DateTime(cardView ? cardRow.time : live ? sampleTime : history.time(age));
      lcd.setCursor(0,0);
 
-     lcd.print(screenBufPos);
+     // Log row number, last 3 digits; rows from the card have none
+     if(cardView)
+    	 lcd.print("SD");
+     else
+    	 lcd.print((bufferPos - (live ? 0 : age)) % 1000);
 
+     // Two channels at a time; more than that take turns, with the number
+     // of the first one shown at the end of the line
+     int first = 0;
+     if(sensorCount > 2)
+     {
+    	 first = 2 * ((millis() / SENSOR_PAGE_MS) % ((sensorCount + 1) / 2));
+    	 lcd.setCursor(14,0);
+    	 lcd.print('#');
+    	 lcd.print(first);
+     }
      lcd.setCursor(4,0);
-     //sprintf(outString, "%4.1f", tAir);
-     lcd.print(tAir,1);
-     lcd.print(" ");
-     //sprintf(outString, "%4.1f", tLiquid);
-     //lcd.print(outString);
-     lcd.print(tLiquid,1);
-
+     for(int c = first; (c < first + 2) && (c < sensorCount); c++)
+     {
+    	 int16_t centi = live ? sampleCenti[c] : !cardView ? history.temp(age, c) :
+    			 (c < cardRow.channels) ? cardRow.centi[c] : DEVICE_DISCONNECTED_C * 100;
+    	 if(centi == DEVICE_DISCONNECTED_C * 100)
+    		 lcd.print("--.-");
+    	 else
+    		 centiPrint(lcd, centi, 1);
+    	 lcd.print(" ");
+     }
 
 
     lcd.setCursor(0,1);
@@ -899,13 +3250,14 @@ void mainDisplay()
     		ts.month(), ts.day(), ts.hour(), ts.minute(), ts.second());
     lcd.print(outString);
 
-    lcd.setCursor(15,1);
+    lcd.setCursor(14,1);
+    lcd.print(scrollStepMark[scrollStep]);
     if(liveWrite)
       lcd.print('W');
     else
       lcd.print('B');
 
-    if(screenPos == 0)
+    if(live)
     {
     	lcd.setCursor(0,0);
     	lcd.cursor();
@@ -916,17 +3268,152 @@ void mainDisplay()
     }
 }
 
-void thermostatSettingsDisplay(float * s, int sPos, int thMode)
+void statisticsDisplay(int view)
+{
+	char outString[17];
+
+	if(view < sensorCount)
+	{
+		// 0 18.0..19.4
+		// ~18.7  +0.35/h
+		ChannelStats &st = channelStats[view];
+		lcd.setCursor(0,0);
+		lcd.print(view);
+		lcd.setCursor(2,0);
+		if(st.count == 0)
+		{
+			lcd.print("no samples");
+			return;
+		}
+		centiPrint(lcd, st.min, 1);
+		lcd.print("..");
+		centiPrint(lcd, st.max, 1);
+		lcd.setCursor(0,1);
+		lcd.print('~');
+		centiPrint(lcd, st.sum / (int64_t)st.count, 1);
+		lcd.setCursor(7,1);
+		long rate = (st.rate + (st.rate < 0 ? -512 : 512)) / 1024;
+		if(rate >= 0)
+			lcd.print('+');
+		centiPrint(lcd, rate, 2);
+		lcd.print("/h");
+	}
+	else if(view < sensorCount + zoneCount)
+	{
+		// Zone0 duty 34%
+		// last hour  40%
+		int z = view - sensorCount; // < ZONE_MAX, one digit
+		ZoneStats &zs = zoneStats[z];
+		unsigned int duty = zs.seconds ? 100 * (uint64_t)zs.onSeconds / zs.seconds : 0;
+		unsigned int hour = (zs.duty + (5L << 10)) / (10L << 10);
+		if(duty > 100) duty = 100;
+		if(hour > 100) hour = 100;
+		lcd.setCursor(0,0);
+		snprintf(outString, sizeof(outString), "Zone%c duty %3u%%", '0' + z, duty);
+		lcd.print(outString);
+		lcd.setCursor(0,1);
+		snprintf(outString, sizeof(outString), "last hour  %3u%%", hour);
+		lcd.print(outString);
+	}
+	else if(view == sensorCount + zoneCount)
+	{
+		// Asleep    97.2%
+		// dn  95% idle  2%
+		powerCount();
+		unsigned long total = powerTotalMs ? powerTotalMs : 1;
+		// per mille
+		unsigned int down = (uint64_t)1000 * powerDownMs / total;
+		unsigned int idle = (uint64_t)1000 * powerIdleMs / total;
+		if(down > 1000)
+			down = 1000;
+		if(idle > 1000 - down)
+			idle = 1000 - down;
+		lcd.setCursor(0,0);
+		snprintf(outString, sizeof(outString), "Asleep    %3u.%u%%",
+				(down + idle) / 10, (down + idle) % 10);
+		lcd.print(outString);
+		lcd.setCursor(0,1);
+		snprintf(outString, sizeof(outString), "dn %3u%% idle%3u%%", (down + 5) / 10, (idle + 5) / 10);
+		lcd.print(outString);
+	}
+	else
+	{
+		// Reset stats
+		// since 2d 04h
+		unsigned long age = RTC.now().unixtime() - statsSince;
+		lcd.setCursor(0,0);
+		lcd.print("Reset stats");
+		lcd.setCursor(0,1);
+		if(age >= 86400UL)
+			sprintf(outString, "since %lud %02luh", age / 86400UL, (age / 3600UL) % 24);
+		else
+			sprintf(outString, "since %luh %02lum", age / 3600UL, (age / 60UL) % 60);
+		lcd.print(outString);
+	}
+}
+
+#if DIAGNOSTICS
+void diagnosticsDisplay(int view)
+{
+	char outString[17];
+	char a[5], b[5], c[5];
+
+	if(view < 2 * DIAG_SLOTS_NO)
+	{
+		// logRow   late  0
+		//  85u ~120u ^1.2m   (even views)
+		// 64u 19310000  x4   (odd views: histogram from 64 us, 9: the most)
+		DiagTimes &d = diagTimes[view / 2];
+		lcd.setCursor(0,0);
+		sprintf(outString, "%-8.8s late%3lu", diagNames[view / 2], d.late < 999 ? d.late : 999UL);
+		lcd.print(outString);
+		lcd.setCursor(0,1);
+		if(d.count == 0)
+			lcd.print("never ran");
+		else if(view % 2 == 0)
+		{
+			sprintf(outString, "%s ~%s ^%s", diagFormatUs(a, d.minUs),
+					diagFormatUs(b, d.sumUs / d.count), diagFormatUs(c, d.maxUs));
+			lcd.print(outString);
+		}
+		else
+		{
+			uint16_t most = 1;
+			for(byte n = 0; n < DIAG_BUCKETS; n++)
+				if(d.buckets[n] > most) most = d.buckets[n];
+			char bars[DIAG_BUCKETS + 1];
+			for(byte n = 0; n < DIAG_BUCKETS; n++)
+				bars[n] = d.buckets[n] ? '1' + (uint32_t)8 * d.buckets[n] / most : '.';
+			bars[DIAG_BUCKETS] = 0;
+			sprintf(outString, "64u %s  x4", bars);
+			lcd.print(outString);
+		}
+	}
+	else
+	{
+		// Encoder lost   0
+		// bounces      12
+		lcd.setCursor(0,0);
+		sprintf(outString, "Encoder lost%4u", inputOverflows);
+		lcd.print(outString);
+		lcd.setCursor(0,1);
+		sprintf(outString, "bounces %8lu", diagBounces);
+		lcd.print(outString);
+	}
+}
+#endif
+
+void thermostatSettingsDisplay(const int16_t * s, int sPos, int thMode)
 {
 	char outString[25]; // just to be safe that we will never write into strange memory
 
 	if(s == NULL)
 	{
-		s = thermostatSettings;
+		s = zones[uiZone].settings;
 		sPos = -1;
 	}
 	else
-		thMode = thermostatMode;
+		thMode = zones[uiZone].mode;
 
 	// row 1: Set: 12.1 +- 0.3
 //	lcd.setCursor(0,0);
@@ -934,10 +3421,15 @@ void thermostatSettingsDisplay(float * s, int sPos, int thMode)
 //	lcd.print(outString);
 	lcd.setCursor(0,0);
 	lcd.print("Set:");
-	lcd.print(s[0], 1);
+	centiPrint(lcd, s[0], 1);
 	lcd.setCursor(9,0);
 	lcd.print("+-");
-	lcd.print(s[1],1);
+	centiPrint(lcd, s[1], 1);
+	if(zoneCount > 1)
+	{
+		lcd.setCursor(15,0);
+		lcd.print(uiZone);
+	}
 
 	// row 2: OS:0.1 US:0.1 H
 
@@ -946,13 +3438,13 @@ void thermostatSettingsDisplay(float * s, int sPos, int thMode)
 //	lcd.print(outString);
 	lcd.setCursor(0,1);
 	lcd.print("OS:");
-	lcd.print(s[2],1);
+	centiPrint(lcd, s[2], 1);
 	lcd.setCursor(7,1);
 	lcd.print("US:");
-	lcd.print(s[3],1);
+	centiPrint(lcd, s[3], 1);
 
 	lcd.setCursor(15,1);
-	// (last char "H": H for Heat, C for Cool, - for Off)
+	// (last char "H": H for Heat, C for Cool, - for Off, P for PID)
 	switch(thMode)
 	{
 	case THERMOSTAT_OFF:
@@ -967,6 +3459,9 @@ void thermostatSettingsDisplay(float * s, int sPos, int thMode)
 	case THERMOSTAT_ON:
 		lcd.print("+");
 		break;
+	case THERMOSTAT_PID:
+		lcd.print("P");
+		break;
 	}
 	// Set the cursor if appropriate
 	switch(sPos)
@@ -999,98 +3494,386 @@ void toggleWriteMode(){
 }
 
 
-void settingApply(String name, String value)
+// Binary search in the sorted settingNames, -1 if not found
+int settingFind(const char *name)
+{
+	int lo = 0;
+	int hi = SETTING_KEYS_NO - 1;
+	while(lo <= hi)
+	{
+		int mid = (lo + hi) / 2;
+		int c = strcmp(name, settingNames[mid]);
+		if(c == 0)
+			return mid;
+		if(c < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+	return -1;
+}
+
+// A temperature setting, kept exact in 1/100 degC
+boolean settingCenti(const char *value, int16_t &centi)
+{
+	const char *d = (*value == '-') ? value + 1 : value;
+	if(!isdigit(*d))
+		return false;
+	char *p = (char *)value;
+	int16_t v = centiParse(p);
+	if((*p != 0) || (v < -10000) || (v > 20000))
+		return false;
+	centi = v;
+	return true;
+}
+
+// Returns false for unknown names and values
+boolean settingApply(const char *name, const char *value)
 {
 
-	// For info:
-	//	float thermostatSettings[4] = {
-	//			0, // target temperature
-	//			1, // target temperature window
-	//			0, // temperature undershoot
-	//			0, // temperature overshoot
-	//	};
+	// Per channel settings have the channel number at the end of the name
+	char key[SETTING_NAME_MAX + 1];
+	int channel = -1;
+	int len = strlen(name);
+	while((len > 0) && isdigit(name[len - 1]))
+		len--;
+	if(len > SETTING_NAME_MAX)
+		return false;
+	memcpy(key, name, len);
+	key[len] = 0;
+	if(name[len])
+		channel = atoi(name + len);
+
+	int setting = settingFind(key);
+	boolean perChannel = (setting == SET_SENSOR) || (setting == SET_SENSOR_RES);
+	boolean perZone = settingPerZone(setting);
+	if(perZone)
+	{
+		if(channel < 0)
+			channel = 0;
+		if(channel >= ZONE_MAX)
+			return false;
+	}
+	else if(perChannel ? ((channel < 0) || (channel >= SENSOR_MAX)) : (channel >= 0))
+		return false;
+	ThermostatZone &zone = zones[perZone ? channel : 0];
 
-	if(name.equals("logInterval"))
+	switch(setting)
+	{
+	case SET_PID_INTERVAL:
+	{
+		int pi = atoi(value);
+		if((pi < 1) || (pi > PID_INTERVAL_MAX))
+			return false;
+		pidInterval = pi;
+		scheduleTime[pidControl] = 1000L * pi;
+		scheduleEvent(pidControl, scheduleTime[pidControl]);
+		break;
+	}
+	case SET_PID_KP:
+	case SET_PID_KI:
+	case SET_PID_KD:
+	{
+		// Bounds keep pidUpdate() within 32 bits
+		int k = atoi(value);
+		if((k < 0) || (k > 10000) || ((setting == SET_PID_KI) && (k > 1000)))
+			return false;
+		if(setting == SET_PID_KP)
+			zone.kp = k;
+		else if(setting == SET_PID_KI)
+			zone.ki = k;
+		else
+			zone.kd = k;
+		break;
+	}
+	case SET_PID_WINDOW:
+	case SET_PID_MIN_ON:
+	case SET_PID_MIN_OFF:
+	{
+		int sec = atoi(value);
+		if((sec < 0) || (sec > 3600) || ((setting == SET_PID_WINDOW) && (sec < 1)))
+			return false;
+		if(setting == SET_PID_WINDOW)
+			zone.pidWindow = sec;
+		else if(setting == SET_PID_MIN_ON)
+			zone.pidMinOn = sec;
+		else
+			zone.pidMinOff = sec;
+		break;
+	}
+	case SET_PID_COOL:
+		zone.pidCool = (atoi(value) != 0);
+		break;
+	case SET_LOG_INTERVAL:
 	{
-		int li = value.toInt();
+		int li = atoi(value);
+		if(li < 1)
+			return false;
 		logInterval = li;
-		scheduleTime[cycle] = 1000 * li;
+		scheduleTime[logRow] = 1000L * li;
+		scheduleEvent(logRow, scheduleTime[logRow]);
+		break;
+	}
+	case SET_SAMPLE_INTERVAL:
+	{
+		int si = atoi(value);
+		if(si < 1)
+			return false;
+		sampleInterval = si;
+		scheduleTime[cycle] = 1000L * si;
 		scheduleEvent(cycle, scheduleTime[cycle]);
+		break;
+	}
+	case SET_CONTROL_INTERVAL:
+	{
+		int ci = atoi(value);
+		if(ci < 0)
+			return false;
+		controlInterval = ci;
+		// 0: fpReadSensors() runs the control itself
+		scheduleTime[controlZones] = ci ? 1000L * ci : -1;
+		scheduleEvent(controlZones, ci ? scheduleTime[controlZones] : -1);
+		break;
+	}
+	case SET_LOG_MIN_MAX:
+		logMinMax = (atoi(value) != 0);
+		break;
+	case SET_POWER_SAVE:
+		if((value[0] < '0') || (value[0] > '0' + POWER_DOWN) || value[1])
+			return false;
+		powerMode = value[0] - '0';
+		break;
+	case SET_LOG_ROTATE:
+	{
+		int kb = atoi(value);
+		if(kb < 0)
+			return false;
+		logRotateKB = kb;
+		break;
+	}
+	case SET_LOG_FLUSH:
+	{
+		int lf = atoi(value);
+		if(lf < 1) lf = 1;
+		logFlushInterval = lf;
+		scheduleTime[flushLog] = 1000L * lf;
+		scheduleEvent(flushLog, scheduleTime[flushLog]);
+		break;
 	}
-	else if(name.equals("tempTarget"))
+	case SET_LOG_FORMAT:
+		if(strcmp(value, "B") == 0)
+			logFormat = LOG_BINARY;
+		else if(strcmp(value, "T") == 0)
+			logFormat = LOG_TEXT;
+		else
+			return false;
+		break;
+	case SET_SENSOR:
+	{
+		DeviceAddress address;
+		if(!sensorParseAddress(value, address))
+			return false;
+		// A sensor can only be on one channel
+		int old = sensorChannel(address);
+		if(old >= 0)
+			memset(sensorAddress[old], 0, sizeof(DeviceAddress));
+		memcpy(sensorAddress[channel], address, sizeof(DeviceAddress));
+		break;
+	}
+	case SET_SENSOR_RES:
+	{
+		int res = atoi(value);
+		if((res < 9) || (res > 12))
+			return false;
+		sensorResolution[channel] = res;
+		break;
+	}
+	case SET_TEMP_TARGET:
+		if(!settingCenti(value, zone.settings[0]))
+			return false;
+		break;
+	case SET_TEMP_RANGE:
+		if(!settingCenti(value, zone.settings[1]))
+			return false;
+		break;
+	case SET_TEMP_UNDERSHOOT:
+		if(!settingCenti(value, zone.settings[2]))
+			return false;
+		break;
+	case SET_TEMP_OVERSHOOT:
+		if(!settingCenti(value, zone.settings[3]))
+			return false;
+		break;
+	case SET_THERMOSTAT_MODE:
+		if(strcmp(value, "H") == 0)
+			zone.mode = THERMOSTAT_HEAT;
+		else if(strcmp(value, "C") == 0)
+			zone.mode = THERMOSTAT_COOL;
+		else if(strcmp(value, "X") == 0)
+			zone.mode = THERMOSTAT_OFF;
+		else if(strcmp(value, "O") == 0)
+			zone.mode = THERMOSTAT_ON;
+		else if(strcmp(value, "P") == 0)
+			zone.mode = THERMOSTAT_PID;
+		else
+			return false;
+		break;
+	case SET_ZONE_SENSOR:
 	{
-		thermostatSettings[0] = value.toFloat();
+		int c = atoi(value);
+		if((c < 0) || (c >= SENSOR_MAX))
+			return false;
+		zone.liquid = c;
+		break;
 	}
-	else if(name.equals("tempRange"))
+	case SET_ZONE_AIR:
 	{
-		thermostatSettings[1] = value.toFloat();
+		int c = atoi(value);
+		if((c < -1) || (c >= SENSOR_MAX))
+			return false;
+		zone.air = c;
+		break;
 	}
-	else if(name.equals("tempUndershoot"))
+	case SET_ZONES:
 	{
-		thermostatSettings[2] = value.toFloat();
+		int n = atoi(value);
+		if((n < 1) || (n > ZONE_MAX))
+			return false;
+		zoneCount = n;
+		break;
+	}
+	default:
+		return false;
 	}
-	else if(name.equals("tempOvershoot"))
+	return true;
+}
+
+
+// Keys that take a zone number (none: zone 0)
+boolean settingPerZone(int setting)
+{
+	switch(setting)
 	{
-		thermostatSettings[3] = value.toFloat();
+	case SET_PID_COOL:
+	case SET_PID_KD:
+	case SET_PID_KI:
+	case SET_PID_KP:
+	case SET_PID_MIN_OFF:
+	case SET_PID_MIN_ON:
+	case SET_PID_WINDOW:
+	case SET_TEMP_OVERSHOOT:
+	case SET_TEMP_RANGE:
+	case SET_TEMP_TARGET:
+	case SET_TEMP_UNDERSHOOT:
+	case SET_THERMOSTAT_MODE:
+	case SET_ZONE_AIR:
+	case SET_ZONE_SENSOR:
+		return true;
+	}
+	return false;
+}
 
+// Append "[name=value]" and a line break to the settings being stored
+void settingPrint(const char *name, const char *value)
+{
+	const char *parts[5] = { "[", name, "=", value, "]\r\n" };
+	for(int p = 0; p < 5; p++)
+	{
+		for(const char *c = parts[p]; *c; c++)
+		{
+			if(settingsOut.len == SETTINGS_WRITE_BLOCK)
+				settingsOutFlush();
+			settingsOut.buf[settingsOut.len++] = *c;
+		}
 	}
-	else if(name.equals("thermostatMode"))
+}
+
+void settingsOutFlush()
+{
+	settingsOut.crc = OneWire::crc16((const uint8_t *)settingsOut.buf,
+			settingsOut.len, settingsOut.crc);
+	if(settingsOut.window)
 	{
-		if(value.equals("H"))
-			thermostatMode = THERMOSTAT_HEAT;
-		else if(value.equals("C"))
-			thermostatMode = THERMOSTAT_COOL;
-		else if(value.equals("X"))
-			thermostatMode = THERMOSTAT_OFF;
-		else if(value.equals("O"))
-			thermostatMode = THERMOSTAT_ON;
+		for(byte b = 0; b < settingsOut.len; b++)
+		{
+			if(settingsOut.skip > 0)
+				settingsOut.skip--;
+			else if(settingsOut.windowLen < settingsOut.windowMax)
+				settingsOut.window[settingsOut.windowLen++] = settingsOut.buf[b];
+		}
 	}
+	else
+		settingsOut.file.write((const uint8_t *)settingsOut.buf, settingsOut.len);
+	settingsOut.len = 0;
 }
 
 
-String settingPrint(String name, String value)
+// t: temperature of each channel. All zones are done in one pass; zones
+// that are not in use keep their relay off.
+void controlRelay(const int16_t *t)
 {
-	String out;
-	out = out + "[";
-	out = out + name;
-	out = out + "=";
-	out = out + value;
-	out = out + "]";
-	return(out);
+	for(int z = 0; z < zoneCount; z++)
+		controlZone(zones[z], t);
+	relaysApply();
 }
 
+// Drive the relays from the zones' states
+void relaysApply()
+{
+	statsAddRelays();
+	relayOutputs = 0;
+	for(int z = 0; z < ZONE_MAX; z++)
+	{
+		ThermostatZone &zone = zones[z];
+		boolean on = (z < zoneCount) && ((zone.mode == THERMOSTAT_ON) ||
+				((zone.mode != THERMOSTAT_OFF) && zone.relayState));
+		if(on)
+			relayOutputs |= 1 << z;
+		// Relays are active low
+		digitalWrite(zoneRelayPins[z], on ? LOW : HIGH);
+	}
+}
 
-void controlRelay(float airTemp, float liquidTemp)
+// Sets the zone's relayState; PID zones are left to fpPidControl()
+void controlZone(ThermostatZone &zone, const int16_t *t)
 {
 	// When heating, we expect the temperature to go tOvershoot over its actual value.
 	// When in heating mode but not heating, we expect the temperature to go
 	// 	tUndershoot under its actual value.
 	// Cooling: umgekehrt
 
-	static bool cooling = false;
-	float switchTemp = 0;
-	// for info:
-	//	float thermostatSettings[4] = {
-	//			0, // target temperature
-	//			1, // target temperature window
-	//			0, // temperature undershoot
-	//			0, // temperature overshoot
-	//	};
-
-	switch(thermostatMode)
+	// all in 1/100 degC; sums of two are done in long, as the settings go
+	// up to 20000 each and an int has 16 bits on the AVR
+	long liquidTemp = t[zone.liquid];
+	const int16_t *s = zone.settings; // target, window, undershoot, overshoot
+	long switchTemp = 0;
+
+	if(zone.mode == THERMOSTAT_PID)
+		return;
+	zone.pidActive = false;
+
+	// Never switch on a sensor that is not there
+	if(liquidTemp == DEVICE_DISCONNECTED_C * 100)
+	{
+		zone.relayState = false;
+		zone.cooling = false;
+		return;
+	}
+
+	switch(zone.mode)
 	{
 	case THERMOSTAT_HEAT:
-		if(!relayState)
+		if(!zone.relayState)
 		{
-			switchTemp = liquidTemp - thermostatSettings[2];
-			if(switchTemp <= thermostatSettings[0] - thermostatSettings[1])
-				relayState = true;
+			switchTemp = liquidTemp - s[2];
+			if(switchTemp <= (long)s[0] - s[1])
+				zone.relayState = true;
 		}
 		else
 		{
-			switchTemp = liquidTemp + thermostatSettings[3];
-			if(switchTemp >= thermostatSettings[0] + thermostatSettings[1])
-				relayState = false;
+			switchTemp = liquidTemp + s[3];
+			if(switchTemp >= (long)s[0] + s[1])
+				zone.relayState = false;
 		}
 		break;
 	// For THERMOSTAT_COOL, the US/OS indicates the maximum undershoot/overshoot
@@ -1098,40 +3881,136 @@ void controlRelay(float airTemp, float liquidTemp)
 	// compared to target liquid temp.
 	case THERMOSTAT_COOL:
 		// Switch cooling mode (general mode)
-		if(!cooling)
+		if(!zone.cooling)
 		{
-			if(liquidTemp >= thermostatSettings[0] + thermostatSettings[1])
-				cooling = true;
+			if(liquidTemp >= (long)s[0] + s[1])
+				zone.cooling = true;
 		}
 		else
 		{
-			if(liquidTemp <= thermostatSettings[0] - thermostatSettings[1] )
-				cooling = false;
-				relayState = false;
+			if(liquidTemp <= (long)s[0] - s[1])
+			{
+				zone.cooling = false;
+				zone.relayState = false;
+			}
 		}
 		// Now, IF cooling mode is on, determine if we actually have to cool
-		// or if the air is cold enough already
-		if(cooling)
+		// or if the air is cold enough already. Without an air sensor, cool
+		// for as long as cooling mode is on.
+		if(zone.cooling)
 		{
-			if(relayState && (airTemp < thermostatSettings[0] - thermostatSettings[2]))
-				relayState = false;
-			else if(!relayState && (airTemp > thermostatSettings[0] + thermostatSettings[3]))
-				relayState = true;
+			int airTemp = (zone.air >= 0) ? t[zone.air] : DEVICE_DISCONNECTED_C * 100;
+			if(airTemp == DEVICE_DISCONNECTED_C * 100)
+				zone.relayState = true;
+			else if(zone.relayState && (airTemp < (long)s[0] - s[2]))
+				zone.relayState = false;
+			else if(!zone.relayState && (airTemp > (long)s[0] + s[3]))
+				zone.relayState = true;
 		}
 		break;
 	case THERMOSTAT_OFF:
 		break;
 	}
+}
 
-	if(thermostatMode != THERMOSTAT_OFF)
+/// PID control
+// Zones in THERMOSTAT_PID mode are updated every pidInterval seconds,
+// independent of the log interval: the PID output (0..1000) is the part of
+// each pidWindow the relay is on. The relay stays in a state for at least
+// pidMinOn/pidMinOff, and on or off times shorter than that are left out
+// of the window altogether rather than cut short.
+void fpPidControl()
+{
+	unsigned long ms = millis();
+	for(int z = 0; z < zoneCount; z++)
 	{
-		if(thermostatMode == THERMOSTAT_ON)
-			digitalWrite(RELAY_PIN, LOW);
-		else if(relayState)
-			digitalWrite(RELAY_PIN, LOW);
-		else
-			digitalWrite(RELAY_PIN, HIGH);
+		ThermostatZone &zone = zones[z];
+		if(zone.mode != THERMOSTAT_PID)
+			continue;
+		if(!zone.pidActive)
+		{
+			zone.pidActive = true;
+			zone.pidIntegral = 0;
+			zone.pidOutput = 0;
+			zone.pidWindowStart = ms;
+			zone.pidLastUpdate = ms;
+			// free to switch right away
+			zone.pidLastSwitch = ms - 1000UL *
+					((zone.pidMinOn > zone.pidMinOff) ? zone.pidMinOn : zone.pidMinOff);
+		}
+		pidUpdate(zone, ms);
+		pidRelay(zone, ms);
+	}
+	relaysApply();
+}
+
+// New output from the newest sample, in integers only:
+// error e in 1/100 degC (positive: the relay should work), then
+// P = kp * e / 100
+// I = sum(ki * e * dt) / 360000 (dt in s), kept between 0 and 1000
+// D = kd * (change of the temperature, 1/100 degC per min) / 100, against
+//     the direction the relay works in, from the two newest samples
+void pidUpdate(ThermostatZone &zone, unsigned long ms)
+{
+	if(samplesTaken == 0)
+		return;
+	int16_t temp = sampleCenti[zone.liquid];
+	if(temp == DEVICE_DISCONNECTED_C * 100)
+	{
+		// Never heat or cool on a sensor that is not there
+		zone.pidOutput = 0;
+		return;
+	}
+
+	long target = zone.settings[0];
+	long e = zone.pidCool ? temp - target : target - temp;
+	e = constrain(e, -5000L, 5000L);
+
+	long dt = (ms - zone.pidLastUpdate) / 1000;
+	zone.pidLastUpdate = ms;
+	dt = constrain(dt, 0L, (long)pidInterval);
+	// pidInterval is at most that, but the product below must not wrap
+	if(dt > PID_INTERVAL_MAX)
+		dt = PID_INTERVAL_MAX;
+	zone.pidIntegral += zone.ki * e * dt;
+	zone.pidIntegral = constrain(zone.pidIntegral, 0L, 360000000L);
+
+	long d = 0;
+	if((samplesTaken > 1) && (samplePrevCenti[zone.liquid] != DEVICE_DISCONNECTED_C * 100))
+	{
+		long dTemp = constrain((long)temp - samplePrevCenti[zone.liquid], -1000L, 1000L);
+		long dTime = sampleTime - samplePrevTime;
+		if(dTime > 0)
+			d = dTemp * 60 / dTime;
+		if(!zone.pidCool)
+			d = -d;
+	}
+
+	long out = (long)zone.kp * e / 100 + zone.pidIntegral / 360000 +
+			(long)zone.kd * d / 100;
+	zone.pidOutput = constrain(out, 0L, 1000L);
+}
+
+// Time-proportional switching of a PID zone's relay
+void pidRelay(ThermostatZone &zone, unsigned long ms)
+{
+	unsigned long window = 1000UL * zone.pidWindow;
+	unsigned long minOn = 1000UL * zone.pidMinOn;
+	unsigned long minOff = 1000UL * zone.pidMinOff;
+
+	if(ms - zone.pidWindowStart >= window)
+		zone.pidWindowStart = ms;
+	unsigned long onTime = zone.pidOutput * window / 1000;
+	if(onTime < minOn)
+		onTime = 0;
+	else if(window - onTime < minOff)
+		onTime = window;
+
+	boolean want = (ms - zone.pidWindowStart < onTime);
+	if((want != zone.relayState) &&
+			(ms - zone.pidLastSwitch >= (zone.relayState ? minOn : minOff)))
+	{
+		zone.relayState = want;
+		zone.pidLastSwitch = ms;
 	}
-	else
-		digitalWrite(RELAY_PIN, HIGH);
 }
@@ -8,7 +8,13 @@
 #define _BeerLoggerEc_H_
 #include "Arduino.h"
 //add your includes for the project BeerLoggerEc here
+#include "SD.h"
 
+// Run time measurements and the diagnostics page; 0 leaves them out
+// altogether
+#ifndef DIAGNOSTICS
+#define DIAGNOSTICS 1
+#endif
 
 //end of add your includes here
 #ifdef __cplusplus
@@ -23,43 +29,151 @@ void setup();
 //add your function definitions for the project BeerLoggerEc here
 
 void scheduleEvent(int eventId, long tDelay);
+void scheduleApplyCommands();
+boolean scheduleBefore(int, int);
+void scheduleHeapSet(int, int);
+void scheduleSiftUp(int);
+void scheduleSiftDown(int);
+void scheduleQueue(int eventId, unsigned long target);
+void scheduleRemove(int eventId);
+void powerWait(unsigned long ms);
+boolean powerAwake();
+void powerCount();
 
 // "Schedule function pointer" functions
-void fpClearDebounce();
 void fpManageSD();
 void fpUpdateScreen();
 void fpCycle();
+void fpReadSensors();
+void fpFlushLog();
+void fpPidControl();
+void fpControl();
+void fpLogRow();
+void statsAddSample(int channel);
+void statsAddRelays();
+void statsReset();
+File sdOpen(const char *name, uint8_t mode = FILE_READ);
+#if DIAGNOSTICS
+void diagAdd(byte slot, unsigned long us);
+char *diagFormatUs(char *out, unsigned long us);
+void diagDump();
+#endif
 void fpSettingsLoad();
 void fpSettingsStore();
 
 // Actor functions (that do actual stuff)
-void writeLog(int index);
+void writeLog(int age, uint32_t t);
+void writeLogRow(uint32_t t, const int16_t *values, byte n, byte relays);
+void writeLogText(uint32_t t, const int16_t *values, byte n, byte relays);
+void writeLogBinary(uint32_t t, const int16_t *values, byte n, byte relays);
+void journalAdd(uint32_t t, const int16_t *values, byte relays);
+boolean journalRead(int n, struct JournalRow &row);
+void journalBegin();
+void logRecover();
+byte logValues(int age, int channel, int16_t *values);
+int16_t centiFromRaw(int16_t raw);
+char *centiFormat(char *buf, long centi, byte decimals);
+void centiPrint(Print &out, long centi, byte decimals);
+int16_t centiParse(char *&p);
+void logOpen();
+void logOpenFor(uint32_t t);
+void logSelect(uint32_t t);
+void logNextPart(uint32_t t);
+void logHeader();
+boolean logTailValid(const char *name);
+void logFileName(char *name, uint32_t date, byte part);
+void logIndexAdd(uint32_t t);
+uint32_t logIndexFind(uint32_t t, char *name, uint32_t *offset, boolean after = false);
+uint32_t logIndexNextFile(uint32_t t, const char *current, char *name, uint32_t *offset);
+long logIndexSearch(File &index, uint32_t t);
+boolean logIndexEntry(File &index, long n, byte *entry);
+uint32_t logIndexLastIn(const char *name, uint32_t *offset);
+void logIndexRepair();
+uint32_t logIndexDecode(const byte *entry, char *name, uint32_t *offset);
+void logPut32(byte *, uint32_t);
+uint32_t logGet32(const byte *);
+boolean cardOpen(const char *name);
+void cardClose();
+boolean cardReadRow(uint32_t offset, struct LogRow &row);
+boolean cardReadRecord(uint32_t offset, struct LogRow &row);
+boolean cardSeek(uint32_t t, struct LogRow &row);
+boolean cardPrevRow(struct LogRow &row);
+boolean cardNextRow(struct LogRow &row);
+void serialProcess();
+boolean serialBusy();
+void serialRequest();
+byte serialStatus(byte *out);
+void serialSample();
+void serialDownloadStart(uint32_t from, uint32_t to, byte seq);
+void serialDownload();
 void control();
+int sensorsDiscover();
+void sensorsConfigure();
+int sensorChannel(const uint8_t *address);
+boolean sensorUsed(int channel);
+char *sensorFormatAddress(const uint8_t *address, char *out);
+boolean sensorParseAddress(const char *text, uint8_t *address);
 
 void setMessage(String msg);
 
+// Input queue between the interrupt handlers and loop()
+void inputPush(byte action);
+void inputProcess();
+
 // Encoder and clear button interrupt handlers
-void doEncoderA();
-void doEncoderB();
+void doEncoder();
 void doEncSw();
 void doClearButton();
+void doSerialWake();
 
 
-void settingApply(String name, String value);
-String settingPrint(String name, String value);
+int settingFind(const char *name);
+boolean settingApply(const char *name, const char *value);
+boolean settingPerZone(int);
+boolean settingCenti(const char *value, int16_t &centi);
+void settingPrint(const char *name, const char *value);
+void settingsOutFlush();
+void settingsPrintAll(unsigned long version);
+byte settingsWindow(uint16_t from, byte *out, byte max);
+void settingsFindSlot();
+void settingsParse(File &, boolean apply);
 
 
 void mainDisplay();
-void thermostatSettingsDisplay(float *, int, int);
+void thermostatSettingsDisplay(const int16_t *, int, int);
+void statisticsDisplay(int view);
+#if DIAGNOSTICS
+void diagnosticsDisplay(int view);
+#endif
+uint32_t scrollTime();
+void scrollTo(uint32_t t);
 void toggleWriteMode();
-void controlRelay(float, float);
+void controlRelay(const int16_t *);
+void relaysApply();
+void controlZone(struct ThermostatZone &, const int16_t *);
+void pidUpdate(struct ThermostatZone &, unsigned long ms);
+void pidRelay(struct ThermostatZone &, unsigned long ms);
 
-int uiLoggerSettings(int);
 int uiTempDisplay(int);
 int uiMessage(int);
-int uiThermostatSettings(int);
-int uiThermostatMode(int);
-int uiLoadStoreSettings(int);
+void uiGoTo(int page);
+int uiEdit(int);
+int uiLoggerApply(struct UiEdit &);
+void uiLoggerShow(const struct UiEdit &);
+void uiThermostatLoad(struct UiEdit &);
+int uiThermostatApply(struct UiEdit &);
+void uiThermostatShow(const struct UiEdit &);
+void uiModeLoad(struct UiEdit &);
+int uiModeApply(struct UiEdit &);
+void uiModeShow(const struct UiEdit &);
+int uiLoadStoreApply(struct UiEdit &);
+void uiLoadStoreShow(const struct UiEdit &);
+void uiStatisticsLoad(struct UiEdit &);
+int uiStatisticsApply(struct UiEdit &);
+void uiStatisticsShow(const struct UiEdit &);
+#if DIAGNOSTICS
+void uiDiagnosticsShow(const struct UiEdit &);
+#endif
 
 void handleUi(int);
 
@@ -0,0 +1,69 @@
+/*
+  BlockCache.h - Read cache of a few blocks of one file on the SD card, for
+  the BeerLogger's history view. Stepping back through the log reads the
+  bytes before a row one at a time; with the cache that costs a card read
+  per block rather than per byte, and the blocks stay put while the log
+  file is written through the SD library's single block buffer.
+  The cache does not know which file it holds: call invalidate() when
+  switching files.
+*/
+
+#ifndef BlockCache_h
+#define BlockCache_h
+
+#include "Arduino.h"
+#include "SD.h"
+
+template <uint8_t BLOCKS, uint16_t SIZE>
+class BlockCache
+{
+  public:
+    BlockCache() : last(0), reads(0) { invalidate(); }
+
+    void invalidate()
+    {
+      for(uint8_t b = 0; b < BLOCKS; b++)
+        lengths[b] = 0;
+    }
+
+    // Byte at pos of f, -1 past its end
+    int get(File &f, uint32_t pos)
+    {
+      uint32_t block = pos / SIZE;
+      uint16_t at = pos % SIZE;
+      uint8_t slot = 0;
+      // A block that was short (the end of the file) is read again for
+      // bytes past what it had, the file may have grown since
+      while((slot < BLOCKS) && !((blocks[slot] == block) && (at < lengths[slot])))
+        slot++;
+      if(slot == BLOCKS)
+      {
+        // replace the blocks in turn, never the one used last
+        slot = (last + 1 == BLOCKS) ? 0 : last + 1;
+        blocks[slot] = block;
+        lengths[slot] = 0;
+        if(f.seek(block * SIZE))
+        {
+          int n = f.read(data[slot], SIZE);
+          lengths[slot] = (n > 0) ? n : 0;
+        }
+        reads++;
+        if(at >= lengths[slot])
+          return -1;
+      }
+      last = slot;
+      return data[slot][at];
+    }
+
+    // Blocks read from the card so far
+    unsigned long blockReads() const { return reads; }
+
+  private:
+    uint8_t data[BLOCKS][SIZE];
+    uint32_t blocks[BLOCKS];
+    uint16_t lengths[BLOCKS]; // 0: slot empty
+    uint8_t last;
+    unsigned long reads;
+};
+
+#endif
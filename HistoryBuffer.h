@@ -0,0 +1,120 @@
+/*
+  HistoryBuffer.h - Ring buffer of temperature samples for the BeerLogger.
+  Stores per sample one int16 per sensor (1/100 degC) and the time since
+  the previous sample as uint16 seconds: 2 + 2 * SENSORS bytes, so a
+  sample of two sensors takes 6 bytes instead of the 14 of two floats and
+  a DateTime (about 2.3 times as many samples in the same RAM), and one of
+  four sensors 10 bytes. Only the time of the newest sample is kept in
+  full; older times are rebuilt from the deltas. time() walks them all
+  from the newest; to go over many samples walk them one at a time with
+  older() and newer().
+  Gaps of 0xFFFF seconds (18 hours) and more are kept in full in a small
+  table of GAPS entries. When a gap needs a slot that an older gap still
+  in the buffer has, the samples before that older gap are dropped, so
+  that every time the buffer gives is right.
+*/
+
+#ifndef HistoryBuffer_h
+#define HistoryBuffer_h
+
+#include "Arduino.h"
+
+template <uint16_t CAPACITY, uint8_t SENSORS, uint8_t GAPS = 4>
+class HistoryBuffer
+{
+  public:
+    HistoryBuffer() : head(CAPACITY - 1), count(0), pushes(0), gapHead(0), newestTime(0)
+    {
+      for(uint8_t g = 0; g < GAPS; g++)
+      {
+        gaps[g].seq = 0;
+        gaps[g].dt = 0;
+      }
+    }
+
+    // Append a sample, temperatures in 1/100 degC
+    void push(uint32_t time, const int16_t *temps)
+    {
+      uint32_t dt = (count > 0 && time > newestTime) ? time - newestTime : 0;
+      head = (head + 1 == CAPACITY) ? 0 : head + 1;
+      pushes++;
+      if(count < CAPACITY) count++;
+      deltas[head] = dt;
+      if(dt >= LONG_GAP)
+      {
+        deltas[head] = LONG_GAP;
+        Gap &g = gaps[gapHead];
+        uint16_t age = pushes - g.seq;
+        if(g.dt && (age < count))
+          count = age + 1;
+        g.seq = pushes;
+        g.dt = dt;
+        gapHead = (gapHead + 1 == GAPS) ? 0 : gapHead + 1;
+      }
+      for(uint8_t s = 0; s < SENSORS; s++)
+        temps_[head][s] = temps[s];
+      newestTime = time;
+    }
+
+    uint16_t size() const { return count; }
+    uint16_t capacity() const { return CAPACITY; }
+
+    // age 0 is the newest sample, age must be < size()
+    int16_t temp(uint16_t age, uint8_t sensor) const
+    {
+      return temps_[index(age)][sensor];
+    }
+
+    uint32_t time(uint16_t age) const
+    {
+      uint32_t t = newestTime;
+      for(uint16_t a = 0; a < age; a++)
+        t -= delta(a);
+      return t;
+    }
+
+    // Time of the sample before (age + 1) and after (age - 1) the one at
+    // age, which is at time t
+    uint32_t older(uint16_t age, uint32_t t) const { return t - delta(age); }
+    uint32_t newer(uint16_t age, uint32_t t) const { return t + delta(age - 1); }
+
+  private:
+    enum { LONG_GAP = 0xFFFF };
+
+    struct Gap {
+      uint16_t seq; // pushes when the sample after the gap came
+      uint32_t dt;
+    };
+
+    uint16_t index(uint16_t age) const
+    {
+      return (head >= age) ? head - age : head + CAPACITY - age;
+    }
+
+    // Seconds from the sample before the one at age to it
+    uint32_t delta(uint16_t age) const
+    {
+      uint16_t dt = deltas[index(age)];
+      if(dt != LONG_GAP)
+        return dt;
+      uint16_t seq = pushes - age;
+      for(uint8_t n = 1; n <= GAPS; n++)
+      {
+        const Gap &g = gaps[(gapHead + GAPS - n) % GAPS];
+        if(g.dt && (g.seq == seq))
+          return g.dt;
+      }
+      return LONG_GAP;
+    }
+
+    uint16_t deltas[CAPACITY];
+    int16_t temps_[CAPACITY][SENSORS];
+    Gap gaps[GAPS];
+    uint16_t head; // index of the newest sample
+    uint16_t count;
+    uint16_t pushes; // samples ever pushed, modulo 65536
+    uint8_t gapHead; // the gaps slot to fill next
+    uint32_t newestTime;
+};
+
+#endif
@@ -0,0 +1,93 @@
+/*
+  PowerSave.cpp - Sleep modes of the ATmega for the BeerLogger's scheduler.
+*/
+
+#include "Arduino.h"
+#include "PowerSave.h"
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+
+// The core's clock, from wiring.c
+extern volatile unsigned long timer0_millis;
+extern volatile unsigned long timer0_overflow_count;
+
+static volatile boolean wdtFired;
+static unsigned int wdtUs = 16000; // measured length of the 16 ms period
+static unsigned int carryUs = 0; // slept, not yet in millis()
+
+ISR(WDT_vect)
+{
+  wdtFired = true;
+}
+
+// Watchdog as an interrupt only (no reset) after 16 ms << prescale
+static void wdtStart(byte prescale)
+{
+  byte bits = (1 << WDIE) | ((prescale & 8) ? (1 << WDP3) : 0) | (prescale & 7);
+  wdtFired = false;
+  cli();
+  wdt_reset();
+  MCUSR &= ~(1 << WDRF);
+  WDTCSR = (1 << WDCE) | (1 << WDE);
+  WDTCSR = bits;
+  sei();
+}
+
+void powerIdle()
+{
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  sleep_mode();
+}
+
+unsigned long powerDown(unsigned long ms, boolean (*awake)())
+{
+  byte prescale = 0;
+  while(((16UL << (prescale + 1)) <= ms) && ((16UL << (prescale + 1)) <= POWER_DOWN_MAX_MS))
+    prescale++;
+  unsigned long periods = 1UL << prescale;
+
+  // The ADC's reference draws current even when nothing converts
+  byte adc = ADCSRA;
+  ADCSRA &= ~(1 << ADEN);
+  wdtStart(prescale);
+  set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+  cli();
+  if(awake())
+  {
+    sei();
+    wdt_disable();
+    ADCSRA = adc;
+    return 0;
+  }
+  sleep_enable();
+  sei(); // the instruction after sei still runs before any interrupt
+  sleep_cpu();
+  sleep_disable();
+  boolean full = wdtFired;
+  wdt_disable();
+  ADCSRA = adc;
+
+  unsigned long us = (full ? periods : (periods + 1) / 2) * wdtUs + carryUs;
+  unsigned long slept = us / 1000;
+  carryUs = us % 1000;
+  // micros() counts Timer0 overflows of 1024 us
+  cli();
+  timer0_millis += slept;
+  timer0_overflow_count += us / 1024;
+  sei();
+  return slept;
+}
+
+void powerCalibrate()
+{
+  unsigned long start = micros();
+  wdtStart(0);
+  while(!wdtFired)
+    powerIdle();
+  unsigned long us = micros() - start;
+  wdt_disable();
+  // The watchdog oscillator is not off by more than 10% or so
+  if((us > 12000) && (us < 20000))
+    wdtUs = us;
+}
@@ -0,0 +1,33 @@
+/*
+  PowerSave.h - Sleep modes of the ATmega for the BeerLogger's scheduler.
+  powerIdle() stops the CPU until the next interrupt; Timer0 keeps
+  millis() going and wakes it within a millisecond at the latest.
+  powerDown() stops all clocks until the watchdog or a pin change
+  interrupt wakes the MCU, then moves millis() on by the time slept.
+  The watchdog runs on its own 128 kHz oscillator, which is off by up to
+  10% and drifts with supply voltage and temperature; powerCalibrate()
+  measures it against Timer0 (the crystal), and powerDown() scales by
+  that. A pin change gives no way to tell how much of the watchdog period
+  had passed, so it counts as half of it.
+  The host simulation has its own implementation (sim/PowerSave.cpp).
+*/
+
+#ifndef PowerSave_h
+#define PowerSave_h
+
+#include "Arduino.h"
+
+// Longest power down in one go, ms; bounds the error of a pin change wake
+#define POWER_DOWN_MAX_MS 1000
+
+void powerIdle();
+// Power down for ms rounded down to a watchdog period (16 ms at least,
+// POWER_DOWN_MAX_MS at most), or until a pin change interrupt. awake()
+// is asked with interrupts off just before, so that what an interrupt
+// handler did right before cannot be slept through; it returns true to
+// not sleep. Returns the ms added to millis().
+unsigned long powerDown(unsigned long ms, boolean (*awake)());
+// Measure the watchdog period; takes 16 ms, in idle
+void powerCalibrate();
+
+#endif
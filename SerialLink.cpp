@@ -0,0 +1,95 @@
+/*
+  SerialLink.cpp - Framed serial protocol of the BeerLogger.
+*/
+
+#include "Arduino.h"
+#include "SerialLink.h"
+#include <OneWire.h>
+
+SerialLink::SerialLink(Stream &port) : port(port)
+{
+  rxLen = 0;
+  txLen = 0;
+  txPos = 0;
+  bad = 0;
+}
+
+boolean SerialLink::receive()
+{
+  while(port.available() > 0)
+  {
+    byte c = port.read();
+    if((rxLen == 0) && (c != LINK_SYNC))
+      continue;
+    rx[rxLen++] = c;
+    if(rxFrame())
+      return true;
+  }
+  return false;
+}
+
+// Whether rx holds a whole good frame. A bad one is dropped up to the
+// next sync byte in it, which may start the next frame.
+boolean SerialLink::rxFrame()
+{
+  while(rxLen > 0)
+  {
+    boolean fits = (rxLen >= 4) && (rx[3] <= LINK_PAYLOAD_MAX);
+    if((rxLen < 4) || (fits && (rxLen < rx[3] + LINK_OVERHEAD)))
+      return false;
+    if(fits)
+    {
+      byte n = rx[3] + 4;
+      uint16_t crc = OneWire::crc16(rx + 1, n - 1);
+      if((rx[n] == (crc & 0xFF)) && (rx[n + 1] == (crc >> 8)))
+      {
+        rxLen = 0;
+        return true;
+      }
+    }
+    bad++;
+    byte skip = 1;
+    while((skip < rxLen) && (rx[skip] != LINK_SYNC))
+      skip++;
+    memmove(rx, rx + skip, rxLen - skip);
+    rxLen -= skip;
+  }
+  return false;
+}
+
+boolean SerialLink::send(byte type, byte seq, const byte *payload, byte length)
+{
+  if((txLen != 0) || (length > LINK_PAYLOAD_MAX))
+    return false;
+  tx[0] = LINK_SYNC;
+  tx[1] = type;
+  tx[2] = seq;
+  tx[3] = length;
+  if(payload != tx + 4)
+    memmove(tx + 4, payload, length);
+  uint16_t crc = OneWire::crc16(tx + 1, length + 3);
+  tx[length + 4] = crc & 0xFF;
+  tx[length + 5] = crc >> 8;
+  txLen = length + LINK_OVERHEAD;
+  txPos = 0;
+  pump();
+  return true;
+}
+
+boolean SerialLink::pump()
+{
+  if(txLen == 0)
+    return false;
+  int n = port.availableForWrite();
+  if(n > txLen - txPos)
+    n = txLen - txPos;
+  if(n > 0)
+  {
+    port.write(tx + txPos, n);
+    txPos += n;
+  }
+  if(txPos < txLen)
+    return true;
+  txLen = 0;
+  return false;
+}
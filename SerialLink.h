@@ -0,0 +1,84 @@
+/*
+  SerialLink.h - Framed serial protocol of the BeerLogger.
+  A frame is
+    0xA5, type, seq, length, payload (length bytes), CRC16 (little endian)
+  with the CRC (OneWire::crc16) over type, seq, length and payload. The
+  receiver resynchronises on the next 0xA5 after a bad frame, so no byte
+  stuffing is needed. A reply has the type of its request with bit 7 set
+  and the same seq; frames the logger sends on its own (samples, a log
+  download) have seq of the request that started them, or 0.
+
+  Neither direction blocks: receive() takes what the UART has buffered
+  and send() only queues a frame, which pump() then hands to the UART as
+  far as its transmit buffer has room. One frame is queued at a time.
+*/
+
+#ifndef SerialLink_h
+#define SerialLink_h
+
+#include "Arduino.h"
+
+#define LINK_SYNC 0xA5
+#define LINK_PAYLOAD_MAX 128
+#define LINK_OVERHEAD 6
+#define LINK_VERSION 1
+
+enum LinkTypes {
+	LINK_PING = 0x01, // -> version
+	LINK_STATUS = 0x02, // -> see serialStatus()
+	LINK_SETTINGS = 0x03, // uint16 offset -> uint16 offset, settings text
+	LINK_SET = 0x04, // "name=value" -> byte applied
+	LINK_SUBSCRIBE = 0x05, // byte on -> byte on; then LINK_SAMPLE frames
+	LINK_DOWNLOAD = 0x06, // uint32 from, uint32 to -> LINK_FILE, LINK_DATA.., LINK_END
+	LINK_STORE = 0x07, // -> byte queued
+	LINK_REPLY = 0x80,
+	LINK_SAMPLE = 0x90, // uint32 time, byte relays, int16 1/100 degC per channel
+	LINK_FILE = 0x91, // file name; the LINK_DATA frames after it are from it
+	LINK_DATA = 0x92, // uint32 offset in the file, bytes
+	LINK_END = 0x93, // byte status (linkEndStatus)
+	LINK_UNKNOWN = 0xFF // byte type that was not understood
+};
+
+enum LinkEndStatus {
+	LINK_END_DONE = 0,
+	LINK_END_EMPTY, // nothing logged in the range
+	LINK_END_ERROR, // card error
+	LINK_END_CANCELLED // by a new download
+};
+
+class SerialLink
+{
+  public:
+    SerialLink(Stream &port);
+
+    // Read what has arrived; true when a whole frame is there, which then
+    // stays in type()/seq()/payload() until the next call
+    boolean receive();
+    byte type() const { return rx[1]; }
+    byte seq() const { return rx[2]; }
+    byte length() const { return rx[3]; }
+    const byte *payload() const { return rx + 4; }
+
+    // Queue a frame; false if one is still being sent
+    boolean send(byte type, byte seq, const byte *payload, byte length);
+    // The payload of the next frame can also be built in place
+    byte *sendBuffer() { return tx + 4; }
+    boolean ready() const { return txLen == 0; }
+    // Hand the UART what fits; true if something is still waiting
+    boolean pump();
+
+    unsigned long badFrames() const { return bad; }
+
+  private:
+    boolean rxFrame();
+
+    Stream &port;
+    byte rx[LINK_PAYLOAD_MAX + LINK_OVERHEAD];
+    byte rxLen;
+    byte tx[LINK_PAYLOAD_MAX + LINK_OVERHEAD];
+    byte txLen; // 0: idle
+    byte txPos;
+    unsigned long bad;
+};
+
+#endif
@@ -0,0 +1,106 @@
+/*
+  ShadowLcd.cpp - Shadow framebuffer for a character LCD.
+*/
+
+#include "Arduino.h"
+#include "ShadowLcd.h"
+
+ShadowLcd::ShadowLcd(LiquidCrystal &lcd) : lcd(lcd)
+{
+  col = 0;
+  row = 0;
+  cursorOn = false;
+  shownCursorOn = false;
+  shownCol = 0;
+  shownRow = 0;
+}
+
+// Call after lcd.begin(), which leaves the display cleared
+void ShadowLcd::begin()
+{
+  memset(frame, ' ', sizeof(frame));
+  memset(shown, ' ', sizeof(shown));
+  col = 0;
+  row = 0;
+  shownCol = 0;
+  shownRow = 0;
+}
+
+void ShadowLcd::clear()
+{
+  memset(frame, ' ', sizeof(frame));
+  col = 0;
+  row = 0;
+}
+
+void ShadowLcd::setCursor(uint8_t c, uint8_t r)
+{
+  col = c;
+  row = (r < SHADOW_LCD_ROWS) ? r : SHADOW_LCD_ROWS - 1;
+}
+
+void ShadowLcd::cursor()
+{
+  cursorOn = true;
+}
+
+void ShadowLcd::noCursor()
+{
+  cursorOn = false;
+}
+
+size_t ShadowLcd::write(uint8_t c)
+{
+  // Like on the display, characters past the last column are not visible
+  if(col < SHADOW_LCD_COLS)
+    frame[row][col] = c;
+  col++;
+  return 1;
+}
+
+void ShadowLcd::render()
+{
+  for(uint8_t r = 0; r < SHADOW_LCD_ROWS; r++)
+  {
+    uint8_t c = 0;
+    while(c < SHADOW_LCD_COLS)
+    {
+      if(frame[r][c] == shown[r][c])
+      {
+        c++;
+        continue;
+      }
+      // Changed run: position once, then the display's address counter
+      // moves along by itself
+      if((shownRow != r) || (shownCol != c))
+        lcd.setCursor(c, r);
+      while((c < SHADOW_LCD_COLS) && (frame[r][c] != shown[r][c]))
+      {
+        lcd.write(frame[r][c]);
+        shown[r][c] = frame[r][c];
+        c++;
+      }
+      shownRow = r;
+      shownCol = c;
+    }
+  }
+
+  if(cursorOn)
+  {
+    uint8_t c = (col < SHADOW_LCD_COLS) ? col : SHADOW_LCD_COLS - 1;
+    if((shownRow != row) || (shownCol != c))
+    {
+      lcd.setCursor(c, row);
+      shownRow = row;
+      shownCol = c;
+    }
+  }
+  if(cursorOn != shownCursorOn)
+  {
+    if(cursorOn)
+      lcd.cursor();
+    else
+      lcd.noCursor();
+    shownCursorOn = cursorOn;
+  }
+}
@@ -0,0 +1,48 @@
+/*
+  ShadowLcd.h - Shadow framebuffer for a character LCD.
+  Drawing (print, setCursor, clear, cursor) only changes a copy of the
+  screen in RAM. render() then compares it with what the display shows and
+  sends only the runs of characters that changed, followed by the cursor.
+  A redraw of an unchanged screen costs no LCD commands at all, and nothing
+  flickers because the display is never cleared.
+*/
+
+#ifndef ShadowLcd_h
+#define ShadowLcd_h
+
+#include "Arduino.h"
+#include <LiquidCrystal.h>
+
+#define SHADOW_LCD_COLS 16
+#define SHADOW_LCD_ROWS 2
+
+class ShadowLcd : public Print
+{
+  public:
+    ShadowLcd(LiquidCrystal &lcd);
+
+    void begin();
+    // Drawing, same meaning as in LiquidCrystal
+    void clear();
+    void setCursor(uint8_t col, uint8_t row);
+    void cursor();
+    void noCursor();
+    virtual size_t write(uint8_t);
+    using Print::write;
+
+    // Bring the display up to date with the shadow
+    void render();
+
+  private:
+    LiquidCrystal &lcd;
+    char frame[SHADOW_LCD_ROWS][SHADOW_LCD_COLS];
+    char shown[SHADOW_LCD_ROWS][SHADOW_LCD_COLS];
+    // Write position; at render() it is also where the cursor shows
+    uint8_t col, row;
+    boolean cursorOn;
+    // What the display has: its cursor is wherever the last write left it
+    boolean shownCursorOn;
+    uint8_t shownCol, shownRow;
+};
+
+#endif
@@ -0,0 +1,690 @@
+/*
+  Arduino.cpp - Host stand-in for the Arduino core: virtual clock, pins,
+  pin change interrupts, String and Print.
+*/
+
+#include "Arduino.h"
+#include "PinChangeInterrupt.h"
+#include "Wire.h"
+#include "Sim.h"
+#include <deque>
+
+/// Virtual clock
+static unsigned long long simTimeUs = 0;
+static unsigned long long powerCutUs = 0;
+static void (*powerCutHook)() = NULL;
+
+// The power goes when the clock gets to powerCutUs
+static void powerCheck()
+{
+  if(powerCutHook && simTimeUs >= powerCutUs)
+  {
+    void (*hook)() = powerCutHook;
+    powerCutHook = NULL;
+    simTimeUs = powerCutUs;
+    hook();
+  }
+}
+
+void simSetPowerCut(unsigned long long atUs, void (*hook)())
+{
+  powerCutUs = atUs;
+  powerCutHook = hook;
+}
+
+void simAdvance(unsigned long us)
+{
+  simTimeUs += us;
+  powerCheck();
+}
+
+unsigned long long simMicros()
+{
+  return simTimeUs;
+}
+
+unsigned long millis(void)
+{
+  return (unsigned long)(simTimeUs / 1000);
+}
+
+unsigned long micros(void)
+{
+  return (unsigned long)simTimeUs;
+}
+
+static void (*idleHook)() = NULL;
+
+void simSetIdleHook(void (*hook)())
+{
+  idleHook = hook;
+}
+
+void delay(unsigned long ms)
+{
+  simTimeUs += 1000ULL * ms;
+  powerCheck();
+  if(idleHook)
+    idleHook();
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  simTimeUs += us;
+  powerCheck();
+}
+
+/// Pins and interrupts
+static uint8_t pinLevel[SIM_PIN_COUNT];
+static uint8_t pinModes[SIM_PIN_COUNT];
+static callback pinIsr[SIM_PIN_COUNT];
+static uint8_t pinIsrMode[SIM_PIN_COUNT];
+static bool interruptsOn = true;
+static unsigned long pinInterrupts = 0;
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+  if(pin >= SIM_PIN_COUNT) return;
+  pinModes[pin] = mode;
+  if(mode == INPUT_PULLUP) pinLevel[pin] = HIGH;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+  if(pin >= SIM_PIN_COUNT) return;
+  pinLevel[pin] = val ? HIGH : LOW;
+}
+
+int digitalRead(uint8_t pin)
+{
+  if(pin >= SIM_PIN_COUNT) return LOW;
+  return pinLevel[pin];
+}
+
+void noInterrupts(void)
+{
+  interruptsOn = false;
+}
+
+void interrupts(void)
+{
+  interruptsOn = true;
+}
+
+void attachPinChangeInterrupt(uint8_t pcintNum, callback userFunc, uint8_t mode)
+{
+  if(pcintNum >= SIM_PIN_COUNT) return;
+  pinIsr[pcintNum] = userFunc;
+  pinIsrMode[pcintNum] = mode;
+}
+
+void detachPinChangeInterrupt(uint8_t pcintNum)
+{
+  if(pcintNum >= SIM_PIN_COUNT) return;
+  pinIsr[pcintNum] = NULL;
+}
+
+void simSetPin(uint8_t pin, uint8_t level)
+{
+  if(pin >= SIM_PIN_COUNT) return;
+  uint8_t old = pinLevel[pin];
+  pinLevel[pin] = level ? HIGH : LOW;
+  if(old == pinLevel[pin] || pinIsr[pin] == NULL || !interruptsOn) return;
+
+  bool fire = false;
+  switch(pinIsrMode[pin])
+  {
+  case CHANGE:
+    fire = true;
+    break;
+  case RISING:
+    fire = (pinLevel[pin] == HIGH);
+    break;
+  case FALLING:
+    fire = (pinLevel[pin] == LOW);
+    break;
+  }
+  if(fire)
+  {
+    pinInterrupts++;
+    (pinIsr[pin])();
+  }
+}
+
+unsigned long simPinInterrupts()
+{
+  return pinInterrupts;
+}
+
+uint8_t simPinLevel(uint8_t pin)
+{
+  if(pin >= SIM_PIN_COUNT) return LOW;
+  return pinLevel[pin];
+}
+
+void simTurnEncoder(int steps, unsigned long gapUs)
+{
+  // Encoder A is A10, B is A11. Both idle high; a detent is one full Gray
+  // code cycle. Turning "up" makes A lead B.
+  uint8_t first = (steps > 0) ? A10 : A11;
+  uint8_t second = (steps > 0) ? A11 : A10;
+  if(steps < 0) steps = -steps;
+  for(int n = 0; n < steps; n++)
+  {
+    simSetPin(first, LOW);
+    simAdvance(gapUs);
+    simSetPin(second, LOW);
+    simAdvance(gapUs);
+    simSetPin(first, HIGH);
+    simAdvance(gapUs);
+    simSetPin(second, HIGH);
+    simAdvance(gapUs);
+  }
+}
+
+void simPressButton(uint8_t pin, unsigned long holdUs)
+{
+  // Buttons pull the (pulled-up) pin low; the sketch triggers on release
+  simSetPin(pin, LOW);
+  simAdvance(holdUs);
+  simSetPin(pin, HIGH);
+}
+
+/// Serial port
+// Each direction is a wire that carries a byte every 10 bit times, into
+// the ring buffer at the far end
+static unsigned long serialByteUs = 0; // 0: not begun
+static std::deque<uint8_t> serialTx; // logger's transmit buffer
+static unsigned long long serialTxDoneUs = 0; // when the first of serialTx is sent
+static std::string serialOut; // sent, not yet collected by the host
+static std::deque<uint8_t> serialWire; // host bytes on their way
+static unsigned long long serialWireDoneUs = 0;
+static std::deque<uint8_t> serialRx; // logger's receive buffer
+static SimSerialStats serialStats;
+
+// Move the bytes whose time has come
+static void serialUpdate()
+{
+  while(!serialTx.empty() && serialTxDoneUs <= simTimeUs)
+  {
+    serialOut += (char)serialTx.front();
+    serialTx.pop_front();
+    serialStats.bytesOut++;
+    serialStats.lastOutUs = serialTxDoneUs;
+    if(!serialTx.empty())
+      serialTxDoneUs += serialByteUs;
+  }
+  while(!serialWire.empty() && serialWireDoneUs <= simTimeUs)
+  {
+    if(serialRx.size() < SERIAL_RX_BUFFER_SIZE)
+      serialRx.push_back(serialWire.front());
+    else
+      serialStats.rxOverflows++;
+    serialWire.pop_front();
+    serialStats.bytesIn++;
+    if(!serialWire.empty())
+      serialWireDoneUs += serialByteUs;
+  }
+}
+
+void HardwareSerial::begin(unsigned long baud)
+{
+  serialByteUs = 10000000UL / baud;
+  if(serialByteUs == 0) serialByteUs = 1;
+  pinLevel[0] = HIGH; // RX, the line idles high
+}
+
+void HardwareSerial::end()
+{
+  flush();
+  serialByteUs = 0;
+}
+
+int HardwareSerial::available()
+{
+  serialUpdate();
+  return serialRx.size();
+}
+
+int HardwareSerial::peek()
+{
+  serialUpdate();
+  return serialRx.empty() ? -1 : serialRx.front();
+}
+
+int HardwareSerial::read()
+{
+  serialUpdate();
+  if(serialRx.empty())
+    return -1;
+  uint8_t c = serialRx.front();
+  serialRx.pop_front();
+  return c;
+}
+
+void HardwareSerial::flush()
+{
+  if(!serialTx.empty() && serialTxDoneUs > simTimeUs)
+    simTimeUs = serialTxDoneUs + (serialTx.size() - 1) * serialByteUs;
+  powerCheck();
+  serialUpdate();
+}
+
+int HardwareSerial::availableForWrite()
+{
+  serialUpdate();
+  return SERIAL_TX_BUFFER_SIZE - serialTx.size();
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+  if(serialByteUs == 0)
+    return 0;
+  serialUpdate();
+  // A full buffer: wait for the oldest byte to go
+  if(serialTx.size() == SERIAL_TX_BUFFER_SIZE)
+  {
+    simTimeUs = serialTxDoneUs;
+    powerCheck();
+    serialUpdate();
+  }
+  if(serialTx.empty())
+    serialTxDoneUs = simTimeUs + serialByteUs;
+  serialTx.push_back(c);
+  return 1;
+}
+
+HardwareSerial Serial;
+
+void simSerialSend(const std::string &data)
+{
+  serialUpdate();
+  for(size_t n = 0; n < data.size(); n++)
+  {
+    if(serialWire.empty())
+      serialWireDoneUs = simTimeUs + serialByteUs;
+    serialWire.push_back(data[n]);
+  }
+}
+
+std::string simSerialReceive()
+{
+  serialUpdate();
+  std::string out;
+  out.swap(serialOut);
+  return out;
+}
+
+bool simSerialArriving()
+{
+  serialUpdate();
+  return !serialWire.empty() && (serialWireDoneUs - serialByteUs <= simTimeUs);
+}
+
+void simSerialDropArriving()
+{
+  serialStats.rxLost += serialWire.size();
+  serialWire.clear();
+}
+
+bool simSerialIdle()
+{
+  serialUpdate();
+  return serialTx.empty() && serialWire.empty() && serialRx.empty();
+}
+
+SimSerialStats simSerialStats()
+{
+  return serialStats;
+}
+
+void simSerialResetStats()
+{
+  memset(&serialStats, 0, sizeof(serialStats));
+}
+
+TwoWire Wire;
+
+char *dtostrf(double val, signed char width, unsigned char prec, char *sout)
+{
+  // avr-libc writes at most width (or the number's length) plus the NUL
+  sprintf(sout, "%*.*f", width, prec, val);
+  return sout;
+}
+
+/// String
+String::String(const char *cstr) : buffer(NULL), len(0)
+{
+  assign(cstr ? cstr : "", cstr ? strlen(cstr) : 0);
+}
+
+String::String(const String &str) : buffer(NULL), len(0)
+{
+  assign(str.buffer, str.len);
+}
+
+String::String(char c) : buffer(NULL), len(0)
+{
+  char buf[2] = { c, 0 };
+  assign(buf, 1);
+}
+
+String::String(int value, unsigned char base) : buffer(NULL), len(0)
+{
+  char buf[34];
+  if(base == 10)
+    snprintf(buf, sizeof(buf), "%d", value);
+  else
+    snprintf(buf, sizeof(buf), "%x", value);
+  assign(buf, strlen(buf));
+}
+
+String::String(unsigned int value, unsigned char base) : buffer(NULL), len(0)
+{
+  char buf[34];
+  snprintf(buf, sizeof(buf), base == 10 ? "%u" : "%x", value);
+  assign(buf, strlen(buf));
+}
+
+String::String(long value, unsigned char base) : buffer(NULL), len(0)
+{
+  char buf[34];
+  if(base == 10)
+    snprintf(buf, sizeof(buf), "%ld", value);
+  else
+    snprintf(buf, sizeof(buf), "%lx", value);
+  assign(buf, strlen(buf));
+}
+
+String::String(unsigned long value, unsigned char base) : buffer(NULL), len(0)
+{
+  char buf[34];
+  snprintf(buf, sizeof(buf), base == 10 ? "%lu" : "%lx", value);
+  assign(buf, strlen(buf));
+}
+
+String::String(float value, unsigned char decimalPlaces) : buffer(NULL), len(0)
+{
+  char buf[40];
+  snprintf(buf, sizeof(buf), "%.*f", decimalPlaces, (double)value);
+  assign(buf, strlen(buf));
+}
+
+String::String(double value, unsigned char decimalPlaces) : buffer(NULL), len(0)
+{
+  char buf[40];
+  snprintf(buf, sizeof(buf), "%.*f", decimalPlaces, value);
+  assign(buf, strlen(buf));
+}
+
+String::~String()
+{
+  free(buffer);
+}
+
+void String::assign(const char *cstr, unsigned int length)
+{
+  char *nb = (char *)malloc(length + 1);
+  memcpy(nb, cstr, length);
+  nb[length] = 0;
+  free(buffer);
+  buffer = nb;
+  len = length;
+}
+
+void String::append(const char *cstr, unsigned int length)
+{
+  // Grow by exactly what is needed, like the AVR core does
+  buffer = (char *)realloc(buffer, len + length + 1);
+  memcpy(buffer + len, cstr, length);
+  len += length;
+  buffer[len] = 0;
+}
+
+String & String::operator = (const String &rhs)
+{
+  if(this != &rhs) assign(rhs.buffer, rhs.len);
+  return *this;
+}
+
+String & String::operator = (const char *cstr)
+{
+  assign(cstr, strlen(cstr));
+  return *this;
+}
+
+String & String::operator += (const String &rhs)
+{
+  append(rhs.buffer, rhs.len);
+  return *this;
+}
+
+String & String::operator += (const char *cstr)
+{
+  append(cstr, strlen(cstr));
+  return *this;
+}
+
+String & String::operator += (char c)
+{
+  append(&c, 1);
+  return *this;
+}
+
+String operator + (const String &lhs, const String &rhs)
+{
+  String s(lhs);
+  s += rhs;
+  return s;
+}
+
+String operator + (const String &lhs, const char *cstr)
+{
+  String s(lhs);
+  s += cstr;
+  return s;
+}
+
+String operator + (const String &lhs, char c)
+{
+  String s(lhs);
+  s += c;
+  return s;
+}
+
+char String::charAt(unsigned int index) const
+{
+  return index < len ? buffer[index] : 0;
+}
+
+bool String::equals(const String &s) const
+{
+  return len == s.len && strcmp(buffer, s.buffer) == 0;
+}
+
+bool String::equals(const char *cstr) const
+{
+  return strcmp(buffer, cstr) == 0;
+}
+
+long String::toInt(void) const
+{
+  return atol(buffer);
+}
+
+float String::toFloat(void) const
+{
+  return (float)atof(buffer);
+}
+
+/// Print
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+  size_t n = 0;
+  while(size--)
+  {
+    if(write(*buffer++)) n++;
+    else break;
+  }
+  return n;
+}
+
+size_t Print::print(const char str[])
+{
+  return write(str);
+}
+
+size_t Print::print(const String &s)
+{
+  return write((const uint8_t *)s.c_str(), s.length());
+}
+
+size_t Print::print(char c)
+{
+  return write((uint8_t)c);
+}
+
+size_t Print::print(unsigned char b, int base)
+{
+  return print((unsigned long)b, base);
+}
+
+size_t Print::print(int n, int base)
+{
+  return print((long)n, base);
+}
+
+size_t Print::print(unsigned int n, int base)
+{
+  return print((unsigned long)n, base);
+}
+
+size_t Print::print(long n, int base)
+{
+  if(base == 10 && n < 0)
+  {
+    size_t t = print('-');
+    return t + printNumber(-(unsigned long)n, 10);
+  }
+  return printNumber((unsigned long)n, base);
+}
+
+size_t Print::print(unsigned long n, int base)
+{
+  return printNumber(n, base);
+}
+
+size_t Print::print(double n, int digits)
+{
+  return printFloat(n, digits);
+}
+
+size_t Print::println(void)
+{
+  return write("\r\n");
+}
+
+size_t Print::println(const char c[])
+{
+  size_t n = print(c);
+  return n + println();
+}
+
+size_t Print::println(const String &s)
+{
+  size_t n = print(s);
+  return n + println();
+}
+
+size_t Print::println(char c)
+{
+  size_t n = print(c);
+  return n + println();
+}
+
+size_t Print::println(unsigned char b, int base)
+{
+  size_t n = print(b, base);
+  return n + println();
+}
+
+size_t Print::println(int num, int base)
+{
+  size_t n = print(num, base);
+  return n + println();
+}
+
+size_t Print::println(unsigned int num, int base)
+{
+  size_t n = print(num, base);
+  return n + println();
+}
+
+size_t Print::println(long num, int base)
+{
+  size_t n = print(num, base);
+  return n + println();
+}
+
+size_t Print::println(unsigned long num, int base)
+{
+  size_t n = print(num, base);
+  return n + println();
+}
+
+size_t Print::println(double num, int digits)
+{
+  size_t n = print(num, digits);
+  return n + println();
+}
+
+size_t Print::printNumber(unsigned long n, uint8_t base)
+{
+  char buf[8 * sizeof(long) + 1];
+  char *str = &buf[sizeof(buf) - 1];
+  *str = '\0';
+  if(base < 2) base = 10;
+  do {
+    char c = n % base;
+    n /= base;
+    *--str = c < 10 ? c + '0' : c + 'A' - 10;
+  } while(n);
+  return write(str);
+}
+
+size_t Print::printFloat(double number, uint8_t digits)
+{
+  // Same algorithm (and rounding) as the AVR core
+  size_t n = 0;
+  if(isnan(number)) return print("nan");
+  if(isinf(number)) return print("inf");
+  if(number > 4294967040.0) return print("ovf");
+  if(number < -4294967040.0) return print("ovf");
+
+  if(number < 0.0)
+  {
+    n += print('-');
+    number = -number;
+  }
+
+  double rounding = 0.5;
+  for(uint8_t i = 0; i < digits; ++i)
+    rounding /= 10.0;
+  number += rounding;
+
+  unsigned long int_part = (unsigned long)number;
+  double remainder = number - (double)int_part;
+  n += print(int_part);
+
+  if(digits > 0)
+    n += print('.');
+
+  while(digits-- > 0)
+  {
+    remainder *= 10.0;
+    unsigned int toPrint = (unsigned int)remainder;
+    n += print(toPrint);
+    remainder -= toPrint;
+  }
+  return n;
+}
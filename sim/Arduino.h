@@ -0,0 +1,193 @@
+/*
+  Arduino.h - Host stand-in for the Arduino core, used by the simulation build.
+  Only the parts of the core that the BeerLogger sketch touches are provided.
+  Time is virtual: millis()/micros() return the simulated clock and delay()
+  advances it, so a sketch run is deterministic and as fast as the host allows.
+*/
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h> // the AVR core has it through WCharacter.h
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define DEC 10
+#define HEX 16
+
+// Arduino Mega 2560 analog pin numbers
+static const uint8_t A0 = 54;
+static const uint8_t A1 = 55;
+static const uint8_t A2 = 56;
+static const uint8_t A3 = 57;
+static const uint8_t A4 = 58;
+static const uint8_t A5 = 59;
+static const uint8_t A6 = 60;
+static const uint8_t A7 = 61;
+static const uint8_t A8 = 62;
+static const uint8_t A9 = 63;
+static const uint8_t A10 = 64;
+static const uint8_t A11 = 65;
+static const uint8_t A12 = 66;
+static const uint8_t A13 = 67;
+static const uint8_t A14 = 68;
+static const uint8_t A15 = 69;
+
+#define SIM_PIN_COUNT 70
+
+#define PROGMEM
+#define F(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_ptr(addr) (*(void * const *)(addr))
+#define memcpy_P(dest, src, n) memcpy((dest), (src), (n))
+
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+void noInterrupts(void);
+void interrupts(void);
+
+// avr-libc
+char *dtostrf(double val, signed char width, unsigned char prec, char *sout);
+
+#ifdef __cplusplus
+
+class String
+{
+  public:
+    String(const char *cstr = "");
+    String(const String &str);
+    explicit String(char c);
+    explicit String(int value, unsigned char base = 10);
+    explicit String(unsigned int value, unsigned char base = 10);
+    explicit String(long value, unsigned char base = 10);
+    explicit String(unsigned long value, unsigned char base = 10);
+    explicit String(float value, unsigned char decimalPlaces = 2);
+    explicit String(double value, unsigned char decimalPlaces = 2);
+    ~String();
+
+    String & operator = (const String &rhs);
+    String & operator = (const char *cstr);
+    String & operator += (const String &rhs);
+    String & operator += (const char *cstr);
+    String & operator += (char c);
+
+    friend String operator + (const String &lhs, const String &rhs);
+    friend String operator + (const String &lhs, const char *cstr);
+    friend String operator + (const String &lhs, char c);
+
+    unsigned int length(void) const { return len; }
+    const char * c_str() const { return buffer; }
+    char charAt(unsigned int index) const;
+    char operator [] (unsigned int index) const { return charAt(index); }
+    bool equals(const String &s) const;
+    bool equals(const char *cstr) const;
+    bool operator == (const String &rhs) const { return equals(rhs); }
+    bool operator == (const char *cstr) const { return equals(cstr); }
+    long toInt(void) const;
+    float toFloat(void) const;
+
+  private:
+    void assign(const char *cstr, unsigned int length);
+    void append(const char *cstr, unsigned int length);
+
+    char *buffer;
+    unsigned int len;
+};
+
+class Print
+{
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    size_t write(const char *str) { return write((const uint8_t *)str, strlen(str)); }
+    virtual int availableForWrite() { return 0; }
+
+    size_t print(const char[]);
+    size_t print(const String &);
+    size_t print(char);
+    size_t print(unsigned char, int = DEC);
+    size_t print(int, int = DEC);
+    size_t print(unsigned int, int = DEC);
+    size_t print(long, int = DEC);
+    size_t print(unsigned long, int = DEC);
+    size_t print(double, int = 2);
+
+    size_t println(const char[]);
+    size_t println(const String &s);
+    size_t println(char);
+    size_t println(unsigned char, int = DEC);
+    size_t println(int, int = DEC);
+    size_t println(unsigned int, int = DEC);
+    size_t println(long, int = DEC);
+    size_t println(unsigned long, int = DEC);
+    size_t println(double, int = 2);
+    size_t println(void);
+
+  private:
+    size_t printNumber(unsigned long, uint8_t);
+    size_t printFloat(double, uint8_t);
+};
+
+class Stream : public Print
+{
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual void flush() = 0;
+};
+
+// The UART: interrupt driven, with 64 byte transmit and receive ring
+// buffers; write() waits when the transmit buffer is full. Bytes go over
+// the (virtual) wire at the baud rate; see Sim.h for the host end.
+#define SERIAL_TX_BUFFER_SIZE 64
+#define SERIAL_RX_BUFFER_SIZE 64
+
+class HardwareSerial : public Stream
+{
+  public:
+    void begin(unsigned long baud);
+    void end();
+    virtual int available();
+    virtual int peek();
+    virtual int read();
+    virtual void flush();
+    virtual int availableForWrite();
+    virtual size_t write(uint8_t);
+    using Print::write;
+    operator bool() { return true; }
+};
+
+extern HardwareSerial Serial;
+
+#endif // __cplusplus
+
+#endif
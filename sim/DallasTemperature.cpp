@@ -0,0 +1,195 @@
+/*
+  DallasTemperature.cpp - Scripted DS18B20 bus for the simulation build.
+*/
+
+#include "DallasTemperature.h"
+#include "Sim.h"
+#include <vector>
+
+struct SimSensor
+{
+  uint8_t address[8];
+  SimTempSource source;
+  uint8_t resolution;
+  int16_t raw; // scratchpad, 1/128 degC like the library's getTemp()
+};
+
+static std::vector<SimSensor> simSensors;
+
+void simAddSensor(const uint8_t *address, SimTempSource source)
+{
+  SimSensor s;
+  memcpy(s.address, address, 8);
+  s.source = source;
+  s.resolution = 12; // power-on default of the DS18B20
+  s.raw = 85 * 128;  // power-on scratchpad value
+  simSensors.push_back(s);
+}
+
+void simClearSensors()
+{
+  simSensors.clear();
+}
+
+uint8_t simSensorCount()
+{
+  return simSensors.size();
+}
+
+const uint8_t *simSensorAddress(uint8_t index)
+{
+  return index < simSensors.size() ? simSensors[index].address : NULL;
+}
+
+float simSensorTemp(uint8_t index)
+{
+  return index < simSensors.size() ? simSensors[index].source(millis()) : DEVICE_DISCONNECTED_C;
+}
+
+static SimSensor *findSensor(const uint8_t *address)
+{
+  for(size_t n = 0; n < simSensors.size(); n++)
+    if(memcmp(simSensors[n].address, address, 8) == 0)
+      return &simSensors[n];
+  return NULL;
+}
+
+static void convert(SimSensor &s)
+{
+  // Quantise to the sensor's resolution: 12 bit is 1/16 degC, each bit less
+  // halves it
+  float t = s.source(millis());
+  int16_t step = 8 << (12 - s.resolution);
+  long raw = lround(t * 128.0f);
+  s.raw = (int16_t)((raw / step) * step);
+}
+
+DallasTemperature::DallasTemperature(OneWire *)
+  : bitResolution(12), waitForConversion(true), conversionStart(0),
+    conversionResolution(12)
+{
+}
+
+void DallasTemperature::begin(void)
+{
+  bitResolution = 9;
+  for(size_t n = 0; n < simSensors.size(); n++)
+    if(simSensors[n].resolution > bitResolution)
+      bitResolution = simSensors[n].resolution;
+}
+
+uint8_t DallasTemperature::getDeviceCount(void)
+{
+  return simSensors.size();
+}
+
+bool DallasTemperature::getAddress(uint8_t *address, uint8_t index)
+{
+  if(index >= simSensors.size()) return false;
+  memcpy(address, simSensors[index].address, 8);
+  return true;
+}
+
+bool DallasTemperature::isConnected(const uint8_t *address)
+{
+  return findSensor(address) != NULL;
+}
+
+uint8_t DallasTemperature::getResolution()
+{
+  return bitResolution;
+}
+
+void DallasTemperature::setResolution(uint8_t newResolution)
+{
+  bitResolution = constrain(newResolution, 9, 12);
+  for(size_t n = 0; n < simSensors.size(); n++)
+    simSensors[n].resolution = bitResolution;
+}
+
+bool DallasTemperature::setResolution(const uint8_t *address, uint8_t newResolution)
+{
+  SimSensor *s = findSensor(address);
+  if(s == NULL) return false;
+  s->resolution = constrain(newResolution, 9, 12);
+  return true;
+}
+
+uint8_t DallasTemperature::getResolution(const uint8_t *address)
+{
+  SimSensor *s = findSensor(address);
+  return s ? s->resolution : 0;
+}
+
+void DallasTemperature::setWaitForConversion(bool flag)
+{
+  waitForConversion = flag;
+}
+
+bool DallasTemperature::getWaitForConversion(void)
+{
+  return waitForConversion;
+}
+
+bool DallasTemperature::isConversionComplete(void)
+{
+  return millis() - conversionStart >=
+      (unsigned long)millisToWaitForConversion(conversionResolution);
+}
+
+int16_t DallasTemperature::millisToWaitForConversion(uint8_t resolution)
+{
+  switch(resolution)
+  {
+  case 9:
+    return 94;
+  case 10:
+    return 188;
+  case 11:
+    return 375;
+  default:
+    return 750;
+  }
+}
+
+void DallasTemperature::requestTemperatures(void)
+{
+  conversionStart = millis();
+  conversionResolution = 9;
+  for(size_t n = 0; n < simSensors.size(); n++)
+  {
+    convert(simSensors[n]);
+    if(simSensors[n].resolution > conversionResolution)
+      conversionResolution = simSensors[n].resolution;
+  }
+  if(waitForConversion)
+    delay(millisToWaitForConversion(conversionResolution));
+}
+
+bool DallasTemperature::requestTemperaturesByAddress(const uint8_t *address)
+{
+  SimSensor *s = findSensor(address);
+  if(s == NULL) return false;
+  conversionStart = millis();
+  conversionResolution = s->resolution;
+  convert(*s);
+  if(waitForConversion)
+    delay(millisToWaitForConversion(conversionResolution));
+  return true;
+}
+
+int16_t DallasTemperature::getTemp(const uint8_t *address)
+{
+  SimSensor *s = findSensor(address);
+  if(s == NULL) return DEVICE_DISCONNECTED_RAW;
+  // Reading the scratchpad takes about 10 ms of bus time per sensor
+  delayMicroseconds(10000);
+  return s->raw;
+}
+
+float DallasTemperature::getTempC(const uint8_t *address)
+{
+  int16_t raw = getTemp(address);
+  if(raw == DEVICE_DISCONNECTED_RAW) return DEVICE_DISCONNECTED_C;
+  return (float)raw * 0.0078125f;
+}
@@ -0,0 +1,53 @@
+/*
+  DallasTemperature.h - Host stand-in for the DallasTemperature library.
+  Sensors are scripted through simAddSensor() in Sim.h. Conversion time is
+  charged to the virtual clock exactly like the real library: a blocking
+  requestTemperatures() waits for the full conversion of the selected
+  resolution, a non-blocking one returns at once.
+*/
+
+#ifndef DallasTemperature_h
+#define DallasTemperature_h
+
+#include "Arduino.h"
+#include "OneWire.h"
+
+typedef uint8_t DeviceAddress[8];
+
+#define DEVICE_DISCONNECTED_C -127
+#define DEVICE_DISCONNECTED_RAW -7040
+
+class DallasTemperature
+{
+  public:
+    DallasTemperature(OneWire *);
+
+    void begin(void);
+    uint8_t getDeviceCount(void);
+    bool getAddress(uint8_t *, uint8_t);
+    bool isConnected(const uint8_t *);
+
+    uint8_t getResolution();
+    void setResolution(uint8_t);
+    bool setResolution(const uint8_t *, uint8_t);
+    uint8_t getResolution(const uint8_t *);
+
+    void setWaitForConversion(bool);
+    bool getWaitForConversion(void);
+    bool isConversionComplete(void);
+    int16_t millisToWaitForConversion(uint8_t);
+
+    void requestTemperatures(void);
+    bool requestTemperaturesByAddress(const uint8_t *);
+
+    int16_t getTemp(const uint8_t *);
+    float getTempC(const uint8_t *);
+
+  private:
+    uint8_t bitResolution;
+    bool waitForConversion;
+    unsigned long conversionStart;
+    uint8_t conversionResolution;
+};
+
+#endif
@@ -0,0 +1,60 @@
+/*
+  EEPROM.cpp - In-memory EEPROM for the simulation build.
+*/
+
+#include "EEPROM.h"
+#include "Sim.h"
+
+#define EEPROM_WRITE_US 3300
+
+static uint8_t eeprom[E2END + 1];
+static bool erased = false;
+static unsigned long eepromWrites = 0;
+
+EEPROMClass EEPROM;
+
+static void erase()
+{
+  if(!erased)
+    memset(eeprom, 0xFF, sizeof(eeprom));
+  erased = true;
+}
+
+uint8_t EEPROMClass::read(int idx)
+{
+  erase();
+  return (idx >= 0 && idx <= E2END) ? eeprom[idx] : 0xFF;
+}
+
+void EEPROMClass::write(int idx, uint8_t val)
+{
+  erase();
+  if(idx < 0 || idx > E2END) return;
+  simAdvance(EEPROM_WRITE_US);
+  eeprom[idx] = val;
+  eepromWrites++;
+}
+
+void EEPROMClass::update(int idx, uint8_t val)
+{
+  if(read(idx) != val)
+    write(idx, val);
+}
+
+/// Simulation access
+std::string simEepromImage()
+{
+  erase();
+  return std::string((const char *)eeprom, sizeof(eeprom));
+}
+
+void simEepromLoad(const std::string &image)
+{
+  erase();
+  memcpy(eeprom, image.data(), image.size() < sizeof(eeprom) ? image.size() : sizeof(eeprom));
+}
+
+unsigned long simEepromWrites()
+{
+  return eepromWrites;
+}
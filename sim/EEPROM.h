@@ -0,0 +1,28 @@
+/*
+  EEPROM.h - Host stand-in for the Arduino EEPROM library, used by the
+  simulation build. The ATmega2560's 4 KB, erased to 0xFF. Writing a byte
+  takes 3.3 ms of virtual time; a power cut in that time leaves the byte
+  as it was.
+*/
+
+#ifndef EEPROM_h
+#define EEPROM_h
+
+#include "Arduino.h"
+
+#ifndef E2END
+#define E2END 0xFFF
+#endif
+
+class EEPROMClass
+{
+  public:
+    uint8_t read(int idx);
+    void write(int idx, uint8_t val);
+    void update(int idx, uint8_t val);
+    uint16_t length() { return E2END + 1; }
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,134 @@
+/*
+  LiquidCrystal.cpp - Recording HD44780 stand-in for the simulation build.
+*/
+
+#include "LiquidCrystal.h"
+#include "Sim.h"
+
+#define LCD_CLEAR_US 2000
+#define LCD_COMMAND_US 40
+
+static LiquidCrystal *simLcd = NULL;
+static SimLcdStats lcdStats;
+
+static void lcdBusy(unsigned long us)
+{
+  if(lcdStats.clears + lcdStats.commands + lcdStats.chars == 1)
+    lcdStats.firstOpUs = simMicros();
+  simAdvance(us);
+  lcdStats.busyUs += us;
+}
+
+LiquidCrystal::LiquidCrystal(uint8_t rs, uint8_t enable,
+    uint8_t d0, uint8_t d1, uint8_t d2, uint8_t d3)
+  : cols(16), rows(2), col(0), row(0), cursorOn(false)
+{
+  memset(grid, ' ', sizeof(grid));
+  for(int r = 0; r < LCD_MAX_ROWS; r++)
+    grid[r][LCD_MAX_COLS] = 0;
+  simLcd = this;
+}
+
+void LiquidCrystal::begin(uint8_t c, uint8_t r)
+{
+  cols = c > LCD_MAX_COLS ? LCD_MAX_COLS : c;
+  rows = r > LCD_MAX_ROWS ? LCD_MAX_ROWS : r;
+  for(int n = 0; n < LCD_MAX_ROWS; n++)
+    grid[n][cols] = 0;
+  clear();
+}
+
+void LiquidCrystal::clear()
+{
+  for(int r = 0; r < rows; r++)
+    memset(grid[r], ' ', cols);
+  col = 0;
+  row = 0;
+  lcdStats.clears++;
+  lcdBusy(LCD_CLEAR_US);
+}
+
+void LiquidCrystal::home()
+{
+  col = 0;
+  row = 0;
+  lcdStats.commands++;
+  lcdBusy(LCD_CLEAR_US);
+}
+
+void LiquidCrystal::setCursor(uint8_t c, uint8_t r)
+{
+  if(r >= rows) r = rows - 1;
+  col = c;
+  row = r;
+  command(0x80);
+}
+
+void LiquidCrystal::cursor()
+{
+  cursorOn = true;
+  command(0x0E);
+}
+
+void LiquidCrystal::noCursor()
+{
+  cursorOn = false;
+  command(0x0C);
+}
+
+void LiquidCrystal::blink()
+{
+  command(0x0D);
+}
+
+void LiquidCrystal::noBlink()
+{
+  command(0x0C);
+}
+
+void LiquidCrystal::display()
+{
+  command(0x0C);
+}
+
+void LiquidCrystal::noDisplay()
+{
+  command(0x08);
+}
+
+void LiquidCrystal::command(uint8_t)
+{
+  lcdStats.commands++;
+  lcdBusy(LCD_COMMAND_US);
+}
+
+size_t LiquidCrystal::write(uint8_t c)
+{
+  // Characters past the visible width go to DDRAM that is not shown
+  if(col < cols)
+    grid[row][col] = c;
+  col++;
+  lcdStats.chars++;
+  lcdBusy(LCD_COMMAND_US);
+  return 1;
+}
+
+const char *LiquidCrystal::line(uint8_t r) const
+{
+  return r < rows ? grid[r] : "";
+}
+
+const char *simLcdLine(uint8_t row)
+{
+  return simLcd ? simLcd->line(row) : "";
+}
+
+SimLcdStats simLcdStats()
+{
+  return lcdStats;
+}
+
+void simLcdResetStats()
+{
+  memset(&lcdStats, 0, sizeof(lcdStats));
+}
@@ -0,0 +1,50 @@
+/*
+  LiquidCrystal.h - Host stand-in for the HD44780 LiquidCrystal library.
+  Every operation is recorded into a character grid that the simulation can
+  inspect, and charged to the virtual clock with the controller's execution
+  time (about 2 ms for clear/home, 40 us for everything else).
+*/
+
+#ifndef LiquidCrystal_h
+#define LiquidCrystal_h
+
+#include "Arduino.h"
+
+#define LCD_MAX_COLS 20
+#define LCD_MAX_ROWS 4
+
+class LiquidCrystal : public Print
+{
+  public:
+    LiquidCrystal(uint8_t rs, uint8_t enable,
+        uint8_t d0, uint8_t d1, uint8_t d2, uint8_t d3);
+
+    void begin(uint8_t cols, uint8_t rows);
+    void clear();
+    void home();
+    void setCursor(uint8_t col, uint8_t row);
+    void cursor();
+    void noCursor();
+    void blink();
+    void noBlink();
+    void display();
+    void noDisplay();
+    void command(uint8_t);
+
+    virtual size_t write(uint8_t);
+    using Print::write;
+
+    // Simulation access
+    const char *line(uint8_t row) const;
+    bool cursorVisible() const { return cursorOn; }
+    uint8_t cursorCol() const { return col; }
+    uint8_t cursorRow() const { return row; }
+
+  private:
+    uint8_t cols, rows;
+    uint8_t col, row;
+    bool cursorOn;
+    char grid[LCD_MAX_ROWS][LCD_MAX_COLS + 1];
+};
+
+#endif
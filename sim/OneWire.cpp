@@ -0,0 +1,42 @@
+/*
+  OneWire.cpp - Host stand-in for the OneWire library: only the CRC helpers.
+*/
+
+#include "OneWire.h"
+
+uint8_t OneWire::crc8(const uint8_t *addr, uint8_t len)
+{
+  uint8_t crc = 0;
+  while(len--)
+  {
+    uint8_t inbyte = *addr++;
+    for(uint8_t i = 8; i; i--)
+    {
+      uint8_t mix = (crc ^ inbyte) & 0x01;
+      crc >>= 1;
+      if(mix) crc ^= 0x8C;
+      inbyte >>= 1;
+    }
+  }
+  return crc;
+}
+
+uint16_t OneWire::crc16(const uint8_t *input, uint16_t len, uint16_t crc)
+{
+  static const uint8_t oddparity[16] =
+    { 0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0 };
+
+  for(uint16_t i = 0; i < len; i++)
+  {
+    uint16_t cdata = input[i];
+    cdata = (cdata ^ crc) & 0xff;
+    crc >>= 8;
+    if(oddparity[cdata & 0x0F] ^ oddparity[cdata >> 4])
+      crc ^= 0xC001;
+    cdata <<= 6;
+    crc ^= cdata;
+    cdata <<= 1;
+    crc ^= cdata;
+  }
+  return crc;
+}
@@ -0,0 +1,26 @@
+/*
+  OneWire.h - Host stand-in for the OneWire library, used by the simulation build.
+  The bus itself is not simulated; DallasTemperature talks to the scripted
+  sensors directly.
+*/
+
+#ifndef OneWire_h
+#define OneWire_h
+
+#include "Arduino.h"
+
+class OneWire
+{
+  public:
+    OneWire(uint8_t pin) : pin(pin) {}
+
+    // Dallas/Maxim CRC8, as used in ROM codes and scratchpads
+    static uint8_t crc8(const uint8_t *addr, uint8_t len);
+    // Dallas/Maxim CRC16, can be computed in pieces by passing the last crc
+    static uint16_t crc16(const uint8_t *input, uint16_t len, uint16_t crc = 0);
+
+  private:
+    uint8_t pin;
+};
+
+#endif
@@ -0,0 +1,19 @@
+/*
+  PinChangeInterrupt.h - Host stand-in for the PinChangeInterrupt library.
+  Handlers are stored per pin and fired by simSetPin() when the simulated
+  level change matches the requested mode.
+*/
+
+#ifndef PinChangeInterrupt_h
+#define PinChangeInterrupt_h
+
+#include "Arduino.h"
+
+typedef void (* callback)(void);
+
+#define digitalPinToPinChangeInterrupt(p) (p)
+
+void attachPinChangeInterrupt(uint8_t pcintNum, callback userFunc, uint8_t mode);
+void detachPinChangeInterrupt(uint8_t pcintNum);
+
+#endif
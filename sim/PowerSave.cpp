@@ -0,0 +1,49 @@
+/*
+  PowerSave.cpp - Host stand-in for the sleep modes of PowerSave.h.
+  Sleeping moves the virtual clock instead: idle by a millisecond (the
+  Timer0 tick), power down by the watchdog period in millisecond steps.
+  Power down ends early when a pin change interrupt fires or a byte
+  starts to arrive on Serial's RX pin. The UART's clock is stopped then,
+  so the frame on its way is lost, like on the board; the RX pin's edge
+  fires a handler attached to pin 0. The watchdog is taken to be
+  calibrated exactly, so millis() stays the virtual time.
+*/
+
+#include "Arduino.h"
+#include "PowerSave.h"
+#include "Sim.h"
+
+void powerIdle()
+{
+  delay(1);
+}
+
+unsigned long powerDown(unsigned long ms, boolean (*awake)())
+{
+  unsigned long period = 16;
+  while((2 * period <= ms) && (2 * period <= POWER_DOWN_MAX_MS))
+    period *= 2;
+  if(awake())
+    return 0;
+
+  unsigned long pinEvents = simPinInterrupts();
+  for(unsigned long n = 0; n < period; n++)
+  {
+    delay(1);
+    if(simSerialArriving())
+    {
+      simSerialDropArriving();
+      simSetPin(0, LOW);
+      simSetPin(0, HIGH);
+    }
+    if(simPinInterrupts() != pinEvents)
+      // the board would not know how far into the period it is
+      return (period + 1) / 2;
+  }
+  return period;
+}
+
+void powerCalibrate()
+{
+  delay(16);
+}
@@ -0,0 +1,95 @@
+/*
+  RTClib.cpp - Simulated DS1307 and the RTClib DateTime arithmetic.
+*/
+
+#include "RTClib.h"
+#include "Sim.h"
+
+#define SECONDS_FROM_1970_TO_2000 946684800
+
+static const uint8_t daysInMonth[] = { 31,28,31,30,31,30,31,31,30,31,30,31 };
+
+static uint16_t date2days(uint16_t y, uint8_t m, uint8_t d)
+{
+  if(y >= 2000) y -= 2000;
+  uint16_t days = d;
+  for(uint8_t i = 1; i < m; ++i)
+    days += daysInMonth[i - 1];
+  if(m > 2 && y % 4 == 0) ++days;
+  return days + 365 * y + (y + 3) / 4 - 1;
+}
+
+DateTime::DateTime(uint32_t t)
+{
+  t -= SECONDS_FROM_1970_TO_2000;
+  ss = t % 60;
+  t /= 60;
+  mm = t % 60;
+  t /= 60;
+  hh = t % 24;
+  uint16_t days = t / 24;
+  uint8_t leap;
+  for(yOff = 0; ; ++yOff)
+  {
+    leap = yOff % 4 == 0;
+    if(days < 365 + leap) break;
+    days -= 365 + leap;
+  }
+  for(m = 1; ; ++m)
+  {
+    uint8_t daysPerMonth = daysInMonth[m - 1];
+    if(leap && m == 2) ++daysPerMonth;
+    if(days < daysPerMonth) break;
+    days -= daysPerMonth;
+  }
+  d = days + 1;
+}
+
+DateTime::DateTime(uint16_t year, uint8_t month, uint8_t day,
+    uint8_t hour, uint8_t min, uint8_t sec)
+{
+  if(year >= 2000) year -= 2000;
+  yOff = year;
+  m = month;
+  d = day;
+  hh = hour;
+  mm = min;
+  ss = sec;
+}
+
+uint32_t DateTime::unixtime(void) const
+{
+  uint16_t days = date2days(yOff, m, d);
+  uint32_t t = ((days * 24UL + hh) * 60 + mm) * 60 + ss;
+  return t + SECONDS_FROM_1970_TO_2000;
+}
+
+// 2016-01-01 00:00:00 unless the simulation sets something else
+static uint32_t rtcBase = 1451606400;
+static unsigned long long rtcBaseUs = 0;
+
+void simRtcSet(uint32_t unixtime)
+{
+  rtcBase = unixtime;
+  rtcBaseUs = simMicros();
+}
+
+bool RTC_DS1307::begin(void)
+{
+  return true;
+}
+
+void RTC_DS1307::adjust(const DateTime &dt)
+{
+  simRtcSet(dt.unixtime());
+}
+
+uint8_t RTC_DS1307::isrunning(void)
+{
+  return 1;
+}
+
+DateTime RTC_DS1307::now()
+{
+  return DateTime(rtcBase + (uint32_t)((simMicros() - rtcBaseUs) / 1000000ULL));
+}
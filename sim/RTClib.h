@@ -0,0 +1,40 @@
+/*
+  RTClib.h - Host stand-in for RTClib, used by the simulation build.
+  The simulated DS1307 counts from the time set with adjust() (or the
+  simulation epoch) using the virtual clock.
+*/
+
+#ifndef RTClib_h
+#define RTClib_h
+
+#include "Arduino.h"
+
+class DateTime
+{
+  public:
+    DateTime(uint32_t t = 0);
+    DateTime(uint16_t year, uint8_t month, uint8_t day,
+        uint8_t hour = 0, uint8_t min = 0, uint8_t sec = 0);
+
+    uint16_t year() const { return 2000 + yOff; }
+    uint8_t month() const { return m; }
+    uint8_t day() const { return d; }
+    uint8_t hour() const { return hh; }
+    uint8_t minute() const { return mm; }
+    uint8_t second() const { return ss; }
+    uint32_t unixtime(void) const;
+
+  protected:
+    uint8_t yOff, m, d, hh, mm, ss;
+};
+
+class RTC_DS1307
+{
+  public:
+    bool begin(void);
+    void adjust(const DateTime &dt);
+    uint8_t isrunning(void);
+    DateTime now();
+};
+
+#endif
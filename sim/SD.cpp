@@ -0,0 +1,553 @@
+/*
+  SD.cpp - In-memory SD card for the simulation build.
+  The card is a map of upper-cased 8.3 paths to byte vectors. SdFat keeps a
+  single 512 byte block cache for the whole volume; it is modelled here so
+  that evicting a dirty block, flush() and close() cost a block write (plus
+  the directory entry update on sync) like on the real card.
+  The size in the directory entry is kept apart from the data, for what a
+  power cut leaves on the card (simSdPowerCut()).
+*/
+
+#include "SD.h"
+#include "Sim.h"
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include <ctype.h>
+#include <stdlib.h>
+
+struct SimEntry
+{
+  SimEntry() : dir(false), synced(0) {}
+  bool dir;
+  std::vector<uint8_t> data;
+  uint32_t synced; // size in the directory entry, as of the last sync
+};
+
+struct SimHandle
+{
+  std::string path;
+  char name[13];
+  uint32_t pos;
+  uint8_t mode;
+  bool dirty; // directory entry needs an update on sync
+  int refs;
+  bool open;
+  std::string dirCursor;
+};
+
+static std::map<std::string, SimEntry> card;
+static bool cardPresent = true;
+static bool cardMounted = false;
+static SimSdStats sdStats;
+static unsigned long blockTimeUs = 1000;
+
+static std::string cachePath;
+static uint32_t cacheBlock = 0;
+static bool cacheValid = false;
+static bool cacheDirty = false;
+
+SDClass SD;
+
+static std::string normalize(const char *path)
+{
+  std::string p;
+  while(*path == '/') path++;
+  for(; *path; path++)
+    p += (char)toupper(*path);
+  while(!p.empty() && p[p.size() - 1] == '/')
+    p.erase(p.size() - 1);
+  return p;
+}
+
+static std::string parentOf(const std::string &p)
+{
+  size_t slash = p.rfind('/');
+  return slash == std::string::npos ? std::string() : p.substr(0, slash);
+}
+
+static bool parentExists(const std::string &p)
+{
+  std::string parent = parentOf(p);
+  if(parent.empty()) return true;
+  std::map<std::string, SimEntry>::iterator it = card.find(parent);
+  return it != card.end() && it->second.dir;
+}
+
+static void blockWrite()
+{
+  sdStats.blockWrites++;
+  simAdvance(blockTimeUs);
+}
+
+static void blockRead()
+{
+  sdStats.blockReads++;
+  simAdvance(blockTimeUs / 2);
+}
+
+static void cacheWriteBack()
+{
+  if(cacheValid && cacheDirty)
+  {
+    blockWrite();
+    cacheDirty = false;
+  }
+}
+
+// Bring (path, block) into the cache, evicting whatever was there
+static void cacheFetch(const std::string &path, uint32_t block, bool forWrite, uint32_t fileSize)
+{
+  if(!(cacheValid && cachePath == path && cacheBlock == block))
+  {
+    cacheWriteBack();
+    // A block that starts at or past EOF does not need to be read first
+    if(!forWrite || block * SD_BLOCK_SIZE < fileSize)
+      blockRead();
+    cachePath = path;
+    cacheBlock = block;
+    cacheValid = true;
+  }
+  if(forWrite) cacheDirty = true;
+}
+
+static void cacheInvalidate(const std::string &path)
+{
+  if(cacheValid && cachePath == path)
+  {
+    cacheValid = false;
+    cacheDirty = false;
+  }
+}
+
+/// File
+File::File() : h(NULL)
+{
+}
+
+File::File(SimHandle *handle) : h(handle)
+{
+  if(h) h->refs++;
+}
+
+File::File(const File &other) : h(other.h)
+{
+  if(h) h->refs++;
+}
+
+File & File::operator = (const File &other)
+{
+  if(other.h) other.h->refs++;
+  release();
+  h = other.h;
+  return *this;
+}
+
+File::~File()
+{
+  release();
+}
+
+void File::release()
+{
+  if(h && --h->refs == 0)
+    delete h;
+  h = NULL;
+}
+
+static SimEntry *entryOf(SimHandle *h)
+{
+  if(h == NULL || !h->open) return NULL;
+  std::map<std::string, SimEntry>::iterator it = card.find(h->path);
+  return it == card.end() ? NULL : &it->second;
+}
+
+size_t File::write(uint8_t b)
+{
+  return write(&b, 1);
+}
+
+size_t File::write(const uint8_t *buf, size_t size)
+{
+  SimEntry *e = entryOf(h);
+  if(e == NULL || e->dir || !(h->mode & 0x02)) return 0;
+  // O_APPEND: every write goes to the end of the file
+  h->pos = e->data.size();
+  for(size_t n = 0; n < size; n++)
+  {
+    cacheFetch(h->path, h->pos / SD_BLOCK_SIZE, true, e->data.size());
+    if(h->pos < e->data.size())
+      e->data[h->pos] = buf[n];
+    else
+      e->data.push_back(buf[n]);
+    h->pos++;
+  }
+  h->dirty = true;
+  sdStats.bytesWritten += size;
+  return size;
+}
+
+int File::read()
+{
+  uint8_t b;
+  return read(&b, 1) == 1 ? b : -1;
+}
+
+int File::read(void *buf, uint16_t nbyte)
+{
+  SimEntry *e = entryOf(h);
+  if(e == NULL || e->dir) return -1;
+  uint8_t *dst = (uint8_t *)buf;
+  int n = 0;
+  while(n < nbyte && h->pos < e->data.size())
+  {
+    cacheFetch(h->path, h->pos / SD_BLOCK_SIZE, false, e->data.size());
+    dst[n++] = e->data[h->pos++];
+  }
+  sdStats.bytesRead += n;
+  return n;
+}
+
+int File::peek()
+{
+  SimEntry *e = entryOf(h);
+  if(e == NULL || e->dir || h->pos >= e->data.size()) return -1;
+  return e->data[h->pos];
+}
+
+int File::available()
+{
+  SimEntry *e = entryOf(h);
+  if(e == NULL || e->dir) return 0;
+  uint32_t left = e->data.size() - h->pos;
+  return left > 0x7FFF ? 0x7FFF : left;
+}
+
+void File::flush()
+{
+  if(entryOf(h) == NULL) return;
+  sdStats.flushes++;
+  if(cacheValid && cachePath == h->path)
+    cacheWriteBack();
+  if(h->dirty)
+  {
+    // Directory entry: size and modification time
+    blockRead();
+    blockWrite();
+    h->dirty = false;
+    SimEntry *e = entryOf(h);
+    if(e)
+      e->synced = e->data.size();
+  }
+}
+
+bool File::seek(uint32_t pos)
+{
+  SimEntry *e = entryOf(h);
+  if(e == NULL || pos > e->data.size()) return false;
+  h->pos = pos;
+  return true;
+}
+
+uint32_t File::position()
+{
+  return h ? h->pos : 0;
+}
+
+uint32_t File::size()
+{
+  SimEntry *e = entryOf(h);
+  return e ? e->data.size() : 0;
+}
+
+void File::close()
+{
+  if(entryOf(h) == NULL) return;
+  flush();
+  h->open = false;
+}
+
+File::operator bool()
+{
+  return entryOf(h) != NULL;
+}
+
+char * File::name()
+{
+  return h ? h->name : (char *)"";
+}
+
+bool File::isDirectory(void)
+{
+  SimEntry *e = entryOf(h);
+  return e ? e->dir : false;
+}
+
+File File::openNextFile(uint8_t mode)
+{
+  SimEntry *e = entryOf(h);
+  if(e == NULL || !e->dir) return File();
+  std::string prefix = h->path.empty() ? std::string() : h->path + "/";
+  std::map<std::string, SimEntry>::iterator it = card.upper_bound(h->dirCursor);
+  for(; it != card.end(); ++it)
+  {
+    const std::string &p = it->first;
+    if(p.compare(0, prefix.size(), prefix) != 0) continue;
+    if(p.find('/', prefix.size()) != std::string::npos) continue;
+    h->dirCursor = p;
+    return SD.open(p.c_str(), mode);
+  }
+  h->dirCursor = "\xff";
+  return File();
+}
+
+void File::rewindDirectory(void)
+{
+  if(h) h->dirCursor.clear();
+}
+
+/// SDClass
+bool SDClass::begin(uint8_t csPin)
+{
+  // Card init and reading the volume boot block and FAT
+  if(!cardPresent) return false;
+  blockRead();
+  blockRead();
+  cardMounted = true;
+  card[""].dir = true;
+  return true;
+}
+
+bool SDClass::begin(uint8_t csPin, int8_t mosi, int8_t miso, int8_t sck)
+{
+  return begin(csPin);
+}
+
+void SDClass::end()
+{
+  cacheWriteBack();
+  cacheValid = false;
+  cardMounted = false;
+}
+
+File SDClass::open(const char *filename, uint8_t mode)
+{
+  if(!cardMounted) return File();
+  std::string p = normalize(filename);
+  std::map<std::string, SimEntry>::iterator it = card.find(p);
+  if(it == card.end())
+  {
+    if(!(mode & 0x02) || !parentExists(p)) return File();
+    card[p].dir = false;
+    it = card.find(p);
+    blockWrite(); // new directory entry
+  }
+  sdStats.opens++;
+  // Walk the directory and the FAT chain to the end of the file: one read
+  // per directory level plus one per cluster (8 blocks here)
+  blockRead();
+  if(mode & 0x02)
+    for(uint32_t c = 0; c < it->second.data.size() / (8 * SD_BLOCK_SIZE); c++)
+      blockRead();
+
+  SimHandle *h = new SimHandle();
+  h->path = p;
+  size_t slash = p.rfind('/');
+  std::string base = slash == std::string::npos ? p : p.substr(slash + 1);
+  strncpy(h->name, base.c_str(), sizeof(h->name) - 1);
+  h->name[sizeof(h->name) - 1] = 0;
+  h->mode = mode;
+  h->pos = (mode & 0x02) ? it->second.data.size() : 0;
+  h->dirty = false;
+  h->refs = 0;
+  h->open = true;
+  return File(h);
+}
+
+bool SDClass::exists(const char *filepath)
+{
+  if(!cardMounted) return false;
+  return card.find(normalize(filepath)) != card.end();
+}
+
+bool SDClass::mkdir(const char *filepath)
+{
+  if(!cardMounted) return false;
+  // Like SdFat, create missing parents as well
+  std::string p = normalize(filepath);
+  size_t pos = 0;
+  while(true)
+  {
+    pos = p.find('/', pos);
+    std::string part = p.substr(0, pos);
+    std::map<std::string, SimEntry>::iterator it = card.find(part);
+    if(it == card.end())
+    {
+      card[part].dir = true;
+      blockWrite();
+    }
+    else if(!it->second.dir)
+      return false;
+    if(pos == std::string::npos) break;
+    pos++;
+  }
+  return true;
+}
+
+bool SDClass::remove(const char *filepath)
+{
+  if(!cardMounted) return false;
+  std::string p = normalize(filepath);
+  std::map<std::string, SimEntry>::iterator it = card.find(p);
+  if(it == card.end() || it->second.dir) return false;
+  cacheInvalidate(p);
+  card.erase(it);
+  blockWrite();
+  return true;
+}
+
+bool SDClass::rmdir(const char *filepath)
+{
+  if(!cardMounted) return false;
+  std::string p = normalize(filepath);
+  std::map<std::string, SimEntry>::iterator it = card.find(p);
+  if(it == card.end() || !it->second.dir) return false;
+  std::map<std::string, SimEntry>::iterator next = it;
+  ++next;
+  if(next != card.end() && next->first.compare(0, p.size() + 1, p + "/") == 0)
+    return false;
+  card.erase(it);
+  blockWrite();
+  return true;
+}
+
+/// Simulation access
+void simSdInsert(bool present)
+{
+  cardPresent = present;
+  if(!present) cardMounted = false;
+}
+
+void simSdWriteFile(const char *name, const std::string &content)
+{
+  std::string p = normalize(name);
+  cacheInvalidate(p);
+  SimEntry &e = card[p];
+  e.dir = false;
+  e.data.assign(content.begin(), content.end());
+  e.synced = e.data.size();
+}
+
+bool simSdReadFile(const char *name, std::string &content)
+{
+  std::map<std::string, SimEntry>::iterator it = card.find(normalize(name));
+  if(it == card.end() || it->second.dir) return false;
+  content.assign(it->second.data.begin(), it->second.data.end());
+  return true;
+}
+
+void simSdFormat()
+{
+  card.clear();
+  card[""].dir = true;
+  cacheValid = false;
+  cacheDirty = false;
+}
+
+SimSdStats simSdStats()
+{
+  return sdStats;
+}
+
+void simSdResetStats()
+{
+  memset(&sdStats, 0, sizeof(sdStats));
+}
+
+void simSdSetBlockTime(unsigned long us)
+{
+  blockTimeUs = us;
+}
+
+// What the card has after the power goes: of each file what its directory
+// entry says, as of the last sync. For some of them, a card that does its
+// writes in another order leaves the new size with the blocks after the
+// old one never written (0x00 or 0xFF), or a size in between, cutting a
+// row. The block cache and open files are gone.
+void simSdPowerCut()
+{
+  std::map<std::string, SimEntry>::iterator it;
+  for(it = card.begin(); it != card.end(); ++it)
+  {
+    SimEntry &e = it->second;
+    if(e.dir || e.data.size() <= e.synced)
+      continue;
+    switch(rand() % 4)
+    {
+    case 0:
+    case 1:
+      e.data.resize(e.synced);
+      break;
+    case 2:
+      std::fill(e.data.begin() + e.synced, e.data.end(), (rand() & 1) ? 0xFF : 0x00);
+      break;
+    case 3:
+      e.data.resize(e.synced + rand() % (e.data.size() - e.synced));
+      break;
+    }
+    e.synced = e.data.size();
+  }
+  cacheValid = false;
+  cacheDirty = false;
+  cardMounted = false;
+}
+
+static void put32(std::string &out, uint32_t v)
+{
+  for(int b = 0; b < 4; b++)
+    out += (char)((v >> (8 * b)) & 0xFF);
+}
+
+static uint32_t get32(const std::string &in, size_t pos)
+{
+  uint32_t v = 0;
+  for(int b = 0; b < 4 && pos + b < in.size(); b++)
+    v |= (uint32_t)(uint8_t)in[pos + b] << (8 * b);
+  return v;
+}
+
+// Per entry: path length, path, directory flag, size, data
+std::string simSdImage()
+{
+  std::string out;
+  std::map<std::string, SimEntry>::iterator it;
+  for(it = card.begin(); it != card.end(); ++it)
+  {
+    put32(out, it->first.size());
+    out += it->first;
+    out += (char)it->second.dir;
+    put32(out, it->second.data.size());
+    out.append(it->second.data.begin(), it->second.data.end());
+  }
+  return out;
+}
+
+void simSdLoadImage(const std::string &image)
+{
+  simSdFormat();
+  size_t pos = 0;
+  while(pos + 9 <= image.size())
+  {
+    uint32_t n = get32(image, pos);
+    std::string path = image.substr(pos + 4, n);
+    pos += 4 + n;
+    SimEntry &e = card[path];
+    e.dir = image[pos] != 0;
+    uint32_t size = get32(image, pos + 1);
+    pos += 5;
+    e.data.assign(image.begin() + pos, image.begin() + pos + size);
+    e.synced = size;
+    pos += size;
+  }
+}
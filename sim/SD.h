@@ -0,0 +1,71 @@
+/*
+  SD.h - Host stand-in for the SD library, used by the simulation build.
+  Files live in memory. Writes are buffered in a 512 byte block cache the
+  same way SdFat does it, so the number of physical block writes (and the
+  virtual time they cost) matches what the card would see.
+*/
+
+#ifndef SD_h
+#define SD_h
+
+#include "Arduino.h"
+
+#define FILE_READ 0x01
+#define FILE_WRITE 0x13
+
+#define SD_BLOCK_SIZE 512
+
+struct SimHandle;
+
+class File : public Stream
+{
+  public:
+    File();
+    File(const File &other);
+    File & operator = (const File &other);
+    ~File();
+
+    virtual size_t write(uint8_t);
+    virtual size_t write(const uint8_t *buf, size_t size);
+    using Print::write;
+    virtual int read();
+    virtual int peek();
+    virtual int available();
+    virtual void flush();
+    int read(void *buf, uint16_t nbyte);
+    bool seek(uint32_t pos);
+    uint32_t position();
+    uint32_t size();
+    void close();
+    operator bool();
+    char * name();
+    bool isDirectory(void);
+    File openNextFile(uint8_t mode = FILE_READ);
+    void rewindDirectory(void);
+
+  private:
+    friend class SDClass;
+    explicit File(SimHandle *h);
+    void release();
+
+    SimHandle *h;
+};
+
+class SDClass
+{
+  public:
+    bool begin(uint8_t csPin = 10);
+    bool begin(uint8_t csPin, int8_t mosi, int8_t miso, int8_t sck);
+    void end();
+
+    File open(const char *filename, uint8_t mode = FILE_READ);
+    File open(const String &filename, uint8_t mode = FILE_READ) { return open(filename.c_str(), mode); }
+    bool exists(const char *filepath);
+    bool mkdir(const char *filepath);
+    bool remove(const char *filepath);
+    bool rmdir(const char *filepath);
+};
+
+extern SDClass SD;
+
+#endif
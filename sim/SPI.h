@@ -0,0 +1,8 @@
+/*
+  SPI.h - Host stand-in for the SPI library, used by the simulation build.
+*/
+
+#ifndef SPI_h
+#define SPI_h
+
+#endif
@@ -0,0 +1,111 @@
+/*
+  Sim.h - Control interface of the host simulation.
+  The stand-in libraries in this directory keep their state here; the
+  benchmark (and anything else driving the sketch on the host) uses these
+  functions to move the virtual clock, inject inputs and look at outputs.
+*/
+
+#ifndef Sim_h
+#define Sim_h
+
+#include "Arduino.h"
+#include <string>
+
+/// Virtual clock
+void simAdvance(unsigned long us);
+unsigned long long simMicros();
+// Called from every delay(), where the sketch waits; to let the outside
+// world in while it does
+void simSetIdleHook(void (*hook)());
+// Call hook when the virtual clock gets to atUs, from inside whatever the
+// sketch is doing then; the clock stands at atUs. For a power cut the hook
+// does not return (see powercut.cpp).
+void simSetPowerCut(unsigned long long atUs, void (*hook)());
+
+/// Pins and interrupts
+void simSetPin(uint8_t pin, uint8_t level);
+uint8_t simPinLevel(uint8_t pin);
+// One detent of the rotary encoder (full quadrature cycle), gap is the time
+// between two edges
+void simTurnEncoder(int steps, unsigned long gapUs = 2000);
+void simPressButton(uint8_t pin, unsigned long holdUs = 50000);
+// Pin change interrupt handlers run so far
+unsigned long simPinInterrupts();
+
+/// Temperature sensors
+typedef float (* SimTempSource)(unsigned long ms);
+void simAddSensor(const uint8_t *address, SimTempSource source);
+void simClearSensors();
+uint8_t simSensorCount();
+const uint8_t *simSensorAddress(uint8_t index);
+float simSensorTemp(uint8_t index);
+
+/// SD card
+struct SimSdStats
+{
+  unsigned long opens;
+  unsigned long bytesWritten;
+  unsigned long bytesRead;
+  unsigned long flushes;
+  unsigned long blockWrites;
+  unsigned long blockReads;
+};
+void simSdInsert(bool present);
+void simSdWriteFile(const char *name, const std::string &content);
+bool simSdReadFile(const char *name, std::string &content);
+void simSdFormat();
+SimSdStats simSdStats();
+void simSdResetStats();
+// Virtual time charged for one 512 byte block transfer
+void simSdSetBlockTime(unsigned long us);
+// Leave the card as the power going would (uses rand()); unmounts it
+void simSdPowerCut();
+// The card's files, to start another run with
+std::string simSdImage();
+void simSdLoadImage(const std::string &image);
+
+/// EEPROM
+std::string simEepromImage();
+void simEepromLoad(const std::string &image);
+unsigned long simEepromWrites();
+
+/// LCD
+struct SimLcdStats
+{
+  unsigned long clears;
+  unsigned long commands;
+  unsigned long chars;
+  unsigned long long busyUs;
+  // Virtual time of the first operation since simLcdResetStats()
+  unsigned long long firstOpUs;
+};
+const char *simLcdLine(uint8_t row);
+SimLcdStats simLcdStats();
+void simLcdResetStats();
+
+/// Serial port
+// The host end of Serial: bytes sent arrive at the logger at the baud
+// rate, what the logger sent and has gone over the wire is collected
+struct SimSerialStats
+{
+  unsigned long bytesOut; // logger to host
+  unsigned long bytesIn;
+  unsigned long rxOverflows; // bytes lost to a full receive buffer
+  unsigned long rxLost; // bytes lost while the UART slept
+  unsigned long long lastOutUs; // virtual time the last byte out was sent
+};
+void simSerialSend(const std::string &data);
+std::string simSerialReceive();
+// Nothing queued in either direction
+bool simSerialIdle();
+// A byte from the host has started to arrive; drop what is on its way
+// (for a sleeping UART)
+bool simSerialArriving();
+void simSerialDropArriving();
+SimSerialStats simSerialStats();
+void simSerialResetStats();
+
+/// RTC
+void simRtcSet(uint32_t unixtime);
+
+#endif
@@ -0,0 +1,17 @@
+/*
+  Wire.h - Host stand-in for the TWI library, used by the simulation build.
+  The simulated RTC does not talk over a bus, so this only has to link.
+*/
+
+#ifndef Wire_h
+#define Wire_h
+
+class TwoWire
+{
+  public:
+    void begin() {}
+};
+
+extern TwoWire Wire;
+
+#endif
@@ -0,0 +1,380 @@
+/*
+  beerctl.cpp - Talk to the logger over its serial port (see SerialLink.h).
+
+  usage: beerctl [-b baud] <port> <command>
+    ping
+    status
+    settings                 print the settings, in the settings file format
+    set <name>=<value>       apply a setting (not stored)
+    store                    store the settings on the card
+    watch [seconds]          print live samples as text log lines
+    download <from> <to> [dir]
+                             copy the log files' rows from..to into dir;
+                             the files keep their names, and may hold an
+                             hour of rows more on either end
+
+  Times are unixtime or YYYY-MM-DD[THH:MM[:SS]] in the logger's clock.
+  The port is anything termios can open: the USB serial of the board, or
+  the pseudo-terminal simtty prints.
+*/
+
+#include "SerialLink.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+
+// The serial port as a Stream for SerialLink
+class PortStream : public Stream
+{
+  public:
+    PortStream(int fd) : fd(fd), len(0), pos(0) {}
+
+    virtual int available()
+    {
+      if(pos == len)
+      {
+        ssize_t n = ::read(fd, buf, sizeof(buf));
+        len = (n > 0) ? n : 0;
+        pos = 0;
+      }
+      return len - pos;
+    }
+    virtual int read() { return available() ? buf[pos++] : -1; }
+    virtual int peek() { return available() ? buf[pos] : -1; }
+    virtual void flush() { tcdrain(fd); }
+    // The kernel buffers whole frames
+    virtual int availableForWrite() { return LINK_PAYLOAD_MAX + LINK_OVERHEAD; }
+    virtual size_t write(uint8_t c) { return write(&c, 1); }
+    virtual size_t write(const uint8_t *b, size_t n)
+    {
+      size_t done = 0;
+      while(done < n)
+      {
+        ssize_t w = ::write(fd, b + done, n - done);
+        if(w > 0)
+          done += w;
+        else if(errno == EAGAIN)
+          wait(POLLOUT, 100);
+        else
+          break;
+      }
+      return done;
+    }
+
+    // Until the port can be read (or written), at most ms
+    bool wait(short events, int ms)
+    {
+      if(events == POLLIN && pos < len)
+        return true;
+      struct pollfd p = { fd, events, 0 };
+      return poll(&p, 1, ms) > 0;
+    }
+
+  private:
+    int fd;
+    uint8_t buf[256];
+    size_t len, pos;
+};
+
+static PortStream *port;
+static SerialLink *serial;
+static byte seq = 0;
+static volatile bool stop = false;
+
+static void onSignal(int)
+{
+  stop = true;
+}
+
+static uint32_t get32(const byte *p)
+{
+  return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put32(byte *p, uint32_t v)
+{
+  for(int b = 0; b < 4; b++)
+    p[b] = (v >> (8 * b)) & 0xFF;
+}
+
+static int16_t get16(const byte *p)
+{
+  return (int16_t)(p[0] | (p[1] << 8));
+}
+
+// The next frame, or false after ms without one
+static bool next(int ms)
+{
+  while(!serial->receive())
+    if(stop || !port->wait(POLLIN, ms))
+      return false;
+  return true;
+}
+
+// Send a request and wait for its reply; tries three times
+static bool request(byte type, const byte *payload, byte length)
+{
+  for(int tries = 0; tries < 3; tries++)
+  {
+    seq++;
+    serial->send(type, seq, payload, length);
+    while(next(1000))
+    {
+      if(serial->seq() != seq)
+        continue;
+      if(serial->type() == (type | LINK_REPLY))
+        return true;
+      if(serial->type() == LINK_UNKNOWN)
+      {
+        fprintf(stderr, "request %02X not understood\n", type);
+        return false;
+      }
+    }
+  }
+  fprintf(stderr, "no reply\n");
+  return false;
+}
+
+static bool parseTime(const char *text, uint32_t *t)
+{
+  struct tm tm = {};
+  int n = 0;
+  if(sscanf(text, "%d-%d-%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &n) == 3)
+  {
+    if(text[n] == 'T' || text[n] == ' ')
+      sscanf(text + n + 1, "%d:%d:%d", &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+    tm.tm_year -= 1900;
+    tm.tm_mon--;
+    *t = timegm(&tm);
+    return true;
+  }
+  char *end;
+  *t = strtoul(text, &end, 10);
+  return *end == 0;
+}
+
+static void printSample(const byte *p, byte length)
+{
+  printf("%lu;", (unsigned long)get32(p));
+  for(byte n = 5; n + 1 < length; n += 2)
+    printf("%.2f;", get16(p + n) / 100.0);
+  printf("%d\n", p[4]);
+  fflush(stdout);
+}
+
+static int status()
+{
+  static const char *modes[] = { "off", "heat", "cool", "on", "pid" };
+  if(!request(LINK_STATUS, NULL, 0))
+    return 1;
+  const byte *p = serial->payload();
+  time_t t = get32(p);
+  char when[32];
+  strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", gmtime(&t));
+  printf("time %s, %lu samples, card %s, relays %02X\n", when,
+      (unsigned long)get32(p + 4), p[9] ? "in use" : "off", p[8]);
+  byte n = 11;
+  for(byte c = 0; c < p[10]; c++, n += 2)
+    printf("channel %d: %.2f C\n", c, get16(p + n) / 100.0);
+  byte zones = p[n++];
+  for(byte z = 0; z < zones; z++, n += 3)
+    printf("zone %d: %s, target %.2f C\n", z, p[n] < 5 ? modes[p[n]] : "?", get16(p + n + 1) / 100.0);
+  return 0;
+}
+
+static int settings()
+{
+  uint16_t from = 0;
+  for(;;)
+  {
+    byte offset[2] = { (byte)(from & 0xFF), (byte)(from >> 8) };
+    if(!request(LINK_SETTINGS, offset, 2))
+      return 1;
+    byte n = serial->length() - 2;
+    fwrite(serial->payload() + 2, 1, n, stdout);
+    from += n;
+    if(n < LINK_PAYLOAD_MAX - 2)
+      return 0;
+  }
+}
+
+static int watch(long seconds)
+{
+  byte on = 1;
+  if(!request(LINK_SUBSCRIBE, &on, 1))
+    return 1;
+  time_t end = time(NULL) + seconds;
+  while(!stop && (seconds <= 0 || time(NULL) < end))
+    if(next(200) && serial->type() == LINK_SAMPLE)
+      printSample(serial->payload(), serial->length());
+  on = 0;
+  stop = false;
+  return request(LINK_SUBSCRIBE, &on, 1) ? 0 : 1;
+}
+
+static int download(uint32_t from, uint32_t to, const char *dir)
+{
+  byte range[8];
+  put32(range, from);
+  put32(range + 4, to);
+  seq++;
+  serial->send(LINK_DOWNLOAD, seq, range, 8);
+
+  FILE *out = NULL;
+  std::string name;
+  uint32_t expect = 0;
+  unsigned long bytes = 0, gaps = 0;
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  int status = -1;
+  while(status < 0 && next(3000))
+  {
+    if(serial->seq() != seq)
+      continue;
+    const byte *p = serial->payload();
+    switch(serial->type())
+    {
+    case LINK_FILE:
+    {
+      if(out)
+        fclose(out);
+      std::string remote((const char *)p, serial->length());
+      size_t slash = remote.rfind('/');
+      name = std::string(dir) + "/" + remote.substr(slash == std::string::npos ? 0 : slash + 1);
+      out = fopen(name.c_str(), "wb");
+      if(!out)
+      {
+        perror(name.c_str());
+        return 1;
+      }
+      expect = (uint32_t)-1;
+      fprintf(stderr, "%s\n", name.c_str());
+      break;
+    }
+    case LINK_DATA:
+      if(!out)
+        break;
+      if(expect != (uint32_t)-1 && get32(p) != expect)
+        gaps++;
+      expect = get32(p) + serial->length() - 4;
+      fwrite(p + 4, 1, serial->length() - 4, out);
+      bytes += serial->length() - 4;
+      break;
+    case LINK_END:
+      status = p[0];
+      break;
+    }
+  }
+  if(out)
+    fclose(out);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double s = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  fprintf(stderr, "%lu bytes in %.1f s (%.0f B/s), %lu gaps, %lu bad frames\n",
+      bytes, s, bytes / s, gaps, serial->badFrames());
+  switch(status)
+  {
+  case LINK_END_DONE:
+    return gaps ? 1 : 0;
+  case LINK_END_EMPTY:
+    fprintf(stderr, "nothing logged in that range\n");
+    return 0;
+  case LINK_END_ERROR:
+    fprintf(stderr, "card error\n");
+    return 1;
+  case LINK_END_CANCELLED:
+    fprintf(stderr, "cancelled by another download\n");
+    return 1;
+  default:
+    fprintf(stderr, "download broke off\n");
+    return 1;
+  }
+}
+
+static int usage()
+{
+  fprintf(stderr,
+      "usage: beerctl [-b baud] <port> ping | status | settings | set <name>=<value> | store\n"
+      "                                | watch [seconds] | download <from> <to> [dir]\n");
+  return 2;
+}
+
+int main(int argc, char **argv)
+{
+  speed_t baud = B115200;
+  int arg = 1;
+  if(argc > 2 && !strcmp(argv[1], "-b"))
+  {
+    switch(atol(argv[2]))
+    {
+    case 9600: baud = B9600; break;
+    case 57600: baud = B57600; break;
+    case 115200: baud = B115200; break;
+    case 230400: baud = B230400; break;
+    case 460800: baud = B460800; break;
+    default: return usage();
+    }
+    arg = 3;
+  }
+  if(argc < arg + 2)
+    return usage();
+
+  int fd = open(argv[arg], O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if(fd < 0)
+  {
+    perror(argv[arg]);
+    return 1;
+  }
+  struct termios tio;
+  if(tcgetattr(fd, &tio) == 0)
+  {
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, baud);
+    cfsetospeed(&tio, baud);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+  PortStream stream(fd);
+  SerialLink serialLink(stream);
+  port = &stream;
+  serial = &serialLink;
+  signal(SIGINT, onSignal);
+
+  const char *command = argv[arg + 1];
+  char **rest = argv + arg + 2;
+  int more = argc - arg - 2;
+  if(!strcmp(command, "ping"))
+  {
+    if(!request(LINK_PING, NULL, 0))
+      return 1;
+    printf("protocol version %d\n", serial->payload()[0]);
+    return 0;
+  }
+  if(!strcmp(command, "status"))
+    return status();
+  if(!strcmp(command, "settings"))
+    return settings();
+  if(!strcmp(command, "set") && more == 1)
+  {
+    if(!request(LINK_SET, (const byte *)rest[0], strlen(rest[0])))
+      return 1;
+    printf("%s\n", serial->payload()[0] ? "applied" : "rejected");
+    return serial->payload()[0] ? 0 : 1;
+  }
+  if(!strcmp(command, "store"))
+    return request(LINK_STORE, NULL, 0) ? 0 : 1;
+  if(!strcmp(command, "watch"))
+    return watch(more > 0 ? atol(rest[0]) : 0);
+  if(!strcmp(command, "download") && more >= 2)
+  {
+    uint32_t from, to;
+    if(!parseTime(rest[0], &from) || !parseTime(rest[1], &to))
+      return usage();
+    return download(from, to, more > 2 ? rest[2] : ".");
+  }
+  return usage();
+}
@@ -0,0 +1,654 @@
+/*
+  bench.cpp - Benchmark suite for the host simulation build.
+  Runs the unmodified sketch against the stand-in libraries and reports, for
+  the scheduler, logging, settings, serial and UI paths:
+  - host time per call and calls per second (how expensive the code is)
+  - virtual time per call (how long the board would be busy, including the
+    modelled LCD, SD card and sensor bus times)
+  - virtual latency from an input to the matching screen update
+  and the throughput of the Base32 kernels.
+*/
+
+#include "BeerLogger.h"
+#include "Sim.h"
+#include <DallasTemperature.h>
+#include <time.h>
+#include <SD.h>
+#include <RTClib.h>
+#include "SerialLink.h"
+#include "Base32.h"
+#include <string>
+
+extern File logfile;
+extern RTC_DS1307 RTC;
+extern unsigned long samplesTaken;
+extern uint32_t sampleTime;
+extern volatile unsigned int screenPos;
+extern uint32_t logFileDate;
+extern byte logFilePart;
+extern unsigned long powerIdleMs, powerDownMs;
+extern DeviceAddress sensorAddress[];
+
+static DeviceAddress simTemp1 = { 0x28, 0xA2, 0x8C, 0x97, 0x05, 0x00, 0x00, 0x94 };
+static DeviceAddress simTemp2 = { 0x28, 0xFF, 0xA9, 0x02, 0x64, 0x14, 0x03, 0x81 };
+
+// Liquid: a slowly rising ferment. Air: a fridge cycling around it.
+static float liquidSource(unsigned long ms)
+{
+  return 18.0f + 2.0f * (float)ms / 86400000.0f;
+}
+
+static float airSource(unsigned long ms)
+{
+  return 17.0f + 1.5f * sinf((float)ms / 600000.0f);
+}
+
+static const char *settingsFile =
+    "[logInterval=10]\r\n[tempTarget=19.5]\r\n[tempRange=0.5]\r\n"
+    "[tempUndershoot=0.3]\r\n[tempOvershoot=0.2]\r\n[thermostatMode=C]\r\n";
+
+static double hostNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, long calls, double ns, unsigned long long simUs)
+{
+  printf("%-24s %8ld %12.0f %14.0f %12.3f\n", name, calls,
+      ns / calls, 1e9 * calls / ns, simUs / 1000.0 / calls);
+}
+
+static void header(const char *title)
+{
+  printf("\n%s\n", title);
+  printf("%-24s %8s %12s %14s %12s\n",
+      "", "calls", "host ns/call", "host calls/s", "sim ms/call");
+}
+
+// Run the scheduler for the given amount of virtual time
+static long runFor(unsigned long ms)
+{
+  long passes = 0;
+  unsigned long long end = simMicros() + 1000ULL * ms;
+  while(simMicros() < end)
+  {
+    loop();
+    passes++;
+  }
+  return passes;
+}
+
+static void benchScheduler(long iterations)
+{
+  header("Scheduler");
+
+  unsigned long long sim0 = simMicros();
+  double t0 = hostNs();
+  for(long n = 0; n < iterations; n++)
+    loop();
+  report("loop()", iterations, hostNs() - t0, simMicros() - sim0);
+
+  // Steady state over one virtual hour: how often does the sketch wake up
+  // and how many samples make it to the card
+  std::string before, after;
+  char name[20];
+  logFileName(name, logFileDate, logFilePart);
+  simSdReadFile(name, before);
+  sim0 = simMicros();
+  t0 = hostNs();
+  long passes = runFor(3600000UL);
+  double ns = hostNs() - t0;
+  simSdReadFile(name, after);
+  long lines = 0;
+  for(size_t n = before.size(); n < after.size(); n++)
+    if(after[n] == '\n') lines++;
+  printf("%-24s %8ld passes in %.0f s virtual (%.1f passes/s), %ld samples logged, %.0f ms host\n",
+      "1 h steady state", passes, (simMicros() - sim0) / 1e6,
+      passes / ((simMicros() - sim0) / 1e6), lines, ns / 1e6);
+
+  // Where that hour went, and what the MCU would draw for it, from the
+  // ATmega2560's typical supply currents at 16 MHz and 5 V. The board's
+  // regulator, USB chip and LCD come on top.
+  const char *modes[] = { "powerSave=0", "powerSave=1", "powerSave=2" };
+  for(int m = 0; m < 3; m++)
+  {
+    char value[2] = { (char)('0' + m), 0 };
+    settingApply("powerSave", value);
+    unsigned long idle0 = powerIdleMs, down0 = powerDownMs;
+    sim0 = simMicros();
+    runFor(3600000UL);
+    double total = (simMicros() - sim0) / 1000.0;
+    double idle = (powerIdleMs - idle0) / total, down = (powerDownMs - down0) / total;
+    double active = 1 - idle - down;
+    printf("%-24s %5.1f%% power down, %5.1f%% idle, %5.1f%% awake: MCU %.2f mA\n",
+        modes[m], 100 * down, 100 * idle, 100 * active,
+        active * 14.0 + idle * 4.0 + down * 0.015);
+  }
+#if DIAGNOSTICS
+  // What the sketch measured of itself over those hours, as it dumps it:
+  // time;name;runs;min us;mean us;max us;late;histogram from <64 us by x4
+  std::string diag;
+  simSdReadFile("LOG/DIAG.TXT", diag);
+  size_t dumped = diag.size();
+  diagDump();
+  simSdReadFile("LOG/DIAG.TXT", diag);
+  for(size_t n = dumped, eol; (eol = diag.find('\n', n)) != std::string::npos; n = eol + 1)
+    printf("  %s\n", diag.substr(n, eol - n - (diag[eol - 1] == '\r')).c_str());
+#endif
+}
+
+static void benchLogging(long iterations)
+{
+  header("Logging");
+
+  // A sample is taken in two steps: fpCycle() starts the conversion and
+  // fpReadSensors() picks up the result once it is done; here every sample
+  // makes a log row (fpLogRow()). Run it for both
+  // log formats; the periodic flushLog is included at its default rate.
+  const char *formats[] = { "T", "B" };
+  for(int f = 0; f < 2; f++)
+  {
+    settingApply("logFormat", formats[f]);
+    logfile.close();
+    logOpen();
+    printf("logFormat=%s\n", formats[f]);
+
+    unsigned long long simCycle = 0, simRead = 0;
+    double nsCycle = 0, nsRead = 0;
+    simSdResetStats();
+    for(long n = 0; n < iterations; n++)
+    {
+      unsigned long long sim0 = simMicros();
+      double t0 = hostNs();
+      fpCycle();
+      nsCycle += hostNs() - t0;
+      simCycle += simMicros() - sim0;
+      delay(750);
+      sim0 = simMicros();
+      t0 = hostNs();
+      fpReadSensors();
+      fpLogRow();
+      if(n % 6 == 5)
+        fpFlushLog();
+      nsRead += hostNs() - t0;
+      simRead += simMicros() - sim0;
+    }
+    SimSdStats sd = simSdStats();
+    report("fpCycle()", iterations, nsCycle, simCycle);
+    report("fpReadSensors()+LogRow", iterations, nsRead, simRead);
+    printf("%-24s %.3f block writes, %.2f flushes, %.1f bytes per sample\n", "",
+        (double)sd.blockWrites / iterations, (double)sd.flushes / iterations,
+        (double)sd.bytesWritten / iterations);
+  }
+  settingApply("logFormat", "T");
+  logfile.close();
+  logOpen();
+
+  // The newest row, with its journal slot in the EEPROM (older ones the
+  // card has are left out)
+  unsigned long long sim0 = simMicros();
+  unsigned long eeprom0 = simEepromWrites();
+  simSdResetStats();
+  double t0 = hostNs();
+  for(long n = 0; n < iterations; n++)
+    writeLog(0, sampleTime);
+  double ns = hostNs() - t0;
+  SimSdStats sd = simSdStats();
+  report("writeLog()", iterations, ns, simMicros() - sim0);
+  printf("%-24s %.1f bytes per record, %.1f EEPROM bytes written\n", "",
+      (double)sd.bytesWritten / iterations, (double)(simEepromWrites() - eeprom0) / iterations);
+
+  // Opening the log to append: a month of 10 s rows in one file, against
+  // today's rotated file; and finding where the rows from half an hour ago
+  // are through the index
+  long opens = iterations < 50 ? iterations : 50;
+  simSdWriteFile("month.txt", std::string(30L * 8640 * 26, 'x'));
+  sim0 = simMicros();
+  t0 = hostNs();
+  for(long n = 0; n < opens; n++)
+  {
+    File f = SD.open("month.txt", FILE_WRITE);
+    f.close();
+  }
+  report("open 1 month log", opens, hostNs() - t0, simMicros() - sim0);
+  SD.remove("month.txt");
+  sim0 = simMicros();
+  t0 = hostNs();
+  for(long n = 0; n < opens; n++)
+    logOpen();
+  report("logOpen() rotated", opens, hostNs() - t0, simMicros() - sim0);
+
+  char name[20];
+  uint32_t offset;
+  uint32_t when = RTC.now().unixtime() - 1800;
+  sim0 = simMicros();
+  t0 = hostNs();
+  for(long n = 0; n < opens; n++)
+    logIndexFind(when, name, &offset);
+  report("logIndexFind()", opens, hostNs() - t0, simMicros() - sim0);
+}
+
+// The host end of the serial link: what the logger sent is read from in,
+// what the host sends goes to the logger
+class HostStream : public Stream
+{
+  public:
+    std::string in;
+    size_t pos = 0;
+    virtual int available() { return in.size() - pos; }
+    virtual int read() { return pos < in.size() ? (uint8_t)in[pos++] : -1; }
+    virtual int peek() { return pos < in.size() ? (uint8_t)in[pos] : -1; }
+    virtual void flush() {}
+    virtual int availableForWrite() { return LINK_PAYLOAD_MAX + LINK_OVERHEAD; }
+    virtual size_t write(uint8_t c) { simSerialSend(std::string(1, (char)c)); return 1; }
+    virtual size_t write(const uint8_t *b, size_t n) { simSerialSend(std::string((const char *)b, n)); return n; }
+};
+
+// Ping until the logger answers, a try a second like beerctl. The pings
+// go out from the idle hook, while the sketch sleeps, as it mostly does:
+// if it is powered down, the first is lost. Virtual ms until the answer
+// is out.
+static SerialLink *wakeLink;
+static unsigned long long wakeSent;
+static byte wakeSeq;
+static bool wakeAnswered;
+
+static void wakeHook()
+{
+  if(!wakeAnswered && ((wakeSent == 0) || (simMicros() - wakeSent >= 1000000ULL)))
+  {
+    wakeLink->send(LINK_PING, ++wakeSeq, NULL, 0);
+    wakeSent = simMicros();
+  }
+}
+
+static double linkWake(SerialLink &link, HostStream &host)
+{
+  wakeLink = &link;
+  wakeSent = 0;
+  wakeSeq = 200;
+  wakeAnswered = false;
+  simSetIdleHook(wakeHook);
+  while(wakeSent == 0)
+    loop();
+  unsigned long long start = wakeSent;
+  while(!wakeAnswered && (wakeSeq < 210))
+  {
+    loop();
+    host.in += simSerialReceive();
+    while(link.receive())
+      if(link.seq() == wakeSeq)
+        wakeAnswered = true;
+  }
+  simSetIdleHook(NULL);
+  return wakeAnswered ? (simSerialStats().lastOutUs - start) / 1000.0 : -1;
+}
+
+static void benchSerial()
+{
+  header("Serial link");
+  HostStream host;
+  SerialLink link(host);
+
+  double ms = linkWake(link, host);
+  printf("%-24s %.0f ms virtual until answered, %lu bytes lost\n", "request while asleep",
+      ms, simSerialStats().rxLost);
+
+  // Request/reply round trip, until the last byte of the reply is out.
+  // The host only looks when loop() returns, which may be much later.
+  unsigned long long total = 0;
+  double t0 = hostNs();
+  long replies = 0;
+  for(long n = 0; n < 20; n++)
+  {
+    link.send(LINK_STATUS, n, NULL, 0);
+    unsigned long long sent = simMicros();
+    while(simMicros() - sent < 2000000ULL)
+    {
+      loop();
+      host.in += simSerialReceive();
+      if(link.receive())
+      {
+        total += simSerialStats().lastOutUs - sent;
+        replies++;
+        break;
+      }
+    }
+  }
+  if(replies == 0) replies = 1;
+  report("status round trip", replies, hostNs() - t0, total);
+
+  // Download everything (six more hours of it) while sampling, at 1 s,
+  // and control go on
+  runFor(6 * 3600000UL);
+  settingApply("sampleInterval", "1");
+  linkWake(link, host);
+  byte range[8];
+  for(int b = 0; b < 4; b++)
+  {
+    range[b] = 0;
+    range[4 + b] = 0xFF;
+  }
+  link.send(LINK_DOWNLOAD, 42, range, 8);
+  unsigned long samples0 = samplesTaken;
+  unsigned long long data = 0;
+  long files = 0, frames = 0;
+  int status = -1;
+  simSerialResetStats();
+  unsigned long long sim0 = simMicros();
+  t0 = hostNs();
+  while((status < 0) && (simMicros() - sim0 < 600000000ULL))
+  {
+    loop();
+    host.in += simSerialReceive();
+    while(link.receive())
+    {
+      frames++;
+      if(link.type() == LINK_FILE)
+        files++;
+      else if(link.type() == LINK_DATA)
+        data += link.length() - 4;
+      else if(link.type() == LINK_END)
+        status = link.payload()[0];
+    }
+  }
+  SimSerialStats st = simSerialStats();
+  double s = (st.lastOutUs - sim0) / 1e6;
+  printf("%-24s %llu bytes of %ld files in %.2f s virtual, %.0f B/s = %.0f%% of 115200 baud, %.0f ms host\n",
+      "log download", data, files, s, data / s, 100.0 * st.bytesOut / s / 11520, (hostNs() - t0) / 1e6);
+  printf("%-24s status %d, %ld frames, %lu bad, %lu samples taken meanwhile\n", "",
+      status, frames, link.badFrames(), samplesTaken - samples0);
+  settingApply("sampleInterval", "10");
+}
+
+static void benchSettings(long iterations)
+{
+  header("Settings");
+
+  unsigned long long sim0 = simMicros();
+  double t0 = hostNs();
+  for(long n = 0; n < iterations; n++)
+    fpSettingsLoad();
+  report("fpSettingsLoad()", iterations, hostNs() - t0, simMicros() - sim0);
+
+  sim0 = simMicros();
+  t0 = hostNs();
+  for(long n = 0; n < iterations; n++)
+    fpSettingsStore();
+  report("fpSettingsStore()", iterations, hostNs() - t0, simMicros() - sim0);
+
+  // Temperatures out of range are rejected, not wrapped into it
+  static const struct { const char *text; bool ok; int16_t centi; } temps[] = {
+    { "19.5", true, 1950 }, { "-100", true, -10000 }, { "200", true, 20000 },
+    { "300", false, 0 }, { "656", false, 0 }, { "700", false, 0 },
+    { "-700", false, 0 }, { "99999999999", false, 0 },
+  };
+  int wrong = 0;
+  for(unsigned n = 0; n < sizeof(temps) / sizeof(temps[0]); n++)
+  {
+    int16_t centi = 0;
+    bool ok = settingCenti(temps[n].text, centi);
+    if(ok != temps[n].ok || (ok && centi != temps[n].centi))
+    {
+      printf("settingCenti(\"%s\"): %s %d\n", temps[n].text, ok ? "accepted" : "rejected", centi);
+      wrong++;
+    }
+  }
+  printf("%-24s %d errors\n", "temperature range", wrong);
+}
+
+static void benchUi(long iterations)
+{
+  header("UI");
+
+  // Refresh of an unchanged screen, and of one that changes every time
+  // (scrolling between two samples)
+  for(int scroll = 0; scroll < 2; scroll++)
+  {
+    simLcdResetStats();
+    unsigned long long sim0 = simMicros();
+    double t0 = hostNs();
+    for(long n = 0; n < iterations; n++)
+    {
+      if(scroll)
+        screenPos = n & 1;
+      fpUpdateScreen();
+    }
+    double ns = hostNs() - t0;
+    SimLcdStats lcd = simLcdStats();
+    report(scroll ? "fpUpdateScreen() scroll" : "fpUpdateScreen() same", iterations, ns, simMicros() - sim0);
+    printf("%-24s %.1f LCD commands, %.1f chars per refresh\n", "",
+        (double)(lcd.commands + lcd.clears) / iterations, (double)lcd.chars / iterations);
+  }
+  screenPos = 0;
+  fpUpdateScreen();
+
+  // Latency from an encoder detent to the screen showing its effect. Inputs
+  // arrive at pseudo-random points of the loop period.
+  unsigned long long total = 0, worst = 0, best = ~0ULL;
+  unsigned long seed = 12345;
+  for(long n = 0; n < iterations; n++)
+  {
+    seed = seed * 1103515245UL + 12345UL;
+    simAdvance((seed >> 8) % 50000);
+    simTurnEncoder((n & 1) ? 1 : -1, 500);
+    unsigned long long tInput = simMicros();
+    simLcdResetStats();
+    SimLcdStats lcd = simLcdStats();
+    while(lcd.clears + lcd.commands + lcd.chars == 0 && simMicros() - tInput < 10000000ULL)
+    {
+      loop();
+      lcd = simLcdStats();
+    }
+    unsigned long long latency = (lcd.firstOpUs ? lcd.firstOpUs : simMicros()) - tInput;
+    total += latency;
+    if(latency > worst) worst = latency;
+    if(latency < best) best = latency;
+  }
+  printf("%-24s min %.1f ms, mean %.1f ms, max %.1f ms (virtual)\n",
+      "encoder -> screen", best / 1000.0, total / 1000.0 / iterations, worst / 1000.0);
+
+  // Scrolling back past the rows in RAM goes on with the log files on the
+  // card: one detent down at a time, from the first row shown from there
+  long detents = 0;
+  while(strncmp(simLcdLine(0), "SD", 2) != 0 && detents < 2000)
+  {
+    simTurnEncoder(-1);
+    runFor(20);
+    fpUpdateScreen();
+    detents++;
+  }
+  // Rows of the same second look the same and leave the screen alone;
+  // they are not counted
+  total = 0, worst = 0;
+  long rows = 0;
+  for(long n = 0; n < (iterations < 50 ? iterations : 50); n++)
+  {
+    simTurnEncoder(-1);
+    unsigned long long tInput = simMicros();
+    simLcdResetStats();
+    SimLcdStats lcd = simLcdStats();
+    while(lcd.clears + lcd.commands + lcd.chars == 0 && simMicros() - tInput < 1000000ULL)
+    {
+      loop();
+      lcd = simLcdStats();
+    }
+    if(!lcd.firstOpUs)
+      continue;
+    unsigned long long latency = lcd.firstOpUs - tInput;
+    total += latency;
+    if(latency > worst) worst = latency;
+    rows++;
+  }
+  if(rows == 0) rows = 1;
+  printf("%-24s mean %.1f ms, max %.1f ms (virtual), RAM rows end %ld detents back\n",
+      "encoder -> card row", total / 1000.0 / rows, worst / 1000.0, detents);
+}
+
+static void appendChars(const char *chars, byte length, void *context)
+{
+  ((std::string *)context)->append(chars, length);
+}
+
+static void appendBytes(const byte *data, byte length, void *context)
+{
+  ((std::string *)context)->append((const char *)data, length);
+}
+
+// RFC 4648 test vectors, then random data through both kernels; then the
+// speed of each on a 4 KB block
+static void benchBase32(long iterations)
+{
+  header("Base32");
+  static const char *vectors[][3] = {
+    { "f", "MY", "MY======" }, { "fo", "MZXQ", "MZXQ====" },
+    { "foo", "MZXW6", "MZXW6===" }, { "foob", "MZXW6YQ", "MZXW6YQ=" },
+    { "fooba", "MZXW6YTB", "MZXW6YTB" }, { "foobar", "MZXW6YTBOI", "MZXW6YTBOI======" }
+  };
+  char text[8192];
+  byte data[4096], back[4096];
+  long errors = 0;
+  for(int v = 0; v < 6; v++)
+  {
+    long n = strlen(vectors[v][0]);
+    for(int pad = 0; pad < 2; pad++)
+    {
+      long len = Base32::encode((const byte *)vectors[v][0], n, text, pad);
+      if(len != Base32::encodedLength(n, pad) || strncmp(text, vectors[v][1 + pad], len))
+        errors++;
+      if(Base32::decode(vectors[v][1 + pad], strlen(vectors[v][1 + pad]), back) != n
+          || memcmp(back, vectors[v][0], n))
+        errors++;
+    }
+  }
+  if(Base32::decode("mzxw 6ytb\r\noi", 13, back) != 6 || memcmp(back, "foobar", 6)
+      || Base32::decode("MZX!", 4, back) != -1)
+    errors++;
+
+  srand(1);
+  for(int b = 0; b < 4096; b++)
+    data[b] = rand();
+  for(int simd = 0; simd < 2; simd++)
+  {
+#ifdef BASE32_SIMD
+    Base32::useSimd = simd;
+#endif
+    for(long n = 0; n < 200; n++)
+    {
+      long len = rand() % 4096;
+      long chars = Base32::encode(data, len, text, n & 1);
+      if(chars != Base32::encodedLength(len, n & 1) || Base32::decode(text, chars, back) != len
+          || memcmp(back, data, len))
+        errors++;
+    }
+  }
+  printf("%-24s %ld errors\n", "round trips", errors);
+
+  const char *kernels[] = { "tables", "SSSE3" };
+  long chars = Base32::encodedLength(sizeof(data));
+  for(int simd = 0; simd < 2; simd++)
+  {
+#ifdef BASE32_SIMD
+    Base32::useSimd = simd;
+#else
+    if(simd)
+      break;
+#endif
+    double t0 = hostNs();
+    for(long n = 0; n < iterations; n++)
+      Base32::encode(data, sizeof(data), text);
+    double enc = hostNs() - t0;
+    t0 = hostNs();
+    for(long n = 0; n < iterations; n++)
+      Base32::decode(text, chars, back);
+    double dec = hostNs() - t0;
+    printf("%-24s encode %7.0f MB/s, decode %7.0f MB/s (of bytes)\n", kernels[simd],
+        1e3 * sizeof(data) * iterations / enc, 1e3 * sizeof(data) * iterations / dec);
+  }
+#ifdef BASE32_SIMD
+  Base32::useSimd = true;
+#endif
+
+  // Streams: pieces of random size must give what the whole buffer gives
+  std::string streamed, decoded;
+  Base32Encoder encoder(appendChars, &streamed);
+  Base32Decoder decoder(appendBytes, &decoded);
+  errors = 0;
+  for(long n = 0; n < 200; n++)
+  {
+    long len = rand() % 4096;
+    streamed.clear();
+    decoded.clear();
+    for(long done = 0; done < len; )
+    {
+      long piece = rand() % 23;
+      if(piece > len - done)
+        piece = len - done;
+      encoder.write(data + done, piece);
+      done += piece;
+    }
+    long chars = encoder.finish(n & 1);
+    long whole = Base32::encode(data, len, text, n & 1);
+    if(chars != whole || streamed != std::string(text, whole))
+      errors++;
+    for(long done = 0; done < chars; done += 7)
+      decoder.write(streamed.data() + done, chars - done < 7 ? chars - done : 7);
+    if(decoder.finish() != len || decoded != std::string((const char *)data, len))
+      errors++;
+  }
+  printf("%-24s %ld errors\n", "stream round trips", errors);
+
+  // The day's log file from the card in 512 byte reads, through both
+  char name[20];
+  logFileName(name, logFileDate, logFilePart);
+  std::string file;
+  simSdReadFile(name, file);
+  streamed.clear();
+  decoded.clear();
+  unsigned long long sim0 = simMicros();
+  double t0 = hostNs();
+  File f = SD.open(name);
+  int n;
+  while((n = f.read(data, 512)) > 0)
+    encoder.write(data, n);
+  f.close();
+  encoder.finish();
+  decoder.write(streamed.data(), streamed.size());
+  decoder.finish();
+  printf("%-24s %lu bytes -> %lu chars in %.0f ms virtual, %.2f ms host; %s; %u bytes of state\n",
+      "log file stream", (unsigned long)file.size(), (unsigned long)streamed.size(),
+      (simMicros() - sim0) / 1000.0, (hostNs() - t0) / 1e6, decoded == file ? "same back" : "DIFFERENT",
+      (unsigned)(sizeof(Base32Encoder) + sizeof(Base32Decoder)));
+}
+
+int main(int argc, char **argv)
+{
+  long iterations = 1000;
+  if(argc > 1) iterations = atol(argv[1]);
+  if(iterations < 1) iterations = 1;
+
+  simAddSensor(simTemp1, liquidSource);
+  simAddSensor(simTemp2, airSource);
+  simSdFormat();
+  simSdWriteFile("settings.txt", settingsFile);
+
+  setup();
+  // Let the startup schedule mount the card and take the first samples
+  runFor(5000);
+
+  printf("BeerLogger host benchmark, %ld iterations per test\n", iterations);
+  // The settings have no sensorN=: the probes must be on the channels the
+  // zones' defaults expect, air on 0 and liquid on 1
+  bool channels = !memcmp(sensorAddress[0], simTemp2, sizeof(DeviceAddress)) &&
+      !memcmp(sensorAddress[1], simTemp1, sizeof(DeviceAddress));
+  printf("default sensor channels  %s\n", channels ? "air 0, liquid 1" : "WRONG");
+  benchScheduler(iterations);
+  benchLogging(iterations);
+  benchSettings(iterations);
+  benchSerial();
+  benchBase32(iterations);
+  benchUi(iterations < 200 ? iterations : 200);
+  return 0;
+}
@@ -0,0 +1,72 @@
+/*
+  logdecode.cpp - Turn a binary log (log.bin) into the text log format.
+
+  usage: logdecode [log.bin] > log.txt
+
+  Record layout (see writeLogBinary() in BeerLogger.cpp), little endian:
+  byte 0: record length; bit 7 set: per sensor mean, min and max
+  byte 1-4: unixtime
+  then per sensor: temperature in 1/100 degC, int16 (or three of them)
+  then relay state
+  last byte: Dallas CRC8 over all bytes before it
+
+  Output is one "unixtime;t1;t2;...;relay" line per record, like the text
+  log. Records with a bad CRC are skipped and reported on stderr; the
+  decoder then resynchronises one byte further on.
+*/
+
+#include "OneWire.h"
+#include <vector>
+
+int main(int argc, char **argv)
+{
+  FILE *in = stdin;
+  if(argc > 1)
+  {
+    in = fopen(argv[1], "rb");
+    if(in == NULL)
+    {
+      perror(argv[1]);
+      return 1;
+    }
+  }
+
+  std::vector<uint8_t> data;
+  uint8_t buf[4096];
+  size_t n;
+  while((n = fread(buf, 1, sizeof(buf), in)) > 0)
+    data.insert(data.end(), buf, buf + n);
+
+  long records = 0, bad = 0;
+  size_t pos = 0;
+  while(pos < data.size())
+  {
+    uint8_t len = data[pos] & 0x7F;
+    int perSensor = (data[pos] & 0x80) ? 3 : 1;
+    // Smallest record: no sensors at all
+    if(len < 7 || pos + len > data.size() || (len - 7) % (2 * perSensor) != 0 ||
+        OneWire::crc8(&data[pos], len - 1) != data[pos + len - 1])
+    {
+      bad++;
+      pos++;
+      continue;
+    }
+
+    const uint8_t *r = &data[pos];
+    uint32_t t = r[1] | (r[2] << 8) | ((uint32_t)r[3] << 16) | ((uint32_t)r[4] << 24);
+    printf("%lu", (unsigned long)t);
+    int values = (len - 7) / 2;
+    for(int s = 0; s < values; s++)
+    {
+      int16_t centi = (int16_t)(r[5 + 2 * s] | (r[6 + 2 * s] << 8));
+      printf(";%s%d.%02d", centi < 0 ? "-" : "", abs(centi) / 100, abs(centi) % 100);
+    }
+    printf(";%d\r\n", r[5 + 2 * values]);
+    records++;
+    pos += len;
+  }
+
+  if(bad > 0)
+    fprintf(stderr, "%ld records, skipped %ld bad bytes\n", records, bad);
+  return 0;
+}
@@ -0,0 +1,431 @@
+/*
+  powercut.cpp - Cut the simulated logger's power at random times, over and
+  over, and check the log it leaves on the card.
+
+  usage: powercut [cuts] [seed]
+
+  For the text and then the binary log format: boots the sketch on a fresh
+  card with two simulated sensors, cuts its power 30 s to 10 min later
+  (simSdPowerCut() keeps of the card what a cut would), boots it again with
+  what is left on the card and in the EEPROM after up to an hour off, and so
+  on; the last boot runs for 10 min and flushes the log. Each boot runs in
+  a child process forked from this one, so that it starts with the
+  sketch's globals as on power up.
+  Then reads the log files and the index as the card has them and reports
+  the rows against the ones the logger took: all that were in its EEPROM
+  journal after some boot. Exits with 1 if a row is lost or out of order,
+  or there is anything but a torn row at the end of a file.
+*/
+
+#include "BeerLogger.h"
+#include "Sim.h"
+#include <DallasTemperature.h>
+#include <EEPROM.h>
+#include <RTClib.h>
+#include <SD.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern RTC_DS1307 RTC;
+extern File logfile;
+
+// Journal slot layout, see journalAdd() in BeerLogger.cpp
+#define SENSOR_MAX 4
+#define JOURNAL_SLOT_SIZE (10 + 2 * SENSOR_MAX)
+#define JOURNAL_SLOTS ((E2END + 1) / JOURNAL_SLOT_SIZE)
+
+static DeviceAddress simTemp1 = { 0x28, 0xA2, 0x8C, 0x97, 0x05, 0x00, 0x00, 0x94 };
+static DeviceAddress simTemp2 = { 0x28, 0xFF, 0xA9, 0x02, 0x64, 0x14, 0x03, 0x81 };
+
+static float liquidSource(unsigned long ms)
+{
+  return 18.0f + 2.0f * (float)ms / 86400000.0f;
+}
+
+static float airSource(unsigned long ms)
+{
+  return 17.0f + 1.5f * sinf((float)ms / 600000.0f);
+}
+
+// Small parts, for the cuts to catch rotations too
+static const char *settingsText =
+    "[logInterval=10]\r\n[logFlush=60]\r\n[logRotateKB=16]\r\n"
+    "[sensor0=28FFA90264140381]\r\n[sensor1=28A28C9705000094]\r\n";
+static const char *settingsBinary =
+    "[logInterval=10]\r\n[logFlush=60]\r\n[logRotateKB=16]\r\n[logFormat=B]\r\n[logMinMax=1]\r\n"
+    "[sensor0=28FFA90264140381]\r\n[sensor1=28A28C9705000094]\r\n";
+
+/// Child: one boot
+
+static int reportFd;
+
+static void put32(std::string &out, uint32_t v)
+{
+  for(int b = 0; b < 4; b++)
+    out += (char)((v >> (8 * b)) & 0xFF);
+}
+
+static uint32_t get32(const std::string &in, size_t pos)
+{
+  uint32_t v = 0;
+  for(int b = 0; b < 4 && pos + b < in.size(); b++)
+    v |= (uint32_t)(uint8_t)in[pos + b] << (8 * b);
+  return v;
+}
+
+// To the parent: the clock, the card and the EEPROM
+static void report()
+{
+  std::string out;
+  std::string card = simSdImage();
+  std::string eeprom = simEepromImage();
+  put32(out, RTC.now().unixtime());
+  put32(out, card.size());
+  out += card;
+  put32(out, eeprom.size());
+  out += eeprom;
+  for(size_t done = 0; done < out.size(); )
+  {
+    ssize_t n = write(reportFd, out.data() + done, out.size() - done);
+    if(n <= 0)
+      break;
+    done += n;
+  }
+  close(reportFd);
+}
+
+static void powerCut()
+{
+  simSdPowerCut();
+  report();
+  _exit(0);
+}
+
+static void boot(const std::string &card, const std::string &eeprom,
+    const char *settings, uint32_t now, unsigned long runMs, bool cut)
+{
+  simAddSensor(simTemp1, liquidSource);
+  simAddSensor(simTemp2, airSource);
+  if(card.empty())
+  {
+    simSdFormat();
+    simSdWriteFile("settings.txt", settings);
+  }
+  else
+  {
+    simSdLoadImage(card);
+    simEepromLoad(eeprom);
+  }
+  simRtcSet(now);
+  unsigned long long end = simMicros() + 1000ULL * runMs;
+  if(cut)
+    simSetPowerCut(end, powerCut);
+  setup();
+  while(simMicros() < end)
+    loop();
+  logfile.flush();
+  report();
+  _exit(0);
+}
+
+/// Parent: the boots, then the check
+
+struct Run
+{
+  uint32_t start, end; // RTC
+};
+
+// Times of the rows in the journal
+typedef std::set<uint32_t> Taken;
+
+struct Row
+{
+  uint32_t time;
+  uint32_t offset;
+};
+
+struct LogFile
+{
+  std::vector<Row> rows;
+  uint32_t validEnd; // where the valid rows stop
+  uint32_t size;
+};
+
+// Text rows: unixtime;value;...;relays\r\n with values=2 or 6
+static size_t parseText(const std::string &data, size_t pos, int values, uint32_t *time)
+{
+  size_t end = data.find('\n', pos);
+  if(end == std::string::npos)
+    return 0;
+  std::string line = data.substr(pos, end + 1 - pos);
+  char *p = (char *)line.c_str();
+  char *q;
+  *time = strtoul(p, &q, 10);
+  if(q == p || *q != ';')
+    return 0;
+  p = q + 1;
+  for(int v = 0; v < values; v++)
+  {
+    strtod(p, &q);
+    if(q == p || *q != ';' || !strchr(p, '.') || strchr(p, '.') > q)
+      return 0;
+    p = q + 1;
+  }
+  strtoul(p, &q, 10);
+  if(q == p || strcmp(q, "\r\n") != 0)
+    return 0;
+  return line.size();
+}
+
+static size_t parseBinary(const std::string &data, size_t pos, int values, uint32_t *time)
+{
+  size_t length = 7 + 2 * values;
+  if(pos + length > data.size())
+    return 0;
+  const uint8_t *r = (const uint8_t *)data.data() + pos;
+  if((r[0] & 0x7F) != length || OneWire::crc8(r, length - 1) != r[length - 1])
+    return 0;
+  *time = get32(data, pos + 1);
+  return length;
+}
+
+static std::map<std::string, std::string> files(const std::string &image)
+{
+  std::map<std::string, std::string> out;
+  size_t pos = 0;
+  while(pos + 9 <= image.size())
+  {
+    uint32_t n = get32(image, pos);
+    std::string path = image.substr(pos + 4, n);
+    pos += 4 + n;
+    bool dir = image[pos] != 0;
+    uint32_t size = get32(image, pos + 1);
+    pos += 5;
+    if(!dir)
+      out[path] = image.substr(pos, size);
+    pos += size;
+  }
+  return out;
+}
+
+// LOG/YYYYMMDD.TXT sorts after its parts .T01...; part 0 first
+static std::string sortKey(const std::string &path)
+{
+  std::string ext = path.substr(path.size() - 3);
+  if(ext == "TXT" || ext == "BIN")
+    return path.substr(0, path.size() - 3) + "00";
+  return path.substr(0, path.size() - 3) + ext.substr(1);
+}
+
+static void journal(const std::string &eeprom, Taken &taken)
+{
+  for(int n = 0; n < JOURNAL_SLOTS; n++)
+  {
+    size_t pos = n * JOURNAL_SLOT_SIZE;
+    const uint8_t *slot = (const uint8_t *)eeprom.data() + pos;
+    uint32_t seq = get32(eeprom, pos);
+    uint32_t time = get32(eeprom, pos + 4);
+    if(OneWire::crc8(slot, JOURNAL_SLOT_SIZE - 1) == slot[JOURNAL_SLOT_SIZE - 1] &&
+        time != 0 && seq % JOURNAL_SLOTS == (uint32_t)n)
+      taken.insert(time);
+  }
+}
+
+static int check(const char *title, const std::string &image, bool binary,
+    const std::vector<Run> &runs, const Taken &taken)
+{
+  std::map<std::string, std::string> card = files(image);
+  std::map<std::string, LogFile> logs;
+  std::map<std::string, std::string> order;
+  int values = binary ? 6 : 2;
+  const char *ext = binary ? "B" : "T";
+  unsigned long valid = 0, torn = 0, tornBytes = 0, late = 0, duplicate = 0;
+  std::map<uint32_t, int> seen;
+
+  std::map<std::string, std::string>::iterator f;
+  for(f = card.begin(); f != card.end(); ++f)
+    if(f->first.compare(0, 4, "LOG/") == 0 && f->first.size() == 16 &&
+        f->first.compare(13, 1, ext) == 0)
+      order[sortKey(f->first)] = f->first;
+
+  uint32_t last = 0;
+  std::map<std::string, std::string>::iterator o;
+  for(o = order.begin(); o != order.end(); ++o)
+  {
+    const std::string &data = card[o->second];
+    LogFile &log = logs[o->second];
+    size_t pos = 0;
+    uint32_t t;
+    size_t n;
+    // the header line of a text file (see logHeader())
+    if(!binary && data.compare(0, 1, "#") == 0 && data.find('\n') != std::string::npos)
+      pos = data.find('\n') + 1;
+    while(pos < data.size() &&
+        (n = binary ? parseBinary(data, pos, values, &t) : parseText(data, pos, values, &t)) > 0)
+    {
+      Row row = { t, (uint32_t)pos };
+      log.rows.push_back(row);
+      if(t <= last)
+        late++;
+      last = t;
+      if(seen[t]++)
+        duplicate++;
+      valid++;
+      pos += n;
+    }
+    log.validEnd = pos;
+    log.size = data.size();
+    if(pos < data.size())
+    {
+      torn++;
+      tornBytes += data.size() - pos;
+    }
+  }
+
+  // Index: entries in time order, each at a row or the end of the rows
+  const std::string &index = card["LOG/INDEX.BIN"];
+  unsigned long entries = 0, holes = 0, unordered = 0, pastRows = 0, wrong = 0;
+  uint32_t lastEntry = 0;
+  for(size_t pos = 0; pos + 16 <= index.size(); pos += 16)
+  {
+    const uint8_t *e = (const uint8_t *)index.data() + pos;
+    if(OneWire::crc8(e, 15) != e[15])
+    {
+      holes++;
+      continue;
+    }
+    entries++;
+    uint32_t t = get32(index, pos);
+    if(t < lastEntry)
+      unordered++;
+    lastEntry = t;
+    if((e[13] == 1) != binary)
+      continue;
+    char name[20];
+    if(e[12] == 0)
+      sprintf(name, "LOG/%08lu.%s", (unsigned long)get32(index, pos + 4), binary ? "BIN" : "TXT");
+    else
+      sprintf(name, "LOG/%08lu.%c%02d", (unsigned long)get32(index, pos + 4), ext[0], e[12]);
+    if(!logs.count(name))
+    {
+      wrong++;
+      continue;
+    }
+    LogFile &log = logs[name];
+    uint32_t offset = get32(index, pos + 8);
+    if(offset > log.validEnd)
+    {
+      pastRows++;
+      continue;
+    }
+    bool at = (offset == log.validEnd);
+    for(size_t r = 0; r < log.rows.size() && !at; r++)
+      if(log.rows[r].offset == offset)
+        at = (log.rows[r].time >= t);
+    if(!at)
+      wrong++;
+  }
+
+  unsigned long lost = 0, extra = 0;
+  for(Taken::const_iterator r = taken.begin(); r != taken.end(); ++r)
+    if(!seen.count(*r))
+      lost++;
+  std::map<uint32_t, int>::iterator s;
+  for(s = seen.begin(); s != seen.end(); ++s)
+    if(!taken.count(s->first))
+      extra++;
+
+  printf("\n%s: %zu boots, %zu rows taken\n", title, runs.size(), taken.size());
+  printf("  %-34s %8zu\n", "log files", order.size());
+  printf("  %-34s %8lu\n", "valid rows", valid);
+  printf("  %-34s %8lu\n", "rows lost", lost);
+  printf("  %-34s %8lu\n", "rows not taken", extra);
+  printf("  %-34s %8lu\n", "duplicate rows", duplicate);
+  printf("  %-34s %8lu\n", "rows out of order", late);
+  printf("  %-34s %8lu\n", "torn file ends", torn);
+  printf("  %-34s %8lu\n", "bytes in torn ends", tornBytes);
+  printf("  %-34s %8lu\n", "index entries", entries);
+  printf("  %-34s %8lu\n", "index holes", holes);
+  printf("  %-34s %8lu\n", "index entries out of order", unordered);
+  printf("  %-34s %8lu\n", "index entries into torn ends", pastRows);
+  printf("  %-34s %8lu\n", "index entries not at a row", wrong);
+  return (lost || extra || duplicate || late || unordered || wrong) ? 1 : 0;
+}
+
+static bool readAll(int fd, std::string &out)
+{
+  char buf[65536];
+  ssize_t n;
+  while((n = read(fd, buf, sizeof(buf))) > 0)
+    out.append(buf, n);
+  return n == 0;
+}
+
+static int cycle(const char *title, const char *settings, bool binary, int cuts, unsigned seed)
+{
+  std::string card, eeprom;
+  std::vector<Run> runs;
+  Taken taken;
+  uint32_t now = 1451606400 + 86400 - 1800; // over midnight early on
+  srand(seed);
+
+  for(int b = 0; b <= cuts; b++)
+  {
+    bool cut = (b < cuts);
+    unsigned long runMs = cut ? 30000 + rand() % 570000 : 600000;
+    unsigned childSeed = rand();
+    int fd[2];
+    if(pipe(fd) < 0)
+    {
+      perror("pipe");
+      return 1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+      close(fd[0]);
+      reportFd = fd[1];
+      srand(childSeed);
+      boot(card, eeprom, settings, now, runMs, cut);
+    }
+    close(fd[1]);
+    std::string in;
+    readAll(fd[0], in);
+    close(fd[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if(in.size() < 8)
+    {
+      fprintf(stderr, "boot %d: no report\n", b);
+      return 1;
+    }
+    Run run;
+    run.start = now;
+    run.end = get32(in, 0);
+    runs.push_back(run);
+    uint32_t n = get32(in, 4);
+    card = in.substr(8, n);
+    eeprom = in.substr(12 + n, get32(in, 8 + n));
+    journal(eeprom, taken);
+    now = run.end + 1 + rand() % 3600;
+  }
+  return check(title, card, binary, runs, taken);
+}
+
+int main(int argc, char **argv)
+{
+  int cuts = (argc > 1) ? atoi(argv[1]) : 50;
+  unsigned seed = (argc > 2) ? strtoul(argv[2], NULL, 10) : 1;
+  if(cuts < 0) cuts = 0;
+
+  printf("BeerLogger power cuts, %d cuts, seed %u\n", cuts, seed);
+  int failed = cycle("text log", settingsText, false, cuts, seed);
+  failed |= cycle("binary log", settingsBinary, true, cuts, seed);
+  printf("\n%s\n", failed ? "FAILED" : "ok");
+  return failed;
+}
@@ -0,0 +1,101 @@
+/*
+  simtty.cpp - Run the simulated logger with its serial port on a
+  pseudo-terminal, for beerctl or any other serial program to talk to.
+
+  usage: simtty [speed]
+
+  Prints the terminal's name, then runs the sketch with two simulated
+  sensors and a fresh card. Virtual time goes speed times as fast as real
+  time (default 1); the serial line keeps its modelled 115200 baud in
+  virtual time. Above 1, the logger only idles and never powers down.
+*/
+
+#include "BeerLogger.h"
+#include "Sim.h"
+#include <DallasTemperature.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+static DeviceAddress simTemp1 = { 0x28, 0xA2, 0x8C, 0x97, 0x05, 0x00, 0x00, 0x94 };
+static DeviceAddress simTemp2 = { 0x28, 0xFF, 0xA9, 0x02, 0x64, 0x14, 0x03, 0x81 };
+
+static float liquidSource(unsigned long ms)
+{
+  return 18.0f + 2.0f * (float)ms / 86400000.0f;
+}
+
+static float airSource(unsigned long ms)
+{
+  return 17.0f + 1.5f * sinf((float)ms / 600000.0f);
+}
+
+static int master;
+static double speed = 1.0;
+static double real0;
+static unsigned long long sim0;
+
+static double realSeconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// While the sketch waits: keep virtual time from running ahead of real
+// time, and move the bytes between the terminal and Serial
+static void idle()
+{
+  double ahead = (simMicros() - sim0) / 1e6 / speed - (realSeconds() - real0);
+  if(ahead > 0.001)
+    usleep(ahead * 1e6);
+
+  char buf[256];
+  ssize_t n = read(master, buf, sizeof(buf));
+  if(n > 0)
+    simSerialSend(std::string(buf, n));
+  std::string out = simSerialReceive();
+  if(!out.empty() && write(master, out.data(), out.size()) < 0)
+    perror("write");
+}
+
+int main(int argc, char **argv)
+{
+  if(argc > 1) speed = atof(argv[1]);
+  if(speed <= 0) speed = 1.0;
+
+  master = posix_openpt(O_RDWR | O_NOCTTY);
+  if(master < 0 || grantpt(master) < 0 || unlockpt(master) < 0)
+  {
+    perror("pseudo-terminal");
+    return 1;
+  }
+  // Keep the far end open and raw, so that it neither echoes nor hangs up
+  // between two clients
+  int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+  struct termios tio;
+  tcgetattr(slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+  fcntl(master, F_SETFL, O_NONBLOCK);
+  printf("%s\n", ptsname(master));
+  fflush(stdout);
+
+  simAddSensor(simTemp1, liquidSource);
+  simAddSensor(simTemp2, airSource);
+  simSdFormat();
+  // Sped up, the logger's serial quiet time before it powers down again
+  // (which loses a request) would be over before beerctl tries again
+  std::string settings = "[sensor0=28FFA90264140381]\r\n[sensor1=28A28C9705000094]\r\n";
+  if(speed > 1)
+    settings += "[powerSave=1]\r\n";
+  simSdWriteFile("settings.txt", settings);
+  setup();
+
+  real0 = realSeconds();
+  sim0 = simMicros();
+  simSetIdleHook(idle);
+  for(;;)
+    loop();
+}